@@ -26,6 +26,7 @@
 #include <autodefs.h>
 
 #include <sys/types.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <time.h>
@@ -74,6 +75,10 @@ typedef unsigned int uint;
 #define ZERODELAY       0x2000
 
 extern int DFlags;
+#define FSYNC_NONE   0
+#define FSYNC_FULL   1
+#define FSYNC_BATCH  2
+
 extern int UseFSync;
 extern char FieldDelimiter;
 
@@ -82,6 +87,9 @@ extern char Hostname[256];
 extern const char *Home;
 
 extern int BufferLimit;
+extern int BufferLimitMin;
+extern int ParallelChannels;
+extern int MaxConnections;
 
 extern int new_total[2], new_done[2];
 extern int flags_total[2], flags_done[2];
@@ -119,6 +127,19 @@ int starts_with( const char *str, int strl, const char *cmp, int cmpl );
 int starts_with_upper( const char *str, int strl, const char *cmp, int cmpl );
 int equals( const char *str, int strl, const char *cmp, int cmpl );
 
+/* Drop all CRs, and prefix each LF with a CR if crlf is set.
+ * The output buffer needs to be twice as big as the input. */
+int convert_line_ends( char *out, const char *in, int len, int crlf );
+
+/* Find the named field (given in upper case) in a message header and
+ * return its value (including continuation lines) without surrounding
+ * whitespace, or null. */
+const char *find_header( const char *hdr, int len, const char *name, int nlen, int *vlen );
+/* Return a copy of the Message-ID from a message header, or null. */
+char *find_msgid( const char *hdr, int len );
+/* Hash the Date, From, and Subject fields of a message header. */
+uint hash_header( const char *hdr, int len );
+
 #ifndef HAVE_TIMEGM
 time_t timegm( struct tm *tm );
 #endif
@@ -133,6 +154,27 @@ int ATTR_PRINTFLIKE(2, 3) nfasprintf( char **str, const char *fmt, ... );
 int ATTR_PRINTFLIKE(3, 4) nfsnprintf( char *buf, int blen, const char *fmt, ... );
 void ATTR_NORETURN oob( void );
 
+/* An arena for objects of one size. The objects are carved from big blocks,
+ * and freed objects are recycled, but the blocks are released only as a whole. */
+typedef union arena_blk {
+	union arena_blk *next;
+	double align_d;
+	long align_l;
+} arena_blk_t;
+
+typedef struct {
+	arena_blk_t *blks;
+	char *ptr, *end;
+	void *free_objs;
+	uint obj_size, blk_size;
+	uint nobjs, max_objs, nblks, nbytes;
+} arena_t;
+
+void arena_init( arena_t *arena, uint obj_size );
+void *arena_alloc( arena_t *arena );
+void arena_free( arena_t *arena, void *obj );
+void arena_release( arena_t *arena );
+
 char *expand_strdup( const char *s );
 
 int map_name( const char *arg, char **result, int reserve, const char *in, const char *out );
@@ -178,6 +220,9 @@ typedef struct {
 	time_t timeout;
 } wakeup_t;
 
+/* Get a time stamp in milliseconds, for measuring short intervals. */
+uint get_msecs( void );
+
 void init_wakeup( wakeup_t *tmr, void (*cb)( void * ), void *aux );
 void conf_wakeup( wakeup_t *tmr, int timeout );
 void wipe_wakeup( wakeup_t *tmr );
@@ -185,4 +230,9 @@ static INLINE int pending_wakeup( wakeup_t *tmr ) { return tmr->links.next != 0;
 
 void main_loop( void );
 
+/* Forced flushes with FSync Batch. All queued descriptors are synced before
+ * the first callback is invoked. Without callback, fd is synced only once. */
+void defer_fsync( int fd, void (*cb)( int err, void *aux ), void *aux );
+void flush_fsyncs( void );
+
 #endif
@@ -200,10 +200,46 @@ getopt_helper( conffile_t *cfile, int *cops, channel_conf_t *conf )
 		conf->ops[M] |= XOP_HAVE_TYPE;
 	} else if (!strcasecmp( "SyncState", cfile->cmd ))
 		conf->sync_state = expand_strdup( cfile->val );
-	else if (!strcasecmp( "CopyArrivalDate", cfile->cmd ))
+	else if (!strcasecmp( "SyncStateFormat", cfile->cmd )) {
+		if (!strcasecmp( "Text", cfile->val ))
+			conf->state_format = STATE_TEXT;
+		else if (!strcasecmp( "Binary", cfile->val ))
+			conf->state_format = STATE_BINARY;
+		else {
+			error( "%s:%d: invalid SyncStateFormat arg '%s'\n",
+			       cfile->file, cfile->line, cfile->val );
+			cfile->err = 1;
+		}
+	} else if (!strcasecmp( "SyncStateDelta", cfile->cmd )) {
+		conf->state_delta = parse_int( cfile );
+		if (conf->state_delta < 0) {
+			error( "%s:%d: SyncStateDelta must not be negative\n", cfile->file, cfile->line );
+			cfile->err = 1;
+		}
+	} else if (!strcasecmp( "CopyArrivalDate", cfile->cmd ))
 		conf->use_internal_date = parse_bool( cfile );
+	else if (!strcasecmp( "DetectMoves", cfile->cmd ))
+		conf->detect_moves = parse_bool( cfile );
+	else if (!strcasecmp( "LinkDuplicates", cfile->cmd ))
+		conf->link_dups = parse_bool( cfile );
+	else if (!strcasecmp( "RecoverState", cfile->cmd ))
+		conf->recover_state = parse_bool( cfile );
 	else if (!strcasecmp( "MaxMessages", cfile->cmd ))
 		conf->max_messages = parse_int( cfile );
+	else if (!strcasecmp( "MaxAge", cfile->cmd )) {
+		conf->max_age = parse_int( cfile );
+		if (conf->max_age < 0) {
+			error( "%s:%d: MaxAge must not be negative\n", cfile->file, cfile->line );
+			cfile->err = 1;
+		}
+	}
+	else if (!strcasecmp( "ParallelBoxes", cfile->cmd )) {
+		conf->parallel_boxes = parse_int( cfile );
+		if (conf->parallel_boxes < 1) {
+			error( "%s:%d: ParallelBoxes must be positive\n", cfile->file, cfile->line );
+			cfile->err = 1;
+		}
+	}
 	else if (!strcasecmp( "ExpireUnread", cfile->cmd ))
 		conf->expire_unread = parse_bool( cfile );
 	else {
@@ -346,6 +382,7 @@ load_config( const char *where, int pseudo )
 
 	gcops = 0;
 	global_conf.expire_unread = -1;
+	global_conf.parallel_boxes = 1;
   reloop:
 	while (getcline( &cfile )) {
 		if (!cfile.cmd)
@@ -366,8 +403,15 @@ load_config( const char *where, int pseudo )
 			channel = nfcalloc( sizeof(*channel) );
 			channel->name = nfstrdup( cfile.val );
 			channel->max_messages = global_conf.max_messages;
+			channel->max_age = global_conf.max_age;
 			channel->expire_unread = global_conf.expire_unread;
 			channel->use_internal_date = global_conf.use_internal_date;
+			channel->detect_moves = global_conf.detect_moves;
+			channel->link_dups = global_conf.link_dups;
+			channel->recover_state = global_conf.recover_state;
+			channel->state_format = global_conf.state_format;
+			channel->state_delta = global_conf.state_delta;
+			channel->parallel_boxes = global_conf.parallel_boxes;
 			cops = 0;
 			max_size = -1;
 			while (getcline( &cfile ) && cfile.cmd) {
@@ -419,7 +463,10 @@ load_config( const char *where, int pseudo )
 				cfile.err = 1;
 			} else if (merge_ops( cops, channel->ops ))
 				cfile.err = 1;
-			else {
+			else if (channel->max_messages && channel->max_age) {
+				error( "channel '%s' has both MaxMessages and MaxAge\n", channel->name );
+				cfile.err = 1;
+			} else {
 				if (max_size >= 0) {
 					if (!max_size)
 						max_size = INT_MAX;
@@ -467,7 +514,14 @@ load_config( const char *where, int pseudo )
 		}
 		else if (!strcasecmp( "FSync", cfile.cmd ))
 		{
-			UseFSync = parse_bool( &cfile );
+			if (!strcasecmp( "None", cfile.val ))
+				UseFSync = FSYNC_NONE;
+			else if (!strcasecmp( "Batch", cfile.val ))
+				UseFSync = FSYNC_BATCH;
+			else if (!strcasecmp( "Full", cfile.val ))
+				UseFSync = FSYNC_FULL;
+			else
+				UseFSync = parse_bool( &cfile ) ? FSYNC_FULL : FSYNC_NONE;
 		}
 		else if (!strcasecmp( "FieldDelimiter", cfile.cmd ))
 		{
@@ -484,9 +538,40 @@ load_config( const char *where, int pseudo )
 		}
 		else if (!strcasecmp( "BufferLimit", cfile.cmd ))
 		{
-			BufferLimit = parse_size( &cfile );
-			if (BufferLimit <= 0) {
-				error( "%s:%d: BufferLimit must be positive\n", cfile.file, cfile.line );
+			if (!strcasecmp( "auto", cfile.val )) {
+				BufferLimitMin = 256 * 1024;
+				BufferLimit = 64 * 1024 * 1024;
+				if ((cfile.val = get_arg( &cfile, ARG_OPTIONAL, 0 ))) {
+					BufferLimitMin = parse_size( &cfile );
+					if ((cfile.val = get_arg( &cfile, ARG_REQUIRED, 0 )))
+						BufferLimit = parse_size( &cfile );
+				}
+				if (BufferLimitMin <= 0 || BufferLimit < BufferLimitMin) {
+					error( "%s:%d: BufferLimit bounds must be positive and ascending\n", cfile.file, cfile.line );
+					cfile.err = 1;
+				}
+			} else {
+				BufferLimitMin = 0;
+				BufferLimit = parse_size( &cfile );
+				if (BufferLimit <= 0) {
+					error( "%s:%d: BufferLimit must be positive\n", cfile.file, cfile.line );
+					cfile.err = 1;
+				}
+			}
+		}
+		else if (!strcasecmp( "ParallelChannels", cfile.cmd ))
+		{
+			ParallelChannels = parse_int( &cfile );
+			if (ParallelChannels < 1) {
+				error( "%s:%d: ParallelChannels must be positive\n", cfile.file, cfile.line );
+				cfile.err = 1;
+			}
+		}
+		else if (!strcasecmp( "MaxConnections", cfile.cmd ))
+		{
+			MaxConnections = parse_int( &cfile );
+			if (MaxConnections < 1) {
+				error( "%s:%d: MaxConnections must be positive\n", cfile.file, cfile.line );
 				cfile.err = 1;
 			}
 		}
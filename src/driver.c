@@ -27,17 +27,6 @@
 
 driver_t *drivers[N_DRIVERS] = { &maildir_driver, &imap_driver };
 
-void
-free_generic_messages( message_t *msgs )
-{
-	message_t *tmsg;
-
-	for (; msgs; msgs = tmsg) {
-		tmsg = msgs->next;
-		free( msgs );
-	}
-}
-
 void
 parse_generic_store( store_conf_t *store, conffile_t *cfg )
 {
@@ -68,6 +68,9 @@ typedef struct message {
 	int uid;
 	uchar flags, status;
 	char tuid[TUIDL];
+	/* Only with OPEN_MSGID, which also implies that the size is that with CRLF line endings: */
+	uint hdr_hash; /* see hash_header() */
+	char *msgid;
 } message_t;
 
 /* For opts, both in store and driver_t->select() */
@@ -79,6 +82,7 @@ typedef struct message {
 #define OPEN_SETFLAGS   (1<<6)
 #define OPEN_APPEND     (1<<7)
 #define OPEN_FIND       (1<<8)
+#define OPEN_MSGID      (1<<9)
 
 typedef struct store {
 	struct store *next;
@@ -93,8 +97,16 @@ typedef struct store {
 	char *path; /* own */
 	message_t *msgs; /* own */
 	int uidvalidity;
-	int uidnext; /* from SELECT responses */
+	int uidnext; /* from SELECT or STATUS responses */
 	uint opts; /* maybe preset? */
+	time_t since; /* if set, load_box() ignores messages which arrived before this time, ... */
+	int keep_uid; /* ... unless their UID is at least this (if non-zero), ... */
+	int since_uid; /* ... and reports the lowest UID of a message which arrived since */
+	uint64_t highestmodseq; /* from SELECT responses; 0 if the box has no mod-sequences */
+	uint64_t changed_since; /* if set, load_box() may omit the flags of messages up to ... */
+	int changed_uid; /* ... this UID which were not modified after this mod-sequence */
+	int *known_uids; /* sorted UIDs up to changed_uid which load_box() may assume to exist, */
+	int nknown_uids; /* unless the server reports them as expunged */
 	/* note that the following do _not_ reflect stats from msgs, but mailbox totals */
 	int count; /* # of messages */
 	int recent; /* # of recent messages - don't trust this beyond the initial read */
@@ -110,12 +122,14 @@ set_bad_callback( store_t *ctx, void (*cb)( void *aux ), void *aux )
 }
 
 typedef struct {
-	char *data;
-	int len;
+	void *stream; /* storing driver's state for a message which is being passed in pieces */
 	time_t date;
 	uchar flags;
 } msg_data_t;
 
+/* Size of the pieces message contents are preferably passed in. */
+#define MSG_CHUNK_SIZE 65536
+
 #define DRV_OK          0
 /* Message went missing, or mailbox is full, etc. */
 #define DRV_MSG_BAD     1
@@ -153,7 +167,8 @@ struct driver {
 	void (*cleanup)( void );
 
 	/* Allocate a store with the given configuration. This is expected to
-	 * return quickly, and must not fail. */
+	 * return quickly. It fails (returning null) only if opening another server
+	 * connection would exceed a configured connection limit. */
 	store_t *(*alloc_store)( store_conf_t *conf, const char *label );
 
 	/* Open/connect the store. This may recycle existing server connections. */
@@ -180,7 +195,9 @@ struct driver {
 	                    void (*cb)( int sts, void *aux ), void *aux );
 
 	/* Open the selected mailbox.
-	 * Note that this should not directly complain about failure to open. */
+	 * Note that this should not directly complain about failure to open.
+	 * If prepare_load_box() was already invoked and the box is only going to be
+	 * appended to, the driver may merely obtain the box's status. */
 	void (*open_box)( store_t *ctx,
 	                  void (*cb)( int sts, void *aux ), void *aux );
 
@@ -199,7 +216,8 @@ struct driver {
 
 	/* Invoked before load_box(), this informs the driver which operations (OP_*)
 	 * will be performed on the mailbox. The driver may extend the set by implicitly
-	 * needed or available operations. */
+	 * needed or available operations, and drop unsupported optional ones.
+	 * This may be invoked before open_box() already, and again afterwards. */
 	void (*prepare_load_box)( store_t *ctx, int opts );
 
 	/* Load the message attributes needed to perform the requested operations.
@@ -210,15 +228,54 @@ struct driver {
 	void (*load_box)( store_t *ctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
 	                  void (*cb)( int sts, void *aux ), void *aux );
 
-	/* Fetch the contents and flags of the given message from the current mailbox. */
+	/* Fetch the contents and flags of the given message from the current mailbox.
+	 * The contents are passed to data_cb in one or more pieces before cb is invoked.
+	 * The flags and date are filled in by the time cb is invoked. */
 	void (*fetch_msg)( store_t *ctx, message_t *msg, msg_data_t *data,
+	                   void (*data_cb)( const char *buf, int len, void *aux ),
 	                   void (*cb)( int sts, void *aux ), void *aux );
 
-	/* Store the given message to either the current mailbox or the trash folder.
+	/* Start storing a message to either the current mailbox or the trash folder.
+	 * The contents are subsequently passed to store_msg_data() in pieces. */
+	int (*store_msg_begin)( store_t *ctx, msg_data_t *data, int to_trash );
+
+	/* Append a piece of the contents to the message being stored. */
+	int (*store_msg_data)( store_t *ctx, msg_data_t *data, const char *buf, int len );
+
+	/* Finish storing the given message, using the flags and date from data.
 	 * If the new copy's UID can be immediately determined, return it, otherwise -2. */
 	void (*store_msg)( store_t *ctx, msg_data_t *data, int to_trash,
 	                   void (*cb)( int sts, int uid, void *aux ), void *aux );
 
+	/* Discard a message whose storing was started, but not finished. */
+	void (*abort_store_msg)( store_t *ctx, msg_data_t *data );
+
+	/* Keep a copy of a message from the current mailbox which is about to be deleted,
+	 * so it can be stored again if it re-appears elsewhere. Return an opaque handle and
+	 * the message's Message-ID, or null if the copy cannot be made. Optional. */
+	void *(*stash_msg)( store_t *ctx, message_t *msg, char **msgid );
+
+	/* Keep a copy of the message which is being stored with the given TUID, so it can
+	 * be stored again elsewhere. Must be called before store_msg(). Return an opaque
+	 * handle, or null if the copy cannot be made. Optional; requires the other stash
+	 * functions. */
+	void *(*stash_stored_msg)( store_t *ctx, msg_data_t *data, const char *tuid );
+
+	/* Stash all messages of the named mailbox which have a Message-ID, without
+	 * selecting it. The stashes refer to the messages themselves, which may
+	 * disappear in the meantime. Optional; requires the other stash functions. */
+	void (*stash_box_msgs)( store_t *ctx, const char *name,
+	                        void (*cb)( void *stash, char *msgid, void *aux ), void *aux );
+
+	/* Start storing a stashed message to the current mailbox instead of fetching
+	 * it again; finish with store_msg(). The message's size with CRLF line endings
+	 * must match. The new copy carries the TUID which is passed in; if the stash
+	 * already carries one, that is kept and returned instead. The stash remains valid. */
+	int (*store_stashed_msg)( store_t *ctx, void *stash, int size, char *tuid, msg_data_t *data );
+
+	/* Discard a stashed message. */
+	void (*free_stash)( void *stash );
+
 	/* Index the messages which have newly appeared in the mailbox, including their
 	 * temporary UID headers. This is needed if store_msg() does not guarantee returning
 	 * a UID; otherwise the driver needs to implement only the OPEN_FIND flag. */
@@ -255,12 +312,14 @@ struct driver {
 	/* Get approximate amount of memory occupied by the driver. */
 	int (*memory_usage)( store_t *ctx );
 
+	/* Get the buffer limit which suits the measured throughput and latency of
+	 * the connection, or 0 if it is not known yet. Optional. */
+	int (*buffer_limit)( store_t *ctx );
+
 	/* Get the FAIL_* state of the driver. */
 	int (*fail_state)( store_conf_t *conf );
 };
 
-void free_generic_messages( message_t * );
-
 void parse_generic_store( store_conf_t *store, conffile_t *cfg );
 
 #define N_DRIVERS 2
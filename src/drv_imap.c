@@ -53,6 +53,8 @@ typedef struct imap_server_conf {
 	char *pass;
 	char *pass_cmd;
 	int max_in_progress;
+	char auto_depth; /* max_in_progress is only the upper bound */
+	int max_conns, num_conns;
 	int cap_mask;
 	string_list_t *auth_mechs;
 #ifdef HAVE_LIBSSL
@@ -88,18 +90,28 @@ typedef struct _list {
 #define MAX_LIST_DEPTH 5
 
 struct imap_store;
+struct imap_cmd_fetch_msg;
 
 typedef struct parse_list_state {
 	list_t *head, **stack[MAX_LIST_DEPTH];
 	int (*callback)( struct imap_store *ctx, list_t *list, char *cmd );
+	struct imap_cmd_fetch_msg *stream; /* the request whose BODY[] is passed on while it is read */
 	int level, need_bytes;
 } parse_list_state_t;
 
 struct imap_cmd;
 
+typedef struct {
+	int uid;
+	int flags;
+	char what; /* '+' or '-' */
+	struct imap_cmd_refcounted_state *sts;
+} imap_flag_upd_t;
+
 typedef struct imap_store {
 	store_t gen;
 	const char *label; /* foreign */
+	arena_t msg_arena; /* the messages of the selected box */
 	const char *prefix;
 	const char *name;
 	int ref_count;
@@ -107,9 +119,13 @@ typedef struct imap_store {
 	/* trash folder's existence is not confirmed yet */
 	enum { TrashUnknown, TrashChecking, TrashKnown } trashnc;
 	uint got_namespace:1;
+	uint selected:1; /* the box is SELECTed, not just STATUSed */
+	uint qresync:1; /* QRESYNC was ENABLEd */
 	char delimiter[2]; /* hierarchy delimiter */
 	list_t *ns_personal, *ns_other, *ns_shared; /* NAMESPACE info */
 	message_t **msgapp; /* FETCH results */
+	int chg_minuid, chg_maxuid; /* range whose FLAGS were fetched only if changed ... */
+	message_t *chg_cur; /* ... and where the lookup of the respective messages left off */
 	uint caps; /* CAPABILITY results */
 	string_list_t *auth_mechs;
 	parse_list_state_t parse_list_sts;
@@ -118,6 +134,30 @@ typedef struct imap_store {
 	struct imap_cmd *pending, **pending_append;
 	struct imap_cmd *in_progress, **in_progress_append;
 	int buffer_mem; /* memory currently occupied by buffers in the queue */
+	/* APPENDs which are held back to be combined into a MULTIAPPEND */
+	struct imap_cmd *appends, **appends_append;
+	char *appends_cmd; /* the command without the messages */
+	int num_appends, appends_len;
+	wakeup_t appends_timer;
+	/* fetch_msg() requests which are held back to be combined into one UID FETCH */
+	struct imap_cmd_fetch_msg *fetches, **fetches_append;
+	int num_fetches, fetches_size;
+	char fetches_items[32]; /* the data items besides the body, which all requests share */
+	wakeup_t fetches_timer;
+	/* the requests whose UID FETCH was sent, mapped by UID */
+	struct imap_cmd_fetch_msg **fetch_map;
+	int fetch_map_size, num_mapped_fetches;
+	/* flag changes which are sent by commit_cmds() */
+	imap_flag_upd_t *flag_upds;
+	int num_flag_upds, flag_upds_alloc;
+	int fetch_mem; /* approximate size of the messages which are being fetched */
+
+	/* Used for adapting the buffer limit and the pipeline depth to the connection */
+	uint sample_start, sample_bytes, sample_cmds; /* current measurement interval */
+	int rtt; /* shortest round-trip time seen so far in ms; -1 if none */
+	int bandwidth; /* in bytes per ms; smoothed */
+	int cmd_rate; /* completed commands per second; smoothed */
+	int buffer_limit, depth; /* derived from the above; 0 if not known yet */
 
 	/* Used during sequential operations like connect */
 	enum { GreetingPending = 0, GreetingBad, GreetingOk, GreetingPreauth } greeting;
@@ -141,6 +181,8 @@ struct imap_cmd {
 	struct imap_cmd *next;
 	char *cmd;
 	int tag;
+	uint sent; /* time stamp */
+	char lone; /* no other commands were in flight when this one was sent */
 
 	struct {
 		/* Will be called on each continuation request until it resets this pointer.
@@ -149,7 +191,7 @@ struct imap_cmd {
 		void (*done)( imap_store_t *ctx, struct imap_cmd *cmd, int response );
 		char *data;
 		int data_len;
-		int uid; /* to identify fetch responses */
+		struct imap_cmd *more; /* the messages of a MULTIAPPEND, each with its own cmd and data */
 		char high_prio; /* if command is queued, put it at the front of the queue. */
 		char to_trash; /* we are storing to trash, not current. */
 		char create; /* create the mailbox if we get an error which suggests so. */
@@ -165,7 +207,25 @@ struct imap_cmd_simple {
 
 struct imap_cmd_fetch_msg {
 	struct imap_cmd_simple gen;
+	struct imap_cmd_fetch_msg *next; /* in the same batch */
+	struct imap_cmd_fetch_msg *map_next; /* in the same bucket of the UID map */
 	msg_data_t *msg_data;
+	void (*data_cb)( const char *buf, int len, void *aux );
+	int uid;
+	int got_data;
+	int size;
+	char want_flags;
+};
+
+struct imap_cmd_fetch_msgs {
+	struct imap_cmd gen;
+	struct imap_cmd_fetch_msg *msgs;
+	char items[32];
+};
+
+struct imap_cmd_load_box {
+	struct imap_cmd_simple gen;
+	int minuid, maxuid, newuid, nexcs, *excs;
 };
 
 struct imap_cmd_out_uid {
@@ -192,6 +252,12 @@ struct imap_cmd_refcounted {
 	struct imap_cmd_refcounted_state *state;
 };
 
+struct imap_cmd_set_flags {
+	struct imap_cmd gen;
+	struct imap_cmd_refcounted_state **states;
+	int nstates;
+};
+
 #define CAP(cap) (ctx->caps & (1 << (cap)))
 
 enum CAPABILITY {
@@ -206,7 +272,10 @@ enum CAPABILITY {
 	LITERALPLUS,
 	MOVE,
 	NAMESPACE,
-	COMPRESS_DEFLATE
+	COMPRESS_DEFLATE,
+	CONDSTORE,
+	QRESYNC,
+	MULTIAPPEND
 };
 
 static const char *cap_list[] = {
@@ -221,7 +290,10 @@ static const char *cap_list[] = {
 	"LITERAL+",
 	"MOVE",
 	"NAMESPACE",
-	"COMPRESS=DEFLATE"
+	"COMPRESS=DEFLATE",
+	"CONDSTORE",
+	"QRESYNC",
+	"MULTIAPPEND"
 };
 
 #define RESP_OK       0
@@ -274,6 +346,7 @@ done_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd, int response )
 static void
 send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 {
+	struct imap_cmd *part;
 	int bufl, litplus, iovcnt = 1;
 	const char *buffmt;
 	conn_iovec_t iov[3];
@@ -306,7 +379,27 @@ send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	iov[0].buf = buf;
 	iov[0].len = bufl;
 	iov[0].takeOwn = KeepOwn;
-	if (litplus) {
+	if (cmd->param.more) {
+		/* The line is continued by the messages. Only ones which qualify for
+		 * LITERAL+ are combined. The buffers are kept, as the messages may
+		 * need to be appended one by one after all. */
+		iov[0].len -= 2;
+		socket_write( &ctx->conn, iov, 1 );
+		for (part = cmd->param.more; part; part = part->param.more) {
+			bufl = nfsnprintf( buf, sizeof(buf), " %s{%d+}\r\n", part->cmd, part->param.data_len );
+			if (DFlags & DEBUG_NET) {
+				printf( "%s>>>%s", ctx->label, buf );
+				fflush( stdout );
+			}
+			iov[0].len = bufl;
+			iov[1].buf = part->param.data;
+			iov[1].len = part->param.data_len;
+			iov[1].takeOwn = KeepOwn;
+			socket_write( &ctx->conn, iov, 2 );
+		}
+		iov[0].buf = "\r\n";
+		iov[0].len = 2;
+	} else if (litplus) {
 		iov[1].buf = cmd->param.data;
 		iov[1].len = cmd->param.data_len;
 		iov[1].takeOwn = GiveOwn;
@@ -320,6 +413,13 @@ send_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	socket_write( &ctx->conn, iov, iovcnt );
 	if (cmd->param.to_trash && ctx->trashnc == TrashUnknown)
 		ctx->trashnc = TrashChecking;
+	cmd->sent = get_msecs();
+	if ((cmd->lone = !ctx->num_in_progress)) {
+		/* Idle periods are not representative of the connection. */
+		ctx->sample_start = cmd->sent;
+		ctx->sample_bytes = ctx->conn.bytes_in + ctx->conn.bytes_out;
+		ctx->sample_cmds = 0;
+	}
 	cmd->next = 0;
 	*ctx->in_progress_append = cmd;
 	ctx->in_progress_append = &cmd->next;
@@ -338,7 +438,65 @@ cmd_sendable( imap_store_t *ctx, struct imap_cmd *cmd )
 	                                     offsetof(struct imap_cmd, next)), 1) &&
 	         (cmdp->param.cont || cmdp->param.data)) &&
 	       !(cmd->param.to_trash && ctx->trashnc == TrashChecking) &&
-	       ctx->num_in_progress < ((imap_store_conf_t *)ctx->gen.conf)->server->max_in_progress;
+	       ctx->num_in_progress < (ctx->depth ? ctx->depth : ((imap_store_conf_t *)ctx->gen.conf)->server->max_in_progress);
+}
+
+#define SAMPLE_INTERVAL 200 /* ms */
+
+static int
+changed_much( int old, int new )
+{
+	return new != old && (new >= old + old / 2 || new <= old - old / 3);
+}
+
+/* The connection is kept busy if the amounts of data and commands in flight
+ * cover twice the respective bandwidth-delay products. */
+static void
+tune_connection( imap_store_t *ctx, struct imap_cmd *cmd )
+{
+	imap_server_conf_t *srvc = ((imap_store_conf_t *)ctx->gen.conf)->server;
+	uint now, elapsed, bytes;
+	int rtt, limit, depth;
+
+	if (!BufferLimitMin && !srvc->auto_depth)
+		return;
+	now = get_msecs();
+	if (cmd->lone && (ctx->rtt < 0 || (int)(now - cmd->sent) < ctx->rtt))
+		ctx->rtt = now - cmd->sent;
+	ctx->sample_cmds++;
+	if ((elapsed = now - ctx->sample_start) < SAMPLE_INTERVAL)
+		return;
+	bytes = ctx->conn.bytes_in + ctx->conn.bytes_out - ctx->sample_bytes;
+	ctx->bandwidth = (ctx->bandwidth + bytes / elapsed) / (ctx->bandwidth ? 2 : 1);
+	ctx->cmd_rate = (ctx->cmd_rate + ctx->sample_cmds * 1000 / elapsed) / (ctx->cmd_rate ? 2 : 1);
+	ctx->sample_start = now;
+	ctx->sample_bytes += bytes;
+	ctx->sample_cmds = 0;
+
+	rtt = ctx->rtt + 1; /* account for the timer resolution */
+	if (BufferLimitMin) {
+		limit = ctx->bandwidth * rtt * 2;
+		if (limit < BufferLimitMin)
+			limit = BufferLimitMin;
+		else if (limit > BufferLimit)
+			limit = BufferLimit;
+	} else {
+		limit = 0;
+	}
+	if (srvc->auto_depth) {
+		depth = ctx->cmd_rate * rtt * 2 / 1000 + 1;
+		if (depth > srvc->max_in_progress)
+			depth = srvc->max_in_progress;
+	} else {
+		depth = 0;
+	}
+	if (!changed_much( ctx->buffer_limit, limit ) && !changed_much( ctx->depth, depth ))
+		return;
+	ctx->buffer_limit = limit;
+	ctx->depth = depth;
+	info( "Account %s: round-trip time %d ms, throughput %d kB/s; buffer limit %d kB, pipeline depth %d\n",
+	      srvc->name, ctx->rtt, ctx->bandwidth * 1000 / 1024, limit / 1024,
+	      depth ? depth : srvc->max_in_progress );
 }
 
 static void
@@ -353,11 +511,45 @@ flush_imap_cmds( imap_store_t *ctx )
 	}
 }
 
+static void imap_refcounted_done( struct imap_cmd_refcounted_state *sts );
+
 static void
 cancel_pending_imap_cmds( imap_store_t *ctx )
 {
 	struct imap_cmd *cmd;
-
+	struct imap_cmd_fetch_msg *fcmd;
+	imap_flag_upd_t *upds;
+	int i, n;
+
+	if ((n = ctx->num_flag_upds)) {
+		upds = ctx->flag_upds;
+		ctx->flag_upds = 0;
+		ctx->num_flag_upds = ctx->flag_upds_alloc = 0;
+		for (i = 0; i < n; i++) {
+			upds[i].sts->ret_val = DRV_CANCELED;
+			imap_refcounted_done( upds[i].sts );
+		}
+		free( upds );
+	}
+	if (ctx->fetches) {
+		conf_wakeup( &ctx->fetches_timer, -1 );
+		ctx->num_fetches = ctx->fetches_size = 0;
+		while ((fcmd = ctx->fetches)) {
+			if (!(ctx->fetches = fcmd->next))
+				ctx->fetches_append = &ctx->fetches;
+			done_imap_cmd( ctx, &fcmd->gen.gen, RESP_CANCEL );
+		}
+	}
+	if (ctx->appends) {
+		conf_wakeup( &ctx->appends_timer, -1 );
+		free( ctx->appends_cmd );
+		ctx->num_appends = ctx->appends_len = 0;
+		while ((cmd = ctx->appends)) {
+			if (!(ctx->appends = cmd->param.more))
+				ctx->appends_append = &ctx->appends;
+			done_imap_cmd( ctx, cmd, RESP_CANCEL );
+		}
+	}
 	while ((cmd = ctx->pending)) {
 		if (!(ctx->pending = cmd->next))
 			ctx->pending_append = &ctx->pending;
@@ -378,6 +570,10 @@ cancel_sent_imap_cmds( imap_store_t *ctx )
 	}
 }
 
+static void imap_flush_fetches( imap_store_t *ctx );
+static void imap_flush_appends( imap_store_t *ctx );
+static void imap_flush_flag_upds( imap_store_t *ctx );
+
 static void
 submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 {
@@ -386,6 +582,12 @@ submit_imap_cmd( imap_store_t *ctx, struct imap_cmd *cmd )
 	assert( cmd );
 	assert( cmd->param.done );
 
+	/* Held back commands must not be overtaken, as later ones may depend on them. */
+	if (ctx->fetches)
+		imap_flush_fetches( ctx );
+	if (ctx->appends)
+		imap_flush_appends( ctx );
+
 	if ((ctx->pending && !cmd->param.high_prio) || !cmd_sendable( ctx, cmd )) {
 		if (ctx->pending && cmd->param.high_prio) {
 			cmd->next = ctx->pending;
@@ -482,6 +684,18 @@ imap_vprintf( const char *fmt, va_list ap )
 	}
 }
 
+static char *
+imap_printf( const char *fmt, ... )
+{
+	va_list ap;
+	char *ret;
+
+	va_start( ap, fmt );
+	ret = imap_vprintf( fmt, ap );
+	va_end( ap );
+	return ret;
+}
+
 static void
 imap_exec( imap_store_t *ctx, struct imap_cmd *cmdp,
            void (*done)( imap_store_t *ctx, struct imap_cmd *cmd, int response ),
@@ -677,12 +891,15 @@ enum {
 	LIST_BAD
 };
 
+static int parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s );
+static struct imap_cmd_fetch_msg *start_fetch_stream( imap_store_t *ctx, list_t *item, list_t *body );
+
 static int
 parse_imap_list( imap_store_t *ctx, char **sp, parse_list_state_t *sts )
 {
 	list_t *cur, **curp;
 	char *s = *sp, *d, *p;
-	int n, bytes;
+	int n, want, bytes;
 	char c;
 
 	assert( sts );
@@ -694,6 +911,10 @@ parse_imap_list( imap_store_t *ctx, char **sp, parse_list_state_t *sts )
 		if (!bytes)
 			goto getline;
 		cur = (list_t *)((char *)curp - offsetof(list_t, next));
+		if (sts->stream) {
+			s = cur->val + (cur->len - bytes) % MSG_CHUNK_SIZE;
+			goto getchunk;
+		}
 		s = cur->val + cur->len - bytes;
 		goto getbytes;
 	}
@@ -728,6 +949,32 @@ parse_imap_list( imap_store_t *ctx, char **sp, parse_list_state_t *sts )
 			if (*s != '}' || *++s)
 				goto bail;
 
+			if (sts->callback == parse_fetch_rsp && sts->level == 1 &&
+			    (sts->stream = start_fetch_stream( ctx, sts->head->child, cur ))) {
+				/* Pass the message on in pieces, re-using one buffer. */
+				s = cur->val = nfmalloc( MSG_CHUNK_SIZE );
+
+			  getchunk:
+				while (bytes) {
+					want = cur->val + MSG_CHUNK_SIZE - s;
+					if (want > bytes)
+						want = bytes;
+					if ((n = socket_read( &ctx->conn, s, want )) < 0)
+						goto badeof;
+					if (n) {
+						sts->stream->data_cb( s, n, sts->stream->gen.callback_aux );
+						bytes -= n;
+						if ((s += n) == cur->val + MSG_CHUNK_SIZE)
+							s = cur->val;
+					}
+					/* After a short read, the rest may be read directly into
+					 * our buffer, which needs to wait for the next fill. */
+					if (n < want)
+						goto postpone;
+				}
+				goto getline;
+			}
+
 			s = cur->val = nfmalloc( cur->len + 1 );
 			s[cur->len] = 0;
 
@@ -816,6 +1063,7 @@ parse_list_init( parse_list_state_t *sts )
 	sts->need_bytes = -1;
 	sts->level = 1;
 	sts->head = 0;
+	sts->stream = 0;
 	sts->stack[0] = &sts->head;
 }
 
@@ -892,17 +1140,172 @@ parse_date( const char *str )
 	return date - (hours * 60 + mins) * 60;
 }
 
+static struct imap_cmd_fetch_msg *
+find_fetch( imap_store_t *ctx, int uid )
+{
+	struct imap_cmd_fetch_msg *cmd;
+
+	if (!ctx->fetch_map_size)
+		return 0;
+	for (cmd = ctx->fetch_map[uid & (ctx->fetch_map_size - 1)]; cmd; cmd = cmd->map_next)
+		if (cmd->uid == uid && !cmd->got_data)
+			return cmd;
+	return 0;
+}
+
+static imap_message_t *
+find_changed_msg( imap_store_t *ctx, int uid )
+{
+	message_t *msg;
+
+	/* The responses come in ascending UID order, so continue where the
+	 * previous lookup left off - but start over if necessary. */
+	if (!(msg = ctx->chg_cur) || msg->uid > uid)
+		msg = ctx->gen.msgs;
+	for (; msg && msg->uid < uid; msg = msg->next) {}
+	ctx->chg_cur = msg;
+	return (msg && msg->uid == uid) ? (imap_message_t *)msg : 0;
+}
+
+typedef struct {
+	char *body, *msgid;
+	const char *tuid;
+	int uid, mask, status, size, modseq;
+	uint hdr_hash;
+	time_t date;
+	char streamed; /* the body was passed on already */
+} fetch_rsp_t;
+
+/* Returns 0 for unknown system flags. */
 static int
-parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
+parse_fetch_flag( const char *val, int len, fetch_rsp_t *rsp )
+{
+	uint i;
+
+	if (val[0] != '\\') /* ignore user-defined flags for now */
+		return 1;
+	if (equals( val + 1, len - 1, "Recent", 6 )) {
+		rsp->status |= M_RECENT;
+		return 1;
+	}
+	for (i = 0; i < as(Flags); i++)
+		if (equals( val + 1, len - 1, Flags[i], strlen( Flags[i] ) )) {
+			rsp->mask |= 1 << i;
+			return 1;
+		}
+	if (len > 2 && val[1] == 'X' && val[2] == '-')
+		return 1; /* ignore system flag extensions */
+	return 0;
+}
+
+/* The BODY[] literal of a FETCH response can be passed on while it is read
+ * if all other data items which the request needs precede it. Anything
+ * unexpected makes the response go the regular way, which reports it. */
+static struct imap_cmd_fetch_msg *
+start_fetch_stream( imap_store_t *ctx, list_t *item, list_t *body )
+{
+	struct imap_cmd_fetch_msg *cmd;
+	list_t *flags;
+	fetch_rsp_t rsp;
+
+	memset( &rsp, 0, sizeof(rsp) );
+	for (; item->next != body; item = item->next->next) {
+		if (!is_atom( item ) || !item->next->next)
+			return 0;
+		if (!strcmp( "UID", item->val )) {
+			if (!is_atom( item->next ))
+				return 0;
+			rsp.uid = atoi( item->next->val );
+		} else if (!strcmp( "FLAGS", item->val )) {
+			if (!is_list( item->next ))
+				return 0;
+			for (flags = item->next->child; flags; flags = flags->next)
+				if (!is_atom( flags ) || !parse_fetch_flag( flags->val, flags->len, &rsp ))
+					return 0;
+			rsp.status |= M_FLAGS;
+		} else if (!strcmp( "INTERNALDATE", item->val )) {
+			if (!is_atom( item->next ) || (rsp.date = parse_date( item->next->val )) == -1)
+				return 0;
+		}
+	}
+	if (!is_atom( item ) || strcmp( "BODY[]", item->val ) ||
+	    !rsp.uid || !(cmd = find_fetch( ctx, rsp.uid )) ||
+	    (cmd->want_flags && !(rsp.status & M_FLAGS)) ||
+	    (cmd->msg_data->date == -1 && !rsp.date))
+		return 0;
+	cmd->msg_data->date = rsp.date;
+	if (rsp.status & M_FLAGS)
+		cmd->msg_data->flags = rsp.mask;
+	cmd->got_data = 1;
+	return cmd;
+}
+
+static int
+store_fetch_rsp( imap_store_t *ctx, fetch_rsp_t *rsp )
 {
-	list_t *tmp, *flags;
-	char *body = 0, *tuid = 0;
 	imap_message_t *cur;
 	msg_data_t *msgdata;
-	struct imap_cmd *cmdp;
-	int uid = 0, mask = 0, status = 0, size = 0;
-	uint i;
-	time_t date = 0;
+	struct imap_cmd_fetch_msg *fcmdp;
+	int uid = rsp->uid;
+
+	if (rsp->body) {
+		if (!(fcmdp = find_fetch( ctx, uid ))) {
+			error( "IMAP error: unexpected FETCH response (UID %d)\n", uid );
+			free( rsp->body );
+			free( rsp->msgid );
+			return LIST_BAD;
+		}
+		msgdata = fcmdp->msg_data;
+		msgdata->date = rsp->date;
+		if (rsp->status & M_FLAGS)
+			msgdata->flags = rsp->mask;
+		fcmdp->got_data = 1;
+		fcmdp->data_cb( rsp->body, rsp->size, fcmdp->gen.callback_aux );
+		free( rsp->body );
+	} else if (rsp->streamed) {
+		/* Everything was taken care of in start_fetch_stream(). */
+	} else if (rsp->modseq && !(rsp->status & M_FLAGS)) {
+		/* With CONDSTORE, a silent STORE still reports the new mod-sequence. */
+	} else if (uid && (rsp->status & M_FLAGS) && uid >= ctx->chg_minuid && uid <= ctx->chg_maxuid) {
+		/* The message was already loaded without flags, so this comes from
+		 * the CHANGEDSINCE query. Updates for messages which have flags
+		 * already are asynchronous; ignore them for now. */
+		if ((cur = find_changed_msg( ctx, uid )) && !(cur->gen.status & M_FLAGS)) {
+			cur->gen.flags = rsp->mask;
+			cur->gen.status |= rsp->status;
+		}
+	} else if (uid) { /* ignore async flag updates for now */
+		/* XXX this will need sorting for out-of-order (multiple queries) */
+		cur = arena_alloc( &ctx->msg_arena );
+		*ctx->msgapp = &cur->gen;
+		ctx->msgapp = &cur->gen.next;
+		cur->gen.next = 0;
+		cur->gen.uid = uid;
+		cur->gen.flags = rsp->mask;
+		cur->gen.status = rsp->status;
+		cur->gen.size = rsp->size;
+		cur->gen.srec = 0;
+		if (rsp->tuid)
+			memcpy( cur->gen.tuid, rsp->tuid, TUIDL );
+		else
+			cur->gen.tuid[0] = 0;
+		cur->gen.msgid = rsp->msgid;
+		cur->gen.hdr_hash = rsp->hdr_hash;
+		rsp->msgid = 0;
+		if (ctx->gen.uidnext <= uid) /* in case the server sends no UIDNEXT */
+			ctx->gen.uidnext = uid + 1;
+	}
+
+	free( rsp->msgid );
+	return LIST_OK;
+}
+
+static int
+parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
+{
+	list_t *tmp, *flags;
+	fetch_rsp_t rsp;
+	int vlen, ret;
 
 	if (!is_list( list )) {
 		error( "IMAP error: bogus FETCH response\n" );
@@ -910,12 +1313,13 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 		return LIST_BAD;
 	}
 
+	memset( &rsp, 0, sizeof(rsp) );
 	for (tmp = list->child; tmp; tmp = tmp->next) {
 		if (is_atom( tmp )) {
 			if (!strcmp( "UID", tmp->val )) {
 				tmp = tmp->next;
 				if (is_atom( tmp ))
-					uid = atoi( tmp->val );
+					rsp.uid = atoi( tmp->val );
 				else
 					error( "IMAP error: unable to parse UID\n" );
 			} else if (!strcmp( "FLAGS", tmp->val )) {
@@ -923,46 +1327,42 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 				if (is_list( tmp )) {
 					for (flags = tmp->child; flags; flags = flags->next) {
 						if (is_atom( flags )) {
-							if (flags->val[0] == '\\') { /* ignore user-defined flags for now */
-								if (!strcmp( "Recent", flags->val + 1)) {
-									status |= M_RECENT;
-									goto flagok;
-								}
-								for (i = 0; i < as(Flags); i++)
-									if (!strcmp( Flags[i], flags->val + 1 )) {
-										mask |= 1 << i;
-										goto flagok;
-									}
-								if (flags->val[1] == 'X' && flags->val[2] == '-')
-									goto flagok; /* ignore system flag extensions */
+							if (!parse_fetch_flag( flags->val, flags->len, &rsp ))
 								error( "IMAP warning: unknown system flag %s\n", flags->val );
-							}
-						  flagok: ;
 						} else
 							error( "IMAP error: unable to parse FLAGS list\n" );
 					}
-					status |= M_FLAGS;
+					rsp.status |= M_FLAGS;
 				} else
 					error( "IMAP error: unable to parse FLAGS\n" );
+			} else if (!strcmp( "MODSEQ", tmp->val )) {
+				tmp = tmp->next;
+				if (is_list( tmp ))
+					rsp.modseq = 1;
+				else
+					error( "IMAP error: unable to parse MODSEQ\n" );
 			} else if (!strcmp( "INTERNALDATE", tmp->val )) {
 				tmp = tmp->next;
 				if (is_atom( tmp )) {
-					if ((date = parse_date( tmp->val )) == -1)
+					if ((rsp.date = parse_date( tmp->val )) == -1)
 						error( "IMAP error: unable to parse INTERNALDATE format\n" );
 				} else
 					error( "IMAP error: unable to parse INTERNALDATE\n" );
 			} else if (!strcmp( "RFC822.SIZE", tmp->val )) {
 				tmp = tmp->next;
 				if (is_atom( tmp ))
-					size = atoi( tmp->val );
+					rsp.size = atoi( tmp->val );
 				else
 					error( "IMAP error: unable to parse RFC822.SIZE\n" );
 			} else if (!strcmp( "BODY[]", tmp->val )) {
 				tmp = tmp->next;
-				if (is_atom( tmp )) {
-					body = tmp->val;
+				if (ctx->parse_list_sts.stream) {
+					ctx->parse_list_sts.stream = 0;
+					rsp.streamed = 1;
+				} else if (is_atom( tmp )) {
+					rsp.body = tmp->val;
 					tmp->val = 0;       /* don't free together with list */
-					size = tmp->len;
+					rsp.size = tmp->len;
 				} else
 					error( "IMAP error: unable to parse BODY[]\n" );
 			} else if (!strcmp( "BODY[HEADER.FIELDS", tmp->val )) {
@@ -974,8 +1374,13 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 					tmp = tmp->next;
 					if (!is_atom( tmp ))
 						goto bfail;
-					if (starts_with_upper( tmp->val, tmp->len, "X-TUID: ", 8 ))
-						tuid = tmp->val + 8;
+					if ((rsp.tuid = find_header( tmp->val, tmp->len, "X-TUID", 6, &vlen )) && vlen != TUIDL)
+						rsp.tuid = 0;
+					if (ctx->gen.opts & OPEN_MSGID) {
+						free( rsp.msgid );
+						rsp.msgid = find_msgid( tmp->val, tmp->len );
+						rsp.hdr_hash = hash_header( tmp->val, tmp->len );
+					}
 				} else {
 				  bfail:
 					error( "IMAP error: unable to parse BODY[HEADER.FIELDS ...]\n" );
@@ -984,39 +1389,196 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 		}
 	}
 
-	if (body) {
-		for (cmdp = ctx->in_progress; cmdp; cmdp = cmdp->next)
-			if (cmdp->param.uid == uid)
-				goto gotuid;
-		error( "IMAP error: unexpected FETCH response (UID %d)\n", uid );
+	ret = store_fetch_rsp( ctx, &rsp );
+	free_list( list );
+	return ret;
+}
+
+/* Parse a FETCH response which is entirely contained in the line in place,
+ * without building a list first. This covers the bulk of the responses
+ * when loading a mailbox. Returns -1 if the response contains anything
+ * beyond that (literals in particular), so parse_fetch_rsp() needs to
+ * take over; no state is modified in that case. */
+static int
+parse_fetch_line( imap_store_t *ctx, char *s )
+{
+	fetch_rsp_t rsp;
+	char *p;
+	int len;
+	char date[40];
+
+	if (!s || *s != '(')
+		return -1;
+	memset( &rsp, 0, sizeof(rsp) );
+	for (s++;;) {
+		for (p = s; *s != ' '; s++)
+			if (!*s)
+				return -1;
+		len = s++ - p;
+		/* The lengths of the keywords we care about are unique. */
+		switch (len) {
+		case 3:
+			if (!equals( p, len, "UID", 3 ) || !isdigit( (uchar)*s ))
+				return -1;
+			rsp.uid = strtol( s, &s, 10 );
+			break;
+		case 5:
+			if (!equals( p, len, "FLAGS", 5 ) || *s != '(')
+				return -1;
+			for (s++; *s != ')'; ) {
+				for (p = s; *s != ' ' && *s != ')'; s++)
+					if (!*s || *s == '(' || *s == '"' || *s == '{')
+						return -1;
+				if (!parse_fetch_flag( p, s - p, &rsp ))
+					return -1;
+				if (*s == ' ')
+					s++;
+			}
+			s++;
+			rsp.status |= M_FLAGS;
+			break;
+		case 6:
+			if (!equals( p, len, "MODSEQ", 6 ) || *s != '(')
+				return -1;
+			for (s++; isdigit( (uchar)*s ); s++) {}
+			if (*s++ != ')')
+				return -1;
+			rsp.modseq = 1;
+			break;
+		case 11:
+			if (!equals( p, len, "RFC822.SIZE", 11 ) || !isdigit( (uchar)*s ))
+				return -1;
+			rsp.size = strtol( s, &s, 10 );
+			break;
+		case 12:
+			if (!equals( p, len, "INTERNALDATE", 12 ) || *s != '"')
+				return -1;
+			for (p = ++s; *s != '"'; s++)
+				if (!*s || *s == '\\' || s - p == sizeof(date) - 1)
+					return -1;
+			memcpy( date, p, s - p );
+			date[s - p] = 0;
+			s++;
+			if ((rsp.date = parse_date( date )) == -1)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+		if (*s == ')')
+			break;
+		if (*s++ != ' ')
+			return -1;
+	}
+	return store_fetch_rsp( ctx, &rsp );
+}
+
+/* Only the UID FETCH (CHANGEDSINCE ... VANISHED) responses are of interest;
+ * the plain VANISHED responses replace EXPUNGE, which is ignored as well. */
+static int
+parse_vanished_rsp( imap_store_t *ctx, char *cmd )
+{
+	message_t **msgp, *msg;
+	char *arg;
+	int lo, hi, lasthi;
+
+	if (!(arg = next_arg( &cmd )) || strcmp( arg, "(EARLIER)" ))
+		return 0;
+	if (!(arg = next_arg( &cmd )))
+		goto bad;
+	/* The pre-loaded messages are in ascending UID order, and the set is
+	 * most likely sorted as well, so usually a single pass suffices. */
+	msgp = &ctx->gen.msgs;
+	lasthi = 0;
+	for (;;) {
+		lo = strtol( arg, &arg, 10 );
+		hi = (*arg == ':') ? strtol( arg + 1, &arg, 10 ) : lo;
+		if (lo > hi) {
+			int tmp = lo;
+			lo = hi;
+			hi = tmp;
+		}
+		if (lo <= 0)
+			goto bad;
+		if (lo <= lasthi)
+			msgp = &ctx->gen.msgs;
+		lasthi = hi;
+		while ((msg = *msgp) && msg->uid <= hi) {
+			if (msg->uid >= lo && msg->uid >= ctx->chg_minuid && msg->uid <= ctx->chg_maxuid) {
+				if (!(*msgp = msg->next))
+					ctx->msgapp = msgp;
+			} else {
+				msgp = &msg->next;
+			}
+		}
+		if (!*arg)
+			break;
+		if (*arg++ != ',')
+			goto bad;
+	}
+	ctx->chg_cur = 0;
+	return 0;
+
+  bad:
+	error( "IMAP error: malformed VANISHED response\n" );
+	return -1;
+}
+
+/* Only UID SEARCH SINCE is issued, to find the first recent message. */
+static void
+parse_search_rsp( imap_store_t *ctx, char *cmd )
+{
+	char *arg;
+	int uid;
+
+	while ((arg = next_arg( &cmd ))) {
+		if ((uid = atoi( arg )) > 0 && uid < ctx->gen.since_uid)
+			ctx->gen.since_uid = uid;
+	}
+}
+
+static int parse_status_rsp_p2( imap_store_t *, list_t *, char * );
+
+static int
+parse_status_rsp( imap_store_t *ctx, list_t *list, char *cmd )
+{
+	/* We STATUS only the selected box, so the name is of no interest. */
+	free_list( list );
+	return parse_list( ctx, cmd, parse_status_rsp_p2 );
+}
+
+static int
+parse_status_rsp_p2( imap_store_t *ctx, list_t *list, char *cmd ATTR_UNUSED )
+{
+	list_t *lp;
+	char *earg;
+	int val;
+
+	if (!is_list( list )) {
 		free_list( list );
+	  bad_status:
+		error( "IMAP error: malformed STATUS response\n" );
 		return LIST_BAD;
-	  gotuid:
-		msgdata = ((struct imap_cmd_fetch_msg *)cmdp)->msg_data;
-		msgdata->data = body;
-		msgdata->len = size;
-		msgdata->date = date;
-		if (status & M_FLAGS)
-			msgdata->flags = mask;
-	} else if (uid) { /* ignore async flag updates for now */
-		/* XXX this will need sorting for out-of-order (multiple queries) */
-		cur = nfcalloc( sizeof(*cur) );
-		*ctx->msgapp = &cur->gen;
-		ctx->msgapp = &cur->gen.next;
-		cur->gen.next = 0;
-		cur->gen.uid = uid;
-		cur->gen.flags = mask;
-		cur->gen.status = status;
-		cur->gen.size = size;
-		cur->gen.srec = 0;
-		if (tuid)
-			strncpy( cur->gen.tuid, tuid, TUIDL );
-		else
-			cur->gen.tuid[0] = 0;
-		if (ctx->gen.uidnext <= uid) /* in case the server sends no UIDNEXT */
-			ctx->gen.uidnext = uid + 1;
 	}
-
+	for (lp = list->child; lp; lp = lp->next->next) {
+		if (!is_atom( lp ) || !is_atom( lp->next )) {
+			free_list( list );
+			goto bad_status;
+		}
+		val = strtol( lp->next->val, &earg, 10 );
+		if (*earg) {
+			free_list( list );
+			goto bad_status;
+		}
+		if (!strcmp( "MESSAGES", lp->val ))
+			ctx->gen.count = val;
+		else if (!strcmp( "RECENT", lp->val ))
+			ctx->gen.recent = val;
+		else if (!strcmp( "UIDNEXT", lp->val ))
+			ctx->gen.uidnext = val;
+		else if (!strcmp( "UIDVALIDITY", lp->val ))
+			ctx->gen.uidvalidity = val;
+	}
 	free_list( list );
 	return LIST_OK;
 }
@@ -1044,6 +1606,39 @@ parse_capability( imap_store_t *ctx, char *cmd )
 		add_string_list( &ctx->auth_mechs, "LOGIN" );
 }
 
+/* A MULTIAPPEND reports the UIDs of all messages, in order. */
+static int
+parse_appenduid_set( struct imap_cmd *cmd, char *arg )
+{
+	int uid, end;
+
+	for (;;) {
+		uid = strtol( arg, &arg, 10 );
+		end = (*arg == ':') ? strtol( arg + 1, &arg, 10 ) : uid;
+		if (uid <= 0 || end < uid)
+			return 0;
+		for (; uid <= end; uid++, cmd = cmd->param.more) {
+			if (!cmd)
+				return 0;
+			((struct imap_cmd_out_uid *)cmd)->out_uid = uid;
+		}
+		if (!*arg)
+			return !cmd;
+		if (*arg++ != ',')
+			return 0;
+	}
+}
+
+static void
+parse_enabled_rsp( imap_store_t *ctx, char *cmd )
+{
+	char *arg;
+
+	while ((arg = next_arg( &cmd )))
+		if (!strcmp( "QRESYNC", arg ))
+			ctx->qresync = 1;
+}
+
 static int
 parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 {
@@ -1072,6 +1667,15 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 			error( "IMAP error: malformed NEXTUID status\n" );
 			return RESP_CANCEL;
 		}
+	} else if (!strcmp( "HIGHESTMODSEQ", arg )) {
+		if (!(arg = next_arg( &s )) ||
+		    (ctx->gen.highestmodseq = strtoull( arg, &earg, 10 ), *earg))
+		{
+			error( "IMAP error: malformed HIGHESTMODSEQ status\n" );
+			return RESP_CANCEL;
+		}
+	} else if (!strcmp( "NOMODSEQ", arg )) {
+		ctx->gen.highestmodseq = 0;
 	} else if (!strcmp( "CAPABILITY", arg )) {
 		parse_capability( ctx, s );
 	} else if (!strcmp( "ALERT", arg )) {
@@ -1084,7 +1688,8 @@ parse_response_code( imap_store_t *ctx, struct imap_cmd *cmd, char *s )
 		if (!(arg = next_arg( &s )) ||
 		    (ctx->gen.uidvalidity = strtoll( arg, &earg, 10 ), *earg) ||
 		    !(arg = next_arg( &s )) ||
-		    !(((struct imap_cmd_out_uid *)cmd)->out_uid = atoi( arg )))
+		    !(cmd->param.more ? parse_appenduid_set( cmd->param.more, arg ) :
+		                        (((struct imap_cmd_out_uid *)cmd)->out_uid = atoi( arg ))))
 		{
 			error( "IMAP error: malformed APPENDUID status\n" );
 			return RESP_CANCEL;
@@ -1287,19 +1892,30 @@ imap_socket_read( void *aux )
 				error( "Error from IMAP server: %s\n", cmd );
 			} else if (!strcmp( "CAPABILITY", arg )) {
 				parse_capability( ctx, cmd );
+			} else if (!strcmp( "ENABLED", arg )) {
+				parse_enabled_rsp( ctx, cmd );
+			} else if (!strcmp( "VANISHED", arg )) {
+				if (parse_vanished_rsp( ctx, cmd ) < 0)
+					break;
 			} else if (!strcmp( "LIST", arg )) {
 				resp = parse_list( ctx, cmd, parse_list_rsp );
 				goto listret;
 			} else if (!strcmp( "NAMESPACE", arg )) {
 				resp = parse_list( ctx, cmd, parse_namespace_rsp );
 				goto listret;
+			} else if (!strcmp( "SEARCH", arg )) {
+				parse_search_rsp( ctx, cmd );
+			} else if (!strcmp( "STATUS", arg )) {
+				resp = parse_list( ctx, cmd, parse_status_rsp );
+				goto listret;
 			} else if ((arg1 = next_arg( &cmd ))) {
 				if (!strcmp( "EXISTS", arg1 ))
 					ctx->gen.count = atoi( arg );
 				else if (!strcmp( "RECENT", arg1 ))
 					ctx->gen.recent = atoi( arg );
 				else if(!strcmp ( "FETCH", arg1 )) {
-					resp = parse_list( ctx, cmd, parse_fetch_rsp );
+					if ((resp = parse_fetch_line( ctx, cmd )) < 0)
+						resp = parse_list( ctx, cmd, parse_fetch_rsp );
 					goto listret;
 				}
 			} else {
@@ -1346,6 +1962,7 @@ imap_socket_read( void *aux )
 		  gottag:
 			if (!(*pcmdp = cmdp->next))
 				ctx->in_progress_append = pcmdp;
+			tune_connection( ctx, cmdp );
 			if (!--ctx->num_in_progress)
 				socket_expect_read( &ctx->conn, 0 );
 			arg = next_arg( &cmd );
@@ -1422,11 +2039,27 @@ get_cmd_result_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
 
 /******************* imap_cancel_store *******************/
 
+/* The number of server connections, including idle ones. */
+static int imap_conns;
+
+static void
+imap_free_messages( imap_store_t *ctx )
+{
+	message_t *msg;
+
+	for (msg = ctx->gen.msgs; msg; msg = msg->next)
+		free( msg->msgid );
+	ctx->gen.msgs = 0;
+	ctx->msgapp = &ctx->gen.msgs;
+	ctx->chg_minuid = ctx->chg_maxuid = 0;
+	ctx->chg_cur = 0;
+	arena_release( &ctx->msg_arena );
+}
 
 static void
 imap_cleanup_store( imap_store_t *ctx )
 {
-	free_generic_messages( ctx->gen.msgs );
+	imap_free_messages( ctx );
 	free_string_list( ctx->gen.boxes );
 }
 
@@ -1445,6 +2078,7 @@ imap_cancel_store( store_t *gctx )
 	free_list( ctx->ns_other );
 	free_list( ctx->ns_shared );
 	free_string_list( ctx->auth_mechs );
+	free( ctx->fetch_map );
 	imap_cleanup_store( ctx );
 	imap_deref( ctx );
 }
@@ -1453,6 +2087,8 @@ static int
 imap_deref( imap_store_t *ctx )
 {
 	if (!--ctx->ref_count) {
+		((imap_store_conf_t *)ctx->gen.conf)->server->num_conns--;
+		imap_conns--;
 		free( ctx );
 		return -1;
 	}
@@ -1485,8 +2121,12 @@ imap_cancel_unowned( void *gctx )
 static void
 imap_free_store( store_t *gctx )
 {
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
+	if (((imap_store_t *)gctx)->state == SST_BAD) {
+		/* Never connected; there is nothing worth keeping. */
+		imap_cancel_store( gctx );
+		return;
+	}
+	imap_free_messages( (imap_store_t *)gctx );
 	set_bad_callback( gctx, imap_cancel_unowned, gctx );
 	gctx->next = unowned;
 	unowned = gctx;
@@ -1542,6 +2182,8 @@ static void imap_open_store_compress( imap_store_t * );
 #ifdef HAVE_LIBZ
 static void imap_open_store_compress_p2( imap_store_t *, struct imap_cmd *, int );
 #endif
+static void imap_open_store_enable( imap_store_t * );
+static void imap_open_store_enable_p2( imap_store_t *, struct imap_cmd *, int );
 static void imap_open_store_namespace( imap_store_t * );
 static void imap_open_store_namespace_p2( imap_store_t *, struct imap_cmd *, int );
 static void imap_open_store_namespace2( imap_store_t * );
@@ -1578,13 +2220,33 @@ imap_alloc_store( store_conf_t *conf, const char *label )
 			goto gotsrv;
 		}
 
-	/* Finally, schedule opening a new server connection. */
+	/* Finally, schedule opening a new server connection, if the limits permit it. */
+	if (srvc->num_conns >= srvc->max_conns)
+		return 0;
+	if (imap_conns >= MaxConnections) {
+		/* Drop an idle connection to some other server to make room. */
+		for (ctxp = &unowned; (ctx = (imap_store_t *)*ctxp); ctxp = &ctx->gen.next)
+			if (ctx->state != SST_BAD)
+				break;
+		if (!ctx)
+			return 0;
+		*ctxp = ctx->gen.next;
+		imap_cancel_store( &ctx->gen );
+	}
+	srvc->num_conns++;
+	imap_conns++;
 	ctx = nfcalloc( sizeof(*ctx) );
+	arena_init( &ctx->msg_arena, sizeof(imap_message_t) );
 	socket_init( &ctx->conn, &srvc->sconf,
 	             (void (*)( void * ))imap_invoke_bad_callback,
 	             imap_socket_read, (void (*)(void *))flush_imap_cmds, ctx );
 	ctx->in_progress_append = &ctx->in_progress;
 	ctx->pending_append = &ctx->pending;
+	ctx->fetches_append = &ctx->fetches;
+	init_wakeup( &ctx->fetches_timer, (void (*)( void * ))imap_flush_fetches, ctx );
+	ctx->appends_append = &ctx->appends;
+	init_wakeup( &ctx->appends_timer, (void (*)( void * ))imap_flush_appends, ctx );
+	ctx->rtt = -1;
 
   gotsrv:
 	ctx->gen.conf = conf;
@@ -2083,7 +2745,7 @@ imap_open_store_compress( imap_store_t *ctx )
 		return;
 	}
 #endif
-	imap_open_store_namespace( ctx );
+	imap_open_store_enable( ctx );
 }
 
 #ifdef HAVE_LIBZ
@@ -2092,14 +2754,34 @@ imap_open_store_compress_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED
 {
 	if (response == RESP_NO) {
 		/* We already reported an error, but it's not fatal to us. */
-		imap_open_store_namespace( ctx );
+		imap_open_store_enable( ctx );
 	} else if (response == RESP_OK) {
 		socket_start_deflate( &ctx->conn );
-		imap_open_store_namespace( ctx );
+		imap_open_store_enable( ctx );
 	}
 }
 #endif
 
+static void
+imap_open_store_enable( imap_store_t *ctx )
+{
+	if (CAP(QRESYNC)) {
+		/* This makes it possible to learn about expunged messages
+		 * without listing all messages. */
+		imap_exec( ctx, 0, imap_open_store_enable_p2, "ENABLE QRESYNC" );
+		return;
+	}
+	imap_open_store_namespace( ctx );
+}
+
+static void
+imap_open_store_enable_p2( imap_store_t *ctx, struct imap_cmd *cmd ATTR_UNUSED, int response )
+{
+	/* A failure is not fatal; we just go without QRESYNC then. */
+	if (response == RESP_NO || response == RESP_OK)
+		imap_open_store_namespace( ctx );
+}
+
 static void
 imap_open_store_namespace( imap_store_t *ctx )
 {
@@ -2175,25 +2857,44 @@ imap_open_store_ssl_bail( imap_store_t *ctx )
 static void
 imap_open_store_bail( imap_store_t *ctx, int failed )
 {
-	((imap_store_conf_t *)ctx->gen.conf)->server->failed = failed;
+	imap_server_conf_t *srvc = ((imap_store_conf_t *)ctx->gen.conf)->server;
+
+	/* If other connections to the server work, this one most likely ran
+	 * into a limit on simultaneous connections, so don't give up on it. */
+	if (srvc->num_conns == 1)
+		srvc->failed = failed;
 	ctx->callbacks.imap_open( DRV_STORE_BAD, ctx->callback_aux );
 }
 
 /******************* imap_open_box *******************/
 
+static void
+imap_exec_select( imap_store_t *ctx, struct imap_cmd *cmd,
+                  void (*done)( imap_store_t *ctx, struct imap_cmd *cmd, int response ),
+                  const char *buf )
+{
+	ctx->gen.highestmodseq = 0;
+	/* Enabling CONDSTORE makes the server report HIGHESTMODSEQ. */
+	imap_exec( ctx, cmd, done, "SELECT \"%\\s\"%s", buf, CAP(CONDSTORE) ? " (CONDSTORE)" : "" );
+}
+
 static int
 imap_select_box( store_t *gctx, const char *name )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
-	free_generic_messages( gctx->msgs );
-	gctx->msgs = 0;
-	ctx->msgapp = &gctx->msgs;
+	imap_flush_flag_upds( ctx );
+	imap_flush_fetches( ctx );
+	imap_flush_appends( ctx );
+	imap_free_messages( ctx );
 
 	ctx->name = name;
+	ctx->selected = 0;
 	return DRV_OK;
 }
 
+static void imap_open_box_p2( imap_store_t *, struct imap_cmd *, int );
+
 static void
 imap_open_box( store_t *gctx,
                void (*cb)( int sts, void *aux ), void *aux )
@@ -2208,14 +2909,30 @@ imap_open_box( store_t *gctx,
 	}
 
 	ctx->gen.uidnext = 0;
+	ctx->gen.count = ctx->gen.recent = 0;
 
 	INIT_IMAP_CMD(imap_cmd_simple, cmd, cb, aux)
 	cmd->gen.param.failok = 1;
-	imap_exec( ctx, &cmd->gen, imap_done_simple_box,
-	           "SELECT \"%\\s\"", buf );
+	if (!(ctx->gen.opts & (OPEN_OLD|OPEN_NEW|OPEN_SETFLAGS|OPEN_EXPUNGE))) {
+		/* Appending does not need a selected box, and SELECTing a big box
+		 * may be expensive. The price is that a UIDVALIDITY change which
+		 * happens concurrently is detected only in the next run. */
+		imap_exec( ctx, &cmd->gen, imap_done_simple_box,
+		           "STATUS \"%\\s\" (MESSAGES RECENT UIDNEXT UIDVALIDITY)", buf );
+	} else {
+		imap_exec_select( ctx, &cmd->gen, imap_open_box_p2, buf );
+	}
 	free( buf );
 }
 
+static void
+imap_open_box_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	if (response == RESP_OK)
+		ctx->selected = 1;
+	imap_done_simple_box( ctx, gcmd, response );
+}
+
 /******************* imap_create_box *******************/
 
 static void
@@ -2246,6 +2963,7 @@ imap_confirm_box_empty( store_t *gctx )
 }
 
 static void imap_delete_box_p2( imap_store_t *, struct imap_cmd *, int );
+static void imap_delete_box_p3( imap_store_t *, void (*)( int, void * ), void * );
 
 static void
 imap_delete_box( store_t *gctx,
@@ -2254,6 +2972,11 @@ imap_delete_box( store_t *gctx,
 	imap_store_t *ctx = (imap_store_t *)gctx;
 	struct imap_cmd_simple *cmd;
 
+	if (!ctx->selected) {
+		/* CLOSE would hit whatever other box is selected. */
+		imap_delete_box_p3( ctx, cb, aux );
+		return;
+	}
 	INIT_IMAP_CMD(imap_cmd_simple, cmd, cb, aux)
 	imap_exec( ctx, &cmd->gen, imap_delete_box_p2, "CLOSE" );
 }
@@ -2262,19 +2985,26 @@ static void
 imap_delete_box_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
 {
 	struct imap_cmd_simple *cmdp = (struct imap_cmd_simple *)gcmd;
-	struct imap_cmd_simple *cmd;
-	char *buf;
 
 	if (response != RESP_OK) {
 		imap_done_simple_box( ctx, &cmdp->gen, response );
 		return;
 	}
+	ctx->selected = 0;
+	imap_delete_box_p3( ctx, cmdp->callback, cmdp->callback_aux );
+}
+
+static void
+imap_delete_box_p3( imap_store_t *ctx, void (*cb)( int sts, void *aux ), void *aux )
+{
+	struct imap_cmd_simple *cmd;
+	char *buf;
 
 	if (prepare_box( &buf, ctx ) < 0) {
-		imap_done_simple_box( ctx, &cmdp->gen, RESP_NO );
+		cb( DRV_BOX_BAD, aux );
 		return;
 	}
-	INIT_IMAP_CMD(imap_cmd_simple, cmd, cmdp->callback, cmdp->callback_aux)
+	INIT_IMAP_CMD(imap_cmd_simple, cmd, cb, aux)
 	imap_exec( ctx, &cmd->gen, imap_done_simple_box,
 	           "DELETE \"%\\s\"", buf );
 	free( buf );
@@ -2291,18 +3021,128 @@ imap_finish_delete_box( store_t *gctx ATTR_UNUSED )
 static void
 imap_prepare_load_box( store_t *gctx, int opts )
 {
+	/* Message-IDs are useful only together with the sizes and flags. */
+	if (opts & OPEN_MSGID)
+		opts |= OPEN_SIZE|OPEN_FLAGS;
+	/* The sizes of new messages are needed to account for fetching them. */
+	if (opts & OPEN_NEW)
+		opts |= OPEN_SIZE;
 	gctx->opts = opts;
 }
 
+static void imap_add_known_msgs( imap_store_t *, int, int );
 static void imap_submit_load( imap_store_t *, const char *, int, struct imap_cmd_refcounted_state * );
 
+static void imap_load_box_p2( imap_store_t *, struct imap_cmd *, int );
+static void imap_load_box_p3( imap_store_t *, int, int, int, int *, int,
+                              void (*)( int, void * ), void * );
+static void imap_load_box_p4( imap_store_t *, struct imap_cmd *, int );
+static void imap_load_box_p5( imap_store_t *, int, int, int, int *, int,
+                              void (*)( int, void * ), void * );
+
 static void
 imap_load_box( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
                void (*cb)( int sts, void *aux ), void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
-	int i, j, bl;
-	char buf[1000];
+	struct imap_cmd_load_box *cmd;
+	char *buf;
+
+	if (!ctx->selected) {
+		if (!(gctx->opts & (OPEN_OLD|OPEN_NEW))) {
+			/* Only appending; nothing was ignored due to its age either. */
+			gctx->since_uid = 0;
+			free( excs );
+			cb( DRV_OK, aux );
+			return;
+		}
+		/* The need to load messages arose only after opening the box,
+		 * e.g., because the sync state needs to be recovered. */
+		if (prepare_box( &buf, ctx ) < 0) {
+			free( excs );
+			cb( DRV_BOX_BAD, aux );
+			return;
+		}
+		INIT_IMAP_CMD_X(imap_cmd_load_box, cmd, cb, aux)
+		cmd->minuid = minuid;
+		cmd->maxuid = maxuid;
+		cmd->newuid = newuid;
+		cmd->excs = excs;
+		cmd->nexcs = nexcs;
+		imap_exec_select( ctx, &cmd->gen.gen, imap_load_box_p2, buf );
+		free( buf );
+		return;
+	}
+	imap_load_box_p3( ctx, minuid, maxuid, newuid, excs, nexcs, cb, aux );
+}
+
+static void
+imap_load_box_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_load_box *cmd = (struct imap_cmd_load_box *)gcmd;
+
+	if (response != RESP_OK) {
+		free( cmd->excs );
+		imap_done_simple_box( ctx, gcmd, response );
+		return;
+	}
+	ctx->selected = 1;
+	imap_load_box_p3( ctx, cmd->minuid, cmd->maxuid, cmd->newuid, cmd->excs, cmd->nexcs,
+	                  cmd->gen.callback, cmd->gen.callback_aux );
+}
+
+static void
+imap_load_box_p3( imap_store_t *ctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
+                  void (*cb)( int sts, void *aux ), void *aux )
+{
+	struct imap_cmd_load_box *cmd;
+	char datestr[16];
+
+	ctx->gen.since_uid = INT_MAX;
+	if (ctx->gen.count && ctx->gen.since) {
+		INIT_IMAP_CMD_X(imap_cmd_load_box, cmd, cb, aux)
+		cmd->minuid = minuid;
+		cmd->maxuid = maxuid;
+		cmd->newuid = newuid;
+		cmd->excs = excs;
+		cmd->nexcs = nexcs;
+		strftime( datestr, sizeof(datestr), "%d-%b-%Y", localtime( &ctx->gen.since ) );
+		imap_exec( ctx, &cmd->gen.gen, imap_load_box_p4, "UID SEARCH SINCE %s", datestr );
+		return;
+	}
+	imap_load_box_p5( ctx, minuid, maxuid, newuid, excs, nexcs, cb, aux );
+}
+
+static void
+imap_load_box_p4( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_load_box *cmd = (struct imap_cmd_load_box *)gcmd;
+	int i, j, winuid;
+
+	if (response != RESP_OK) {
+		free( cmd->excs );
+		imap_done_simple_box( ctx, gcmd, response );
+		return;
+	}
+	/* Messages are ignored only below the first recent one, like in the Maildir driver. */
+	winuid = ctx->gen.since_uid;
+	if (ctx->gen.keep_uid && winuid > ctx->gen.keep_uid)
+		winuid = ctx->gen.keep_uid;
+	if (cmd->minuid < winuid)
+		cmd->minuid = winuid;
+	for (i = j = 0; i < cmd->nexcs; i++)
+		if (cmd->excs[i] >= winuid)
+			cmd->excs[j++] = cmd->excs[i];
+	imap_load_box_p5( ctx, cmd->minuid, cmd->maxuid, cmd->newuid, cmd->excs, j,
+	                  cmd->gen.callback, cmd->gen.callback_aux );
+}
+
+static void
+imap_load_box_p5( imap_store_t *ctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
+                  void (*cb)( int sts, void *aux ), void *aux )
+{
+	int i, j, bl, chguid;
+	char buf[1000], mbuf[24];
 
 	if (!ctx->gen.count) {
 		free( excs );
@@ -2321,56 +3161,248 @@ imap_load_box( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int
 				if (i != j)
 					bl += sprintf( buf + bl, ":%d", excs[i] );
 			}
-			imap_submit_load( ctx, buf, 0, sts );
+			imap_submit_load( ctx, buf, ctx->gen.opts & ~(OPEN_FIND|OPEN_MSGID), sts );
 		}
 		if (maxuid == INT_MAX)
 			maxuid = ctx->gen.uidnext ? ctx->gen.uidnext - 1 : 1000000000;
+		ctx->chg_minuid = ctx->chg_maxuid = 0;
+		ctx->chg_cur = 0;
+		if (ctx->gen.changed_since && ctx->gen.highestmodseq && (ctx->gen.opts & OPEN_FLAGS) && maxuid >= minuid) {
+			/* The flags of the messages which were known already are
+			 * fetched only if they changed since then. */
+			chguid = ctx->gen.changed_uid < maxuid ? ctx->gen.changed_uid : maxuid;
+			if ((ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) && chguid >= newuid)
+				chguid = newuid - 1;
+			if (chguid >= minuid) {
+				if (ctx->qresync && !nexcs) {
+					/* Rather than listing them, assume that the messages still
+					 * exist, unless the server reports them as vanished. */
+					imap_add_known_msgs( ctx, minuid, chguid );
+				} else {
+					sprintf( buf, "%d:%d", minuid, chguid );
+					imap_submit_load( ctx, buf, ctx->gen.opts & ~(OPEN_FLAGS|OPEN_FIND|OPEN_MSGID), sts );
+				}
+				ctx->chg_minuid = minuid;
+				ctx->chg_maxuid = chguid;
+				minuid = chguid + 1;
+			}
+		}
 		if (maxuid >= minuid) {
-			if ((ctx->gen.opts & OPEN_FIND) && minuid < newuid) {
+			if ((ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) && minuid < newuid) {
 				sprintf( buf, "%d:%d", minuid, newuid - 1 );
-				imap_submit_load( ctx, buf, 0, sts );
+				imap_submit_load( ctx, buf, ctx->gen.opts & ~(OPEN_FIND|OPEN_MSGID), sts );
 				if (newuid > maxuid)
 					goto done;
 				sprintf( buf, "%d:%d", newuid, maxuid );
 			} else {
 				sprintf( buf, "%d:%d", minuid, maxuid );
 			}
-			imap_submit_load( ctx, buf, (ctx->gen.opts & OPEN_FIND), sts );
+			imap_submit_load( ctx, buf, ctx->gen.opts, sts );
 		}
 	  done:
+		if (ctx->chg_maxuid) {
+			/* This must come last, as it refers to already loaded messages. */
+			sprintf( buf, "%d:%d", ctx->chg_minuid, ctx->chg_maxuid );
+			sprintf( mbuf, "%" PRIu64, ctx->gen.changed_since );
+			imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
+			           "UID FETCH %s (UID FLAGS) (CHANGEDSINCE %s%s)", buf, mbuf,
+			           ctx->qresync ? " VANISHED" : "" );
+		}
 		free( excs );
 		imap_refcounted_done( sts );
 	}
 }
 
 static void
-imap_submit_load( imap_store_t *ctx, const char *buf, int tuids, struct imap_cmd_refcounted_state *sts )
+imap_add_known_msgs( imap_store_t *ctx, int minuid, int maxuid )
 {
+	imap_message_t *cur;
+	int i;
+
+	for (i = 0; i < ctx->gen.nknown_uids; i++) {
+		if (ctx->gen.known_uids[i] < minuid)
+			continue;
+		if (ctx->gen.known_uids[i] > maxuid)
+			break;
+		cur = arena_alloc( &ctx->msg_arena );
+		*ctx->msgapp = &cur->gen;
+		ctx->msgapp = &cur->gen.next;
+		cur->gen.next = 0;
+		cur->gen.uid = ctx->gen.known_uids[i];
+		cur->gen.flags = 0;
+		cur->gen.status = 0;
+		cur->gen.size = 0;
+		cur->gen.srec = 0;
+		cur->gen.tuid[0] = 0;
+		cur->gen.msgid = 0;
+		cur->gen.hdr_hash = 0;
+	}
+}
+
+static void
+imap_submit_load( imap_store_t *ctx, const char *buf, int opts, struct imap_cmd_refcounted_state *sts )
+{
+	int hdrs = opts & (OPEN_FIND|OPEN_MSGID);
+
 	imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_refcounted_done_box,
-	           "UID FETCH %s (UID%s%s%s)", buf,
-	           (ctx->gen.opts & OPEN_FLAGS) ? " FLAGS" : "",
-	           (ctx->gen.opts & OPEN_SIZE) ? " RFC822.SIZE" : "",
-	           tuids ? " BODY.PEEK[HEADER.FIELDS (X-TUID)]" : "");
+	           "UID FETCH %s (UID%s%s%s%s%s%s)", buf,
+	           (opts & OPEN_FLAGS) ? " FLAGS" : "",
+	           (opts & OPEN_SIZE) ? " RFC822.SIZE" : "",
+	           hdrs ? " BODY.PEEK[HEADER.FIELDS (" : "",
+	           (hdrs & OPEN_FIND) ? (hdrs & OPEN_MSGID) ? "X-TUID " : "X-TUID" : "",
+	           (hdrs & OPEN_MSGID) ? "MESSAGE-ID DATE FROM SUBJECT" : "",
+	           hdrs ? ")]" : "" );
 }
 
 /******************* imap_fetch_msg *******************/
 
+/* Limits for combining FETCHes; the size is the sum of the messages. */
+#define FETCH_MAX_MSGS 64
+#define FETCH_MAX_SIZE (1024*1024)
+
 static void imap_fetch_msg_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response );
 
 static void
-imap_fetch_msg( store_t *ctx, message_t *msg, msg_data_t *data,
+imap_fetch_msg( store_t *gctx, message_t *msg, msg_data_t *data,
+                void (*data_cb)( const char *buf, int len, void *aux ),
                 void (*cb)( int sts, void *aux ), void *aux )
 {
+	imap_store_t *ctx = (imap_store_t *)gctx;
 	struct imap_cmd_fetch_msg *cmd;
+	char items[32];
 
 	INIT_IMAP_CMD_X(imap_cmd_fetch_msg, cmd, cb, aux)
-	cmd->gen.gen.param.uid = msg->uid;
+	cmd->gen.gen.cmd = 0; /* this is not a command of its own */
+	cmd->gen.gen.param.done = imap_fetch_msg_p2;
+	cmd->next = 0;
 	cmd->msg_data = data;
-	data->data = 0;
-	imap_exec( (imap_store_t *)ctx, &cmd->gen.gen, imap_fetch_msg_p2,
-	           "UID FETCH %d (%s%sBODY.PEEK[])", msg->uid,
-	           !(msg->status & M_FLAGS) ? "FLAGS " : "",
-	           (data->date== -1) ? "INTERNALDATE " : "" );
+	cmd->data_cb = data_cb;
+	cmd->uid = msg->uid;
+	cmd->got_data = 0;
+	cmd->size = msg->size;
+	cmd->want_flags = !(msg->status & M_FLAGS);
+	ctx->fetch_mem += msg->size;
+
+	/* Only requests which need the same data items can be combined. */
+	nfsnprintf( items, sizeof(items), "%s%s",
+	            !(msg->status & M_FLAGS) ? "FLAGS " : "",
+	            (data->date== -1) ? "INTERNALDATE " : "" );
+	if (ctx->fetches && strcmp( items, ctx->fetches_items ))
+		imap_flush_fetches( ctx );
+	if (!ctx->fetches) {
+		strcpy( ctx->fetches_items, items );
+		/* Send once the current batch of events is processed. */
+		conf_wakeup( &ctx->fetches_timer, 0 );
+	}
+	*ctx->fetches_append = cmd;
+	ctx->fetches_append = &cmd->next;
+	ctx->fetches_size += msg->size;
+	if (++ctx->num_fetches >= FETCH_MAX_MSGS || ctx->fetches_size >= FETCH_MAX_SIZE)
+		imap_flush_fetches( ctx );
+}
+
+static void
+map_fetch( imap_store_t *ctx, struct imap_cmd_fetch_msg *cmd )
+{
+	struct imap_cmd_fetch_msg **map, *ocmd;
+	int i, size;
+
+	if (ctx->num_mapped_fetches >= ctx->fetch_map_size) {
+		size = ctx->fetch_map_size ? ctx->fetch_map_size * 2 : 64;
+		map = nfcalloc( size * sizeof(*map) );
+		for (i = 0; i < ctx->fetch_map_size; i++) {
+			while ((ocmd = ctx->fetch_map[i])) {
+				ctx->fetch_map[i] = ocmd->map_next;
+				ocmd->map_next = map[ocmd->uid & (size - 1)];
+				map[ocmd->uid & (size - 1)] = ocmd;
+			}
+		}
+		free( ctx->fetch_map );
+		ctx->fetch_map = map;
+		ctx->fetch_map_size = size;
+	}
+	map = &ctx->fetch_map[cmd->uid & (ctx->fetch_map_size - 1)];
+	cmd->map_next = *map;
+	*map = cmd;
+	ctx->num_mapped_fetches++;
+}
+
+static void
+unmap_fetch( imap_store_t *ctx, struct imap_cmd_fetch_msg *cmd )
+{
+	struct imap_cmd_fetch_msg **cmdp;
+
+	for (cmdp = &ctx->fetch_map[cmd->uid & (ctx->fetch_map_size - 1)]; *cmdp != cmd; cmdp = &(*cmdp)->map_next)
+		assert( *cmdp );
+	*cmdp = cmd->map_next;
+	ctx->num_mapped_fetches--;
+}
+
+static void imap_fetch_msgs_p2( imap_store_t *, struct imap_cmd *, int );
+
+static void
+imap_flush_fetches( imap_store_t *ctx )
+{
+	struct imap_cmd_fetch_msgs *cmd;
+	struct imap_cmd_fetch_msg *fcmd;
+	int *uids, i, j, n, bl;
+	char buf[1000];
+
+	if (!ctx->fetches)
+		return;
+	conf_wakeup( &ctx->fetches_timer, -1 );
+	cmd = (struct imap_cmd_fetch_msgs *)new_imap_cmd( sizeof(*cmd) );
+	cmd->msgs = ctx->fetches;
+	strcpy( cmd->items, ctx->fetches_items );
+	/* The retries will complain. */
+	cmd->gen.param.failok = cmd->msgs->next != 0;
+	ctx->fetches = 0;
+	ctx->fetches_append = &ctx->fetches;
+	uids = nfmalloc( ctx->num_fetches * sizeof(int) );
+	for (n = 0, fcmd = cmd->msgs; fcmd; fcmd = fcmd->next) {
+		map_fetch( ctx, fcmd );
+		uids[n++] = fcmd->uid;
+	}
+	ctx->num_fetches = ctx->fetches_size = 0;
+	sort_ints( uids, n );
+	for (bl = 0, i = 0; i < n; i++) {
+		if (bl)
+			buf[bl++] = ',';
+		bl += sprintf( buf + bl, "%d", uids[i] );
+		j = i;
+		for (; i + 1 < n && uids[i + 1] <= uids[i] + 1; i++) {}
+		if (i != j)
+			bl += sprintf( buf + bl, ":%d", uids[i] );
+	}
+	free( uids );
+	imap_exec( ctx, &cmd->gen, imap_fetch_msgs_p2,
+	           "UID FETCH %s (%sBODY.PEEK[])", buf, ctx->fetches_items );
+}
+
+static void
+imap_fetch_msgs_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
+{
+	struct imap_cmd_fetch_msgs *cmd = (struct imap_cmd_fetch_msgs *)gcmd;
+	struct imap_cmd_fetch_msg *fcmd;
+
+	while ((fcmd = cmd->msgs)) {
+		cmd->msgs = fcmd->next;
+		if (response == RESP_NO && !fcmd->got_data) {
+			if (gcmd->param.failok) {
+				/* Some servers fail the entire FETCH if a single message
+				 * cannot be fetched, but still send the others. Fetch the
+				 * missing ones one by one to find the bad one(s). */
+				imap_exec( ctx, &fcmd->gen.gen, imap_fetch_msg_p2,
+				           "UID FETCH %d (%sBODY.PEEK[])", fcmd->uid, cmd->items );
+				continue;
+			}
+			unmap_fetch( ctx, fcmd );
+			done_imap_cmd( ctx, &fcmd->gen.gen, response );
+		} else {
+			unmap_fetch( ctx, fcmd );
+			done_imap_cmd( ctx, &fcmd->gen.gen, response == RESP_NO ? RESP_OK : response );
+		}
+	}
 }
 
 static void
@@ -2378,7 +3410,11 @@ imap_fetch_msg_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
 {
 	struct imap_cmd_fetch_msg *cmd = (struct imap_cmd_fetch_msg *)gcmd;
 
-	if (response == RESP_OK && !cmd->msg_data->data) {
+	/* A request which was sent as a command of its own is still mapped. */
+	if (gcmd->cmd)
+		unmap_fetch( ctx, cmd );
+	ctx->fetch_mem -= cmd->size;
+	if (response == RESP_OK && !cmd->got_data) {
 		/* The FETCH succeeded, but there is no message with this UID. */
 		response = RESP_NO;
 	}
@@ -2387,8 +3423,6 @@ imap_fetch_msg_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
 
 /******************* imap_set_msg_flags *******************/
 
-static void imap_set_flags_p2( imap_store_t *, struct imap_cmd *, int );
-
 static int
 imap_make_flags( int flags, char *buf )
 {
@@ -2411,11 +3445,18 @@ static void
 imap_flags_helper( imap_store_t *ctx, int uid, char what, int flags,
                    struct imap_cmd_refcounted_state *sts )
 {
-	char buf[256];
+	imap_flag_upd_t *upd;
 
-	buf[imap_make_flags( flags, buf )] = 0;
-	imap_exec( ctx, imap_refcounted_new_cmd( sts ), imap_set_flags_p2,
-	           "UID STORE %d %cFLAGS.SILENT %s", uid, what, buf );
+	if (ctx->num_flag_upds == ctx->flag_upds_alloc) {
+		ctx->flag_upds_alloc = ctx->flag_upds_alloc ? ctx->flag_upds_alloc * 2 : 64;
+		ctx->flag_upds = nfrealloc( ctx->flag_upds, ctx->flag_upds_alloc * sizeof(*upd) );
+	}
+	upd = &ctx->flag_upds[ctx->num_flag_upds++];
+	upd->uid = uid;
+	upd->flags = flags;
+	upd->what = what;
+	upd->sts = sts;
+	sts->ref_count++;
 }
 
 static void
@@ -2443,20 +3484,81 @@ imap_set_msg_flags( store_t *gctx, message_t *msg, int uid, int add, int del,
 	}
 }
 
+static int
+compare_flag_upds( const void *l, const void *r )
+{
+	const imap_flag_upd_t *lu = (const imap_flag_upd_t *)l, *ru = (const imap_flag_upd_t *)r;
+
+	if (lu->what != ru->what)
+		return lu->what - ru->what;
+	if (lu->flags != ru->flags)
+		return lu->flags - ru->flags;
+	return lu->uid - ru->uid;
+}
+
+static void imap_set_flags_p2( imap_store_t *, struct imap_cmd *, int );
+
+/* Every distinct change is applied to sets of UIDs, so typically
+ * very few commands are needed even for many messages. */
+static void
+imap_flush_flag_upds( imap_store_t *ctx )
+{
+	imap_flag_upd_t *upds;
+	struct imap_cmd_set_flags *cmd;
+	int i, j, k, n, bl;
+	char buf[1000], fbuf[256];
+
+	if (!(n = ctx->num_flag_upds))
+		return;
+	upds = ctx->flag_upds;
+	ctx->flag_upds = 0;
+	ctx->num_flag_upds = ctx->flag_upds_alloc = 0;
+	qsort( upds, n, sizeof(*upds), compare_flag_upds );
+	for (i = 0; i < n; ) {
+		fbuf[imap_make_flags( upds[i].flags, fbuf )] = 0;
+		cmd = (struct imap_cmd_set_flags *)new_imap_cmd( sizeof(*cmd) );
+		for (bl = 0, j = i; i < n && bl < 960 &&
+		                    upds[i].what == upds[j].what && upds[i].flags == upds[j].flags; i++) {
+			if (bl)
+				buf[bl++] = ',';
+			bl += sprintf( buf + bl, "%d", upds[i].uid );
+			k = i;
+			for (; i + 1 < n && upds[i + 1].uid == upds[i].uid + 1 &&
+			       upds[i + 1].what == upds[k].what && upds[i + 1].flags == upds[k].flags; i++) {}
+			if (i != k)
+				bl += sprintf( buf + bl, ":%d", upds[i].uid );
+		}
+		cmd->nstates = i - j;
+		cmd->states = nfmalloc( cmd->nstates * sizeof(*cmd->states) );
+		for (k = 0; k < cmd->nstates; k++)
+			cmd->states[k] = upds[j + k].sts;
+		imap_exec( ctx, &cmd->gen, imap_set_flags_p2,
+		           "UID STORE %s %cFLAGS.SILENT %s", buf, upds[j].what, fbuf );
+	}
+	free( upds );
+}
+
 static void
-imap_set_flags_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int response )
+imap_set_flags_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *gcmd, int response )
 {
-	struct imap_cmd_refcounted_state *sts = ((struct imap_cmd_refcounted *)cmd)->state;
-	switch (response) {
-	case RESP_CANCEL:
-		sts->ret_val = DRV_CANCELED;
-		break;
-	case RESP_NO:
-		if (sts->ret_val == DRV_OK) /* Don't override cancelation. */
-			sts->ret_val = DRV_MSG_BAD;
-		break;
+	struct imap_cmd_set_flags *cmd = (struct imap_cmd_set_flags *)gcmd;
+	struct imap_cmd_refcounted_state *sts;
+	int i;
+
+	for (i = 0; i < cmd->nstates; i++) {
+		sts = cmd->states[i];
+		switch (response) {
+		case RESP_CANCEL:
+			sts->ret_val = DRV_CANCELED;
+			break;
+		case RESP_NO:
+			if (sts->ret_val == DRV_OK) /* Don't override cancelation. */
+				sts->ret_val = DRV_MSG_BAD;
+			break;
+		}
+		imap_refcounted_done( sts );
 	}
-	imap_refcounted_done( sts );
+	free( cmd->states );
 }
 
 /******************* imap_close_box *******************/
@@ -2524,8 +3626,57 @@ imap_trash_msg( store_t *gctx, message_t *msg,
 
 /******************* imap_store_msg *******************/
 
+/* Limits for combining APPENDs; the size is the sum of the messages. */
+#define MULTIAPPEND_MAX_MSGS 100
+#define MULTIAPPEND_MAX_SIZE (1024*1024)
+
 static void imap_store_msg_p2( imap_store_t *, struct imap_cmd *, int );
 
+typedef struct {
+	char *data;
+	int len, alloc;
+} imap_msg_out_t;
+
+static int
+imap_store_msg_begin( store_t *gctx ATTR_UNUSED, msg_data_t *data, int to_trash ATTR_UNUSED )
+{
+	data->stream = nfcalloc( sizeof(imap_msg_out_t) );
+	return DRV_OK;
+}
+
+/* The message is collected before the APPEND is sent. Its final size is not known
+ * up front (line ending conversion, X-TUID), and a literal which is in flight
+ * could not be taken back if fetching the message failed midway. */
+static int
+imap_store_msg_data( store_t *gctx, msg_data_t *data, const char *buf, int len )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_msg_out_t *out = (imap_msg_out_t *)data->stream;
+
+	if (out->len + len > out->alloc) {
+		out->alloc = out->len + len;
+		if (out->alloc < out->len * 2)
+			out->alloc = out->len * 2;
+		out->data = nfrealloc( out->data, out->alloc );
+	}
+	memcpy( out->data + out->len, buf, len );
+	out->len += len;
+	ctx->buffer_mem += len;
+	return DRV_OK;
+}
+
+static void
+imap_abort_store_msg( store_t *gctx, msg_data_t *data )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_msg_out_t *out = (imap_msg_out_t *)data->stream;
+
+	ctx->buffer_mem -= out->len;
+	free( out->data );
+	free( out );
+	data->stream = 0;
+}
+
 static size_t
 my_strftime( char *s, size_t max, const char *fmt, const struct tm *tm )
 {
@@ -2537,6 +3688,7 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
                 void (*cb)( int sts, int uid, void *aux ), void *aux )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_msg_out_t *out = (imap_msg_out_t *)data->stream;
 	struct imap_cmd_out_uid *cmd;
 	char *buf;
 	int d;
@@ -2550,10 +3702,12 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 	flagstr[d] = 0;
 
 	INIT_IMAP_CMD(imap_cmd_out_uid, cmd, cb, aux)
-	ctx->buffer_mem += data->len;
-	cmd->gen.param.data_len = data->len;
-	cmd->gen.param.data = data->data;
+	cmd->gen.param.data_len = out->len;
+	/* A literal is sent only if there is a buffer, even if it is empty. */
+	cmd->gen.param.data = out->data ? out->data : nfmalloc( 1 );
 	cmd->out_uid = -2;
+	free( out );
+	data->stream = 0;
 
 	if (to_trash) {
 		cmd->gen.param.create = 1;
@@ -2571,6 +3725,24 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 	if (data->date) {
 		/* configure ensures that %z actually works. */
 		my_strftime( datestr, sizeof(datestr), "%d-%b-%Y %H:%M:%S %z", localtime( &data->date ) );
+	}
+	if (!to_trash && CAP(MULTIAPPEND) && CAP(LITERALPLUS) && cmd->gen.param.data_len < 100*1024) {
+		cmd->gen.param.done = imap_store_msg_p2;
+		if (data->date)
+			cmd->gen.cmd = imap_printf( "%s\"%\\s\" ", flagstr, datestr );
+		else
+			cmd->gen.cmd = nfstrdup( flagstr );
+		if (!ctx->appends) {
+			ctx->appends_cmd = imap_printf( "APPEND \"%\\s\"", buf );
+			/* Send once the current batch of events is processed. */
+			conf_wakeup( &ctx->appends_timer, 0 );
+		}
+		*ctx->appends_append = &cmd->gen;
+		ctx->appends_append = &cmd->gen.param.more;
+		ctx->appends_len += cmd->gen.param.data_len;
+		if (++ctx->num_appends >= MULTIAPPEND_MAX_MSGS || ctx->appends_len >= MULTIAPPEND_MAX_SIZE)
+			imap_flush_appends( ctx );
+	} else if (data->date) {
 		imap_exec( ctx, &cmd->gen, imap_store_msg_p2,
 		           "APPEND \"%\\s\" %s\"%\\s\" ", buf, flagstr, datestr );
 	} else {
@@ -2589,6 +3761,56 @@ imap_store_msg_p2( imap_store_t *ctx ATTR_UNUSED, struct imap_cmd *cmd, int resp
 	cmdp->callback( response, cmdp->out_uid, cmdp->callback_aux );
 }
 
+static void imap_multiappend_p2( imap_store_t *, struct imap_cmd *, int );
+
+static void
+imap_flush_appends( imap_store_t *ctx )
+{
+	struct imap_cmd *cmd, *msgs;
+
+	if (!(msgs = ctx->appends))
+		return;
+	conf_wakeup( &ctx->appends_timer, -1 );
+	ctx->appends = 0;
+	ctx->appends_append = &ctx->appends;
+	if (ctx->num_appends == 1) {
+		cmd = msgs;
+		nfasprintf( &cmd->cmd, "%s %s", ctx->appends_cmd, msgs->cmd );
+		free( msgs->cmd );
+		free( ctx->appends_cmd );
+	} else {
+		cmd = new_imap_cmd( sizeof(*cmd) );
+		cmd->cmd = ctx->appends_cmd;
+		cmd->param.failok = 1; /* the retries will complain */
+		cmd->param.done = imap_multiappend_p2;
+		cmd->param.more = msgs;
+	}
+	ctx->num_appends = ctx->appends_len = 0;
+	submit_imap_cmd( ctx, cmd );
+}
+
+static void
+imap_multiappend_p2( imap_store_t *ctx, struct imap_cmd *cmd, int response )
+{
+	struct imap_cmd *msg;
+	char *buf;
+
+	while ((msg = cmd->param.more)) {
+		cmd->param.more = msg->param.more;
+		msg->param.more = 0;
+		if (response == RESP_NO) {
+			/* The messages are appended atomically, so a single bad one
+			 * fails all of them. Append them one by one to find it. */
+			nfasprintf( &buf, "%s %s", cmd->cmd, msg->cmd );
+			free( msg->cmd );
+			msg->cmd = buf;
+			submit_imap_cmd( ctx, msg );
+		} else {
+			done_imap_cmd( ctx, msg, response );
+		}
+	}
+}
+
 /******************* imap_find_new_msgs *******************/
 
 static void imap_find_new_msgs_p2( imap_store_t *, struct imap_cmd *, int );
@@ -2602,6 +3824,18 @@ imap_find_new_msgs( store_t *gctx, int newuid,
 
 	INIT_IMAP_CMD_X(imap_cmd_find_new, cmd, cb, aux)
 	cmd->uid = newuid;
+	if (!ctx->selected) {
+		char *buf;
+
+		if (prepare_box( &buf, ctx ) < 0) {
+			free( cmd );
+			cb( DRV_BOX_BAD, aux );
+			return;
+		}
+		imap_exec_select( ctx, &cmd->gen.gen, imap_find_new_msgs_p2, buf );
+		free( buf );
+		return;
+	}
 	imap_exec( (imap_store_t *)ctx, &cmd->gen.gen, imap_find_new_msgs_p2, "CHECK" );
 }
 
@@ -2615,6 +3849,7 @@ imap_find_new_msgs_p2( imap_store_t *ctx, struct imap_cmd *gcmd, int response )
 		imap_done_simple_box( ctx, gcmd, response );
 		return;
 	}
+	ctx->selected = 1;
 	INIT_IMAP_CMD(imap_cmd_simple, cmd, cmdp->gen.callback, cmdp->gen.callback_aux)
 	imap_exec( (imap_store_t *)ctx, &cmd->gen, imap_done_simple_box,
 	           "UID FETCH %d:1000000000 (UID BODY.PEEK[HEADER.FIELDS (X-TUID)])", cmdp->uid );
@@ -2661,7 +3896,11 @@ imap_cancel_cmds( store_t *gctx,
 static void
 imap_commit_cmds( store_t *gctx )
 {
-	(void)gctx;
+	imap_store_t *ctx = (imap_store_t *)gctx;
+
+	imap_flush_flag_upds( ctx );
+	imap_flush_fetches( ctx );
+	imap_flush_appends( ctx );
 }
 
 /******************* imap_memory_usage *******************/
@@ -2671,7 +3910,17 @@ imap_memory_usage( store_t *gctx )
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
-	return ctx->buffer_mem + ctx->conn.buffer_mem;
+	return ctx->buffer_mem + ctx->fetch_mem + ctx->conn.buffer_mem;
+}
+
+/******************* imap_buffer_limit *******************/
+
+static int
+imap_buffer_limit( store_t *gctx )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+
+	return ctx->buffer_limit;
 }
 
 /******************* imap_fail_state *******************/
@@ -2727,6 +3976,7 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 	server->sconf.system_certs = 1;
 #endif
 	server->max_in_progress = INT_MAX;
+	server->max_conns = INT_MAX;
 #ifdef HAVE_LIBZ
 	server->compression = -1;
 #endif
@@ -2762,10 +4012,19 @@ imap_parse_store( conffile_t *cfg, store_conf_t **storep )
 		else if (!strcasecmp( "Timeout", cfg->cmd ))
 			server->sconf.timeout = parse_int( cfg );
 		else if (!strcasecmp( "PipelineDepth", cfg->cmd )) {
-			if ((server->max_in_progress = parse_int( cfg )) < 1) {
+			if ((server->auto_depth = !strcasecmp( "auto", cfg->val )))
+				cfg->val = get_arg( cfg, ARG_OPTIONAL, 0 );
+			if (!cfg->val) {
+				server->max_in_progress = 64;
+			} else if ((server->max_in_progress = parse_int( cfg )) < 1) {
 				error( "%s:%d: PipelineDepth must be at least 1\n", cfg->file, cfg->line );
 				cfg->err = 1;
 			}
+		} else if (!strcasecmp( "MaxConnections", cfg->cmd )) {
+			if ((server->max_conns = parse_int( cfg )) < 1) {
+				error( "%s:%d: MaxConnections must be at least 1\n", cfg->file, cfg->line );
+				cfg->err = 1;
+			}
 		} else if (!strcasecmp( "DisableExtension", cfg->cmd ) ||
 		           !strcasecmp( "DisableExtensions", cfg->cmd )) {
 			arg = cfg->val;
@@ -2997,7 +4256,15 @@ struct driver imap_driver = {
 	imap_prepare_load_box,
 	imap_load_box,
 	imap_fetch_msg,
+	imap_store_msg_begin,
+	imap_store_msg_data,
 	imap_store_msg,
+	imap_abort_store_msg,
+	0, /* stash_msg */
+	0, /* stash_stored_msg */
+	0, /* stash_box_msgs */
+	0, /* store_stashed_msg */
+	0, /* free_stash */
 	imap_find_new_msgs,
 	imap_set_msg_flags,
 	imap_trash_msg,
@@ -3005,5 +4272,6 @@ struct driver imap_driver = {
 	imap_cancel_cmds,
 	imap_commit_cmds,
 	imap_memory_usage,
+	imap_buffer_limit,
 	imap_fail_state,
 };
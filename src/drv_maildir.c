@@ -77,6 +77,7 @@ typedef struct maildir_store {
 	char *usedb;
 #endif /* USE_DB */
 	wakeup_t lcktmr;
+	arena_t msg_arena; /* the messages of the open box */
 } maildir_store_t;
 
 #ifdef USE_DB
@@ -86,6 +87,8 @@ static struct flock lck;
 
 static int MaildirCount;
 
+#define MSGID_INDEX ".isyncmsgids" /* see maildir_stash_box_msgs() */
+
 static void ATTR_PRINTFLIKE(1, 2)
 debug( const char *msg, ... )
 {
@@ -198,6 +201,7 @@ maildir_alloc_store( store_conf_t *gconf, const char *label ATTR_UNUSED )
 	ctx->gen.conf = gconf;
 	ctx->uvfd = -1;
 	init_wakeup( &ctx->lcktmr, lcktmr_timeout, ctx );
+	arena_init( &ctx->msg_arena, sizeof(maildir_message_t) );
 	return &ctx->gen;
 }
 
@@ -226,15 +230,16 @@ maildir_connect_store( store_t *gctx,
 }
 
 static void
-free_maildir_messages( message_t *msg )
+free_maildir_messages( maildir_store_t *ctx )
 {
-	message_t *tmsg;
+	message_t *msg;
 
-	for (; (tmsg = msg); msg = tmsg) {
-		tmsg = msg->next;
+	for (msg = ctx->gen.msgs; msg; msg = msg->next) {
 		free( ((maildir_message_t *)msg)->base );
-		free( msg );
+		free( msg->msgid );
 	}
+	ctx->gen.msgs = 0;
+	arena_release( &ctx->msg_arena );
 }
 
 static void
@@ -242,7 +247,8 @@ maildir_cleanup( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 
-	free_maildir_messages( gctx->msgs );
+	flush_fsyncs();
+	free_maildir_messages( ctx );
 #ifdef USE_DB
 	if (ctx->db)
 		ctx->db->close( ctx->db, 0 );
@@ -410,8 +416,10 @@ static const char *subdirs[] = { "cur", "new", "tmp" };
 
 typedef struct {
 	char *base;
+	char *msgid;
 	int size;
 	uint uid:31, recent:1;
+	uint hdr_hash;
 	char tuid[TUIDL];
 } msg_t;
 
@@ -426,8 +434,10 @@ maildir_free_scan( msglist_t *msglist )
 	int i;
 
 	if (msglist->ents) {
-		for (i = 0; i < msglist->nents; i++)
+		for (i = 0; i < msglist->nents; i++) {
 			free( msglist->ents[i].base );
+			free( msglist->ents[i].msgid );
+		}
 		free( msglist->ents );
 	}
 }
@@ -571,10 +581,12 @@ maildir_store_uidval( maildir_store_t *ctx )
 	{
 		n = sprintf( buf, "%d\n%d\n", ctx->gen.uidvalidity, ctx->nuid );
 		lseek( ctx->uvfd, 0, SEEK_SET );
-		if (write( ctx->uvfd, buf, n ) != n || ftruncate( ctx->uvfd, n ) || (UseFSync && fdatasync( ctx->uvfd ))) {
+		if (write( ctx->uvfd, buf, n ) != n || ftruncate( ctx->uvfd, n ) || (UseFSync == FSYNC_FULL && fdatasync( ctx->uvfd ))) {
 			error( "Maildir error: cannot write UIDVALIDITY.\n" );
 			return DRV_BOX_BAD;
 		}
+		if (UseFSync == FSYNC_BATCH)
+			defer_fsync( ctx->uvfd, 0, 0 );
 	}
 	conf_wakeup( &ctx->lcktmr, 2 );
 	return DRV_OK;
@@ -789,12 +801,63 @@ maildir_compare( const void *l, const void *r )
 	return strcmp( lm->base, rm->base );
 }
 
+/* Obtain the TUID and/or the identification of the message.
+ * The latter requires reading the whole file to determine the CRLF size. */
+static int
+maildir_read_hdr( maildir_store_t *ctx, const char *path, msg_t *entry )
+{
+	const char *tuid;
+	char *hdr;
+	int i, fd, len, hlen, halloc, eoh, had_eoh, sz, vlen;
+
+	if ((fd = open( path, O_RDONLY )) < 0)
+		return -1;
+	hdr = 0;
+	hlen = halloc = eoh = sz = 0;
+	for (;;) {
+		if (hlen + MSG_CHUNK_SIZE > halloc)
+			hdr = nfrealloc( hdr, (halloc = hlen + MSG_CHUNK_SIZE) );
+		if ((len = read( fd, hdr + hlen, MSG_CHUNK_SIZE )) <= 0)
+			break;
+		had_eoh = eoh;
+		for (i = hlen; i < hlen + len; i++) {
+			if (hdr[i] == '\n') {
+				sz++;
+				if (!eoh && (i == 0 || hdr[i - 1] == '\n' || (hdr[i - 1] == '\r' && (i == 1 || hdr[i - 2] == '\n'))))
+					eoh = i + 1;
+			} else if (hdr[i] == '\r') {
+				sz--;
+			}
+		}
+		sz += len;
+		if (!had_eoh)
+			hlen += len; /* subsequent pieces are read past the header */
+		if (eoh && !(ctx->gen.opts & OPEN_MSGID))
+			break;
+	}
+	close( fd );
+	if (len < 0) {
+		free( hdr );
+		return -1;
+	}
+	if (!eoh)
+		eoh = hlen;
+	if ((ctx->gen.opts & OPEN_FIND) && (tuid = find_header( hdr, eoh, "X-TUID", 6, &vlen )) && vlen == TUIDL)
+		memcpy( entry->tuid, tuid, TUIDL );
+	if (ctx->gen.opts & OPEN_MSGID) {
+		entry->msgid = find_msgid( hdr, eoh );
+		entry->hdr_hash = hash_header( hdr, eoh );
+		entry->size = sz;
+	}
+	free( hdr );
+	return 0;
+}
+
 static int
 maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 {
 	maildir_store_conf_t *conf = (maildir_store_conf_t *)ctx->gen.conf;
 	DIR *d;
-	FILE *f;
 	struct dirent *e;
 	const char *u, *ru;
 #ifdef USE_DB
@@ -911,6 +974,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					entry->recent = i;
 					entry->size = 0;
 					entry->tuid[0] = 0;
+					entry->msgid = 0;
 				}
 			}
 			closedir( d );
@@ -982,7 +1046,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 #endif
 				}
 				uid = entry->uid;
-				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid))
+				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) && uid >= ctx->newuid))
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #ifdef USE_DB
 			} else if (ctx->usedb) {
@@ -991,7 +1055,7 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 					return ret;
 				}
 				entry->uid = uid;
-				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid))
+				if ((ctx->gen.opts & OPEN_SIZE) || ((ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) && uid >= ctx->newuid))
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
 #endif /* USE_DB */
 			} else {
@@ -1035,23 +1099,14 @@ maildir_scan( maildir_store_t *ctx, msglist_t *msglist )
 				}
 				entry->size = st.st_size;
 			}
-			if ((ctx->gen.opts & OPEN_FIND) && uid >= ctx->newuid) {
-				if (!(f = fopen( buf, "r" ))) {
+			if ((ctx->gen.opts & (OPEN_FIND|OPEN_MSGID)) && uid >= ctx->newuid) {
+				if (maildir_read_hdr( ctx, buf, entry ) < 0) {
 					if (errno != ENOENT) {
-						sys_error( "Maildir error: cannot open %s", buf );
+						sys_error( "Maildir error: cannot read %s", buf );
 						goto fail;
 					}
 					goto retry;
 				}
-				while (fgets( nbuf, sizeof(nbuf), f )) {
-					if (!nbuf[0] || nbuf[0] == '\n')
-						break;
-					if (starts_with( nbuf, -1, "X-TUID: ", 8 ) && nbuf[8 + TUIDL] == '\n') {
-						memcpy( entry->tuid, nbuf + 8, TUIDL );
-						break;
-					}
-				}
-				fclose( f );
 			}
 		}
 		ctx->uvok = 1;
@@ -1066,6 +1121,9 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 	entry->base = 0; /* prevent deletion */
 	msg->gen.size = entry->size;
 	msg->gen.srec = 0;
+	msg->gen.msgid = entry->msgid;
+	entry->msgid = 0;
+	msg->gen.hdr_hash = entry->hdr_hash;
 	strncpy( msg->gen.tuid, entry->tuid, TUIDL );
 	if (entry->recent)
 		msg->gen.status |= M_RECENT;
@@ -1079,7 +1137,7 @@ maildir_init_msg( maildir_store_t *ctx, maildir_message_t *msg, msg_t *entry )
 static void
 maildir_app_msg( maildir_store_t *ctx, message_t ***msgapp, msg_t *entry )
 {
-	maildir_message_t *msg = nfmalloc( sizeof(*msg) );
+	maildir_message_t *msg = arena_alloc( &ctx->msg_arena );
 	msg->gen.next = **msgapp;
 	**msgapp = &msg->gen;
 	*msgapp = &msg->gen.next;
@@ -1206,6 +1264,9 @@ maildir_delete_box( store_t *gctx,
 		nfsnprintf( buf + bl, sizeof(buf) - bl, ".uidvalidity" );
 		if (unlink( buf ) && errno != ENOENT)
 			goto badrm;
+		nfsnprintf( buf + bl, sizeof(buf) - bl, MSGID_INDEX );
+		if (unlink( buf ) && errno != ENOENT)
+			goto badrm;
 #ifdef USE_DB
 		nfsnprintf( buf + bl, sizeof(buf) - bl, ".isyncuidmap.db" );
 		if (unlink( buf ) && errno != ENOENT)
@@ -1248,6 +1309,24 @@ maildir_prepare_load_box( store_t *gctx, int opts )
 	gctx->opts = opts;
 }
 
+/* Like maildir_compare(), this relies on the suggested unique file name scheme. */
+static time_t
+maildir_arrival( maildir_store_t *ctx, msg_t *entry )
+{
+	struct stat st;
+	char *end;
+	long secs;
+	char buf[_POSIX_PATH_MAX];
+
+	secs = strtol( entry->base, &end, 10 );
+	if (end != entry->base && *end == '.')
+		return (time_t)secs;
+	nfsnprintf( buf, sizeof(buf), "%s/%s/%s", ctx->gen.path, subdirs[entry->recent], entry->base );
+	if (stat( buf, &st ))
+		return 0;
+	return st.st_mtime;
+}
+
 static void
 maildir_load_box( store_t *gctx, int minuid, int maxuid, int newuid, int *excs, int nexcs,
                   void (*cb)( int sts, void *aux ), void *aux )
@@ -1255,7 +1334,7 @@ maildir_load_box( store_t *gctx, int minuid, int maxuid, int newuid, int *excs,
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	message_t **msgapp;
 	msglist_t msglist;
-	int i;
+	int i, winuid;
 
 	ctx->minuid = minuid;
 	ctx->maxuid = maxuid;
@@ -1267,9 +1346,22 @@ maildir_load_box( store_t *gctx, int minuid, int maxuid, int newuid, int *excs,
 		cb( DRV_BOX_BAD, aux );
 		return;
 	}
+	winuid = 0;
+	if (gctx->since) {
+		/* Only messages which are older than all recent ones are ignored,
+		 * so no message which is still being synchronized appears to vanish. */
+		gctx->since_uid = INT_MAX;
+		for (i = 0; i < msglist.nents; i++)
+			if (msglist.ents[i].uid < gctx->since_uid && maildir_arrival( ctx, msglist.ents + i ) >= gctx->since)
+				gctx->since_uid = msglist.ents[i].uid;
+		winuid = gctx->since_uid;
+		if (gctx->keep_uid && winuid > gctx->keep_uid)
+			winuid = gctx->keep_uid;
+	}
 	msgapp = &ctx->gen.msgs;
 	for (i = 0; i < msglist.nents; i++)
-		maildir_app_msg( ctx, &msgapp, msglist.ents + i );
+		if (msglist.ents[i].uid >= winuid)
+			maildir_app_msg( ctx, &msgapp, msglist.ents + i );
 	maildir_free_scan( &msglist );
 
 	cb( DRV_OK, aux );
@@ -1318,6 +1410,7 @@ maildir_rescan( maildir_store_t *ctx )
 			debug( "updating message %d\n", msg->gen.uid );
 			msg->gen.status &= ~(M_FLAGS|M_RECENT);
 			free( msg->base );
+			free( msg->gen.msgid );
 			maildir_init_msg( ctx, msg, msglist.ents + i );
 			i++, msgapp = &msg->gen.next;
 		}
@@ -1343,12 +1436,14 @@ maildir_again( maildir_store_t *ctx, maildir_message_t *msg,
 
 static void
 maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
+                   void (*data_cb)( const char *buf, int len, void *aux ),
                    void (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
-	int fd, ret;
+	int fd, ret, len;
 	struct stat st;
+	char *dbuf;
 	char buf[_POSIX_PATH_MAX];
 
 	for (;;) {
@@ -1360,12 +1455,15 @@ maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
 			return;
 		}
 	}
-	fstat( fd, &st );
-	data->len = st.st_size;
-	if (data->date == -1)
+	if (data->date == -1) {
+		fstat( fd, &st );
 		data->date = st.st_mtime;
-	data->data = nfmalloc( data->len );
-	if (read( fd, data->data, data->len ) != data->len) {
+	}
+	dbuf = nfmalloc( MSG_CHUNK_SIZE );
+	while ((len = read( fd, dbuf, MSG_CHUNK_SIZE )) > 0)
+		data_cb( dbuf, len, aux );
+	free( dbuf );
+	if (len < 0) {
 		sys_error( "Maildir error: cannot read %s", buf );
 		close( fd );
 		cb( DRV_MSG_BAD, aux );
@@ -1392,21 +1490,138 @@ maildir_make_flags( char info_delimiter, int flags, char *buf )
 	return d;
 }
 
+typedef struct {
+	void (*cb)( int sts, int uid, void *aux );
+	void *aux;
+	char *tname, *nname;
+	const char *base; /* points into tname */
+	time_t date;
+	int fd, uid;
+} maildir_store_job_t;
+
+static int
+maildir_finish_msg( int fd, const char *buf, const char *nbuf, time_t date )
+{
+	if (close( fd ) < 0) {
+		/* Quota exceeded may cause this. */
+		sys_error( "Maildir error: cannot write %s", buf );
+		return DRV_BOX_BAD;
+	}
+
+	if (date) {
+		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
+		struct utimbuf utimebuf;
+		utimebuf.actime = utimebuf.modtime = date;
+		if (utime( buf, &utimebuf ) < 0) {
+			sys_error( "Maildir error: cannot set times for %s", buf );
+			return DRV_BOX_BAD;
+		}
+	}
+
+	if (rename( buf, nbuf )) {
+		sys_error( "Maildir error: cannot rename %s to %s", buf, nbuf );
+		return DRV_BOX_BAD;
+	}
+	return DRV_OK;
+}
+
+static void
+maildir_msg_synced( int err, void *aux )
+{
+	maildir_store_job_t *job = (maildir_store_job_t *)aux;
+	int ret;
+
+	if (err) {
+		sys_error( "Maildir error: cannot write %s", job->tname );
+		close( job->fd );
+		ret = DRV_BOX_BAD;
+	} else {
+		ret = maildir_finish_msg( job->fd, job->tname, job->nname, job->date );
+	}
+	job->cb( ret, ret == DRV_OK ? job->uid : 0, job->aux );
+	free( job->tname );
+	free( job->nname );
+	free( job );
+}
+
+static int
+maildir_store_msg_begin( store_t *gctx, msg_data_t *data, int to_trash )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_store_job_t *job;
+	const char *box;
+	int ret, fd, bl;
+	char buf[_POSIX_PATH_MAX];
+
+	box = to_trash ? ctx->trash : gctx->path;
+	bl = nfsnprintf( buf, sizeof(buf), "%s/tmp/", box );
+	nfsnprintf( buf + bl, sizeof(buf) - bl, "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+		if (errno != ENOENT || !to_trash) {
+			sys_error( "Maildir error: cannot create %s", buf );
+			return DRV_BOX_BAD;
+		}
+		if ((ret = maildir_validate( box, 1, ctx )) != DRV_OK)
+			return ret;
+		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+			sys_error( "Maildir error: cannot create %s", buf );
+			return DRV_BOX_BAD;
+		}
+	}
+	job = nfmalloc( sizeof(*job) );
+	job->tname = nfstrdup( buf );
+	job->base = job->tname + bl;
+	job->fd = fd;
+	data->stream = job;
+	return DRV_OK;
+}
+
+static int
+maildir_store_msg_data( store_t *gctx ATTR_UNUSED, msg_data_t *data, const char *buf, int len )
+{
+	maildir_store_job_t *job = (maildir_store_job_t *)data->stream;
+	int ret;
+
+	if ((ret = write( job->fd, buf, len )) != len) {
+		if (ret < 0)
+			sys_error( "Maildir error: cannot write %s", job->tname );
+		else
+			error( "Maildir error: cannot write %s. Disk full?\n", job->tname );
+		return DRV_BOX_BAD;
+	}
+	return DRV_OK;
+}
+
+static void
+maildir_abort_store_msg( store_t *gctx ATTR_UNUSED, msg_data_t *data )
+{
+	maildir_store_job_t *job = (maildir_store_job_t *)data->stream;
+
+	close( job->fd );
+	unlink( job->tname );
+	free( job->tname );
+	free( job );
+	data->stream = 0;
+}
+
 static void
 maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
                    void (*cb)( int sts, int uid, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_store_job_t *job = (maildir_store_job_t *)data->stream;
 	const char *box;
-	int ret, fd, bl, uid;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+	int ret, bl, uid;
+	char nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3];
 
-	bl = nfsnprintf( base, sizeof(base), "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
+	box = to_trash ? ctx->trash : gctx->path;
+	bl = nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s", box, subdirs[!(data->flags & F_SEEN)], job->base );
 	if (!to_trash) {
 #ifdef USE_DB
 		if (ctx->usedb) {
-			if ((ret = maildir_set_uid( ctx, base, &uid )) != DRV_OK) {
-				free( data->data );
+			if ((ret = maildir_set_uid( ctx, job->base, &uid )) != DRV_OK) {
+				maildir_abort_store_msg( gctx, data );
 				cb( ret, 0, aux );
 				return;
 			}
@@ -1414,76 +1629,423 @@ maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 #endif /* USE_DB */
 		{
 			if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
-				free( data->data );
+				maildir_abort_store_msg( gctx, data );
 				cb( ret, 0, aux );
 				return;
 			}
-			nfsnprintf( base + bl, sizeof(base) - bl, ",U=%d", uid );
+			bl += nfsnprintf( nbuf + bl, sizeof(nbuf) - bl, ",U=%d", uid );
 		}
-		box = gctx->path;
 	} else {
 		uid = 0;
-		box = ctx->trash;
 	}
-
 	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, data->flags, fbuf );
-	nfsnprintf( buf, sizeof(buf), "%s/tmp/%s%s", box, base, fbuf );
-	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-		if (errno != ENOENT || !to_trash) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
-		}
-		if ((ret = maildir_validate( box, 1, ctx )) != DRV_OK) {
-			free( data->data );
-			cb( ret, 0, aux );
-			return;
-		}
-		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
-		}
+	nfsnprintf( nbuf + bl, sizeof(nbuf) - bl, "%s", fbuf );
+
+	if (UseFSync == FSYNC_FULL && fsync( job->fd )) {
+		sys_error( "Maildir error: cannot write %s", job->tname );
+		maildir_abort_store_msg( gctx, data );
+		cb( DRV_BOX_BAD, 0, aux );
+		return;
 	}
-	ret = write( fd, data->data, data->len );
-	free( data->data );
-	if (ret != data->len || (UseFSync && (ret = fsync( fd )))) {
-		if (ret < 0)
-			sys_error( "Maildir error: cannot write %s", buf );
-		else
-			error( "Maildir error: cannot write %s. Disk full?\n", buf );
+	data->stream = 0;
+	if (UseFSync == FSYNC_BATCH) {
+		/* The message must not become visible before it is on disk. */
+		job->cb = cb;
+		job->aux = aux;
+		job->nname = nfstrdup( nbuf );
+		job->date = data->date;
+		job->uid = uid;
+		defer_fsync( job->fd, maildir_msg_synced, job );
+		return;
+	}
+	ret = maildir_finish_msg( job->fd, job->tname, nbuf, data->date );
+	free( job->tname );
+	free( job );
+	cb( ret, ret == DRV_OK ? uid : 0, aux );
+}
+
+typedef struct {
+	char *path;
+	int size; /* with CRLF line endings; -1 if not determined yet */
+	char linked; /* path is our own link, rather than the message itself */
+	char tuid[TUIDL]; /* the X-TUID the copy carries, if any */
+} maildir_stash_t;
+
+static maildir_stash_t *
+maildir_new_stash( const char *path, const char *tuid, int linked )
+{
+	maildir_stash_t *stash;
+
+	stash = nfmalloc( sizeof(*stash) );
+	stash->path = nfstrdup( path );
+	stash->size = -1;
+	stash->linked = linked;
+	if (tuid)
+		memcpy( stash->tuid, tuid, TUIDL );
+	else
+		stash->tuid[0] = 0;
+	return stash;
+}
+
+static maildir_stash_t *
+maildir_make_stash( store_t *gctx, const char *path, const char *tuid )
+{
+	char nbuf[_POSIX_PATH_MAX];
+
+	/* The message's own box may be deleted before the run ends, while the Inbox may not. */
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/tmp/%ld.%d_%d.%s", ((maildir_store_conf_t *)gctx->conf)->inbox,
+	            (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	if (link( path, nbuf )) {
+		debug( "cannot stash %s: %s\n", path, strerror( errno ) );
+		return 0;
+	}
+	return maildir_new_stash( nbuf, tuid, 1 );
+}
+
+/* Obtain the Message-ID and the X-TUID (if any) of the given message file. */
+static char *
+maildir_read_msgid( const char *path, char *tuid )
+{
+	const char *val;
+	char *msgid;
+	int fd, len, vlen;
+	char hbuf[16384];
+
+	if ((fd = open( path, O_RDONLY )) < 0)
+		return 0;
+	len = read( fd, hbuf, sizeof(hbuf) );
+	close( fd );
+	if (len <= 0 || !(msgid = find_msgid( hbuf, len )))
+		return 0;
+	if ((val = find_header( hbuf, len, "X-TUID", 6, &vlen )) && vlen == TUIDL)
+		memcpy( tuid, val, TUIDL );
+	else
+		tuid[0] = 0;
+	return msgid;
+}
+
+static void *
+maildir_stash_msg( store_t *gctx, message_t *gmsg, char **msgid )
+{
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+	maildir_stash_t *stash;
+	char buf[_POSIX_PATH_MAX], tuid[TUIDL];
+
+	nfsnprintf( buf, sizeof(buf), "%s/%s/%s", gctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
+	if (!(*msgid = maildir_read_msgid( buf, tuid )))
+		return 0;
+	if (!(stash = maildir_make_stash( gctx, buf, tuid[0] ? tuid : 0 )))
+		free( *msgid );
+	return stash;
+}
+
+static void *
+maildir_stash_stored_msg( store_t *gctx, msg_data_t *data, const char *tuid )
+{
+	maildir_store_job_t *job = (maildir_store_job_t *)data->stream;
+
+	return maildir_make_stash( gctx, job->tname, tuid );
+}
+
+/* The Message-IDs of a box's messages are kept in a file, so only the headers
+ * of messages which arrived since the previous run need to be read. Maildir
+ * messages do not change, so the unique part of the file name identifies the
+ * contents. As this is merely a cache, it is neither locked nor synced. */
+typedef struct {
+	const char *key; /* unique part of the file name */
+	const char *msgid; /* null if the message has none */
+	const char *tuid; /* null if the message has no X-TUID */
+	int klen;
+	int seen;
+} maildir_msgid_ent_t;
+
+typedef struct {
+	char *buf;
+	int len, alloc;
+} maildir_msgid_out_t;
+
+static uint
+maildir_hash_key( const char *key, int klen )
+{
+	uint h = 0;
+
+	while (--klen >= 0)
+		h = h * 33 + (uchar)*key++;
+	return h * 1103515245U;
+}
+
+static void
+maildir_put_msgid_ent( maildir_msgid_out_t *out, const char *key, int klen, const char *msgid, const char *tuid )
+{
+	int need = TUIDL + klen + (msgid ? strlen( msgid ) : 0) + 4;
+
+	if (out->len + need > out->alloc) {
+		out->alloc = (out->len + need) * 2;
+		out->buf = nfrealloc( out->buf, out->alloc );
+	}
+	out->len += nfsnprintf( out->buf + out->len, out->alloc - out->len, "%.*s %.*s %s\n",
+	                        tuid ? TUIDL : 1, tuid ? tuid : "-", klen, key, msgid ? msgid : "" );
+}
+
+/* Parse the index file in place. Malformed entries are dropped, so the
+ * respective messages are simply read again. */
+static maildir_msgid_ent_t *
+maildir_load_msgids( const char *path, char **ibuf, int *nents )
+{
+	maildir_msgid_ent_t *ents;
+	struct stat st;
+	char *p, *eol, *sp, *kp;
+	int fd, len, n;
+	char buf[_POSIX_PATH_MAX];
+
+	*ibuf = 0;
+	*nents = 0;
+	nfsnprintf( buf, sizeof(buf), "%s/" MSGID_INDEX, path );
+	if ((fd = open( buf, O_RDONLY )) < 0)
+		return 0;
+	if (fstat( fd, &st )) {
 		close( fd );
-		cb( DRV_BOX_BAD, 0, aux );
+		return 0;
+	}
+	*ibuf = nfmalloc( st.st_size + 1 );
+	if ((len = read( fd, *ibuf, st.st_size )) < 0)
+		len = 0;
+	close( fd );
+	(*ibuf)[len] = 0;
+	for (n = 0, p = *ibuf; (p = strchr( p, '\n' )); p++)
+		n++;
+	ents = nfmalloc( (n + 1) * sizeof(*ents) );
+	for (n = 0, p = *ibuf; (eol = strchr( p, '\n' )); p = eol + 1) {
+		*eol = 0;
+		if (!(sp = strchr( p, ' ' )) || (sp - p != TUIDL && !(sp - p == 1 && *p == '-')))
+			continue;
+		kp = sp + 1;
+		if (!(sp = strchr( kp, ' ' )) || sp == kp)
+			continue;
+		ents[n].tuid = *p == '-' ? 0 : p;
+		ents[n].key = kp;
+		ents[n].klen = sp - kp;
+		ents[n].msgid = sp[1] ? sp + 1 : 0;
+		ents[n].seen = 0;
+		n++;
+	}
+	*nents = n;
+	return ents;
+}
+
+static void
+maildir_save_msgids( const char *path, maildir_msgid_out_t *out )
+{
+	int fd, bl;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+
+	bl = nfsnprintf( buf, sizeof(buf), "%s/tmp/", path );
+	nfsnprintf( buf + bl, sizeof(buf) - bl, "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/" MSGID_INDEX, path );
+	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
+		debug( "cannot write %s: %s\n", buf, strerror( errno ) );
 		return;
 	}
-	if (close( fd ) < 0) {
-		/* Quota exceeded may cause this. */
-		sys_error( "Maildir error: cannot write %s", buf );
-		cb( DRV_BOX_BAD, 0, aux );
+	if (write( fd, out->buf, out->len ) != out->len || close( fd ) || rename( buf, nbuf )) {
+		debug( "cannot write %s: %s\n", nbuf, strerror( errno ) );
+		unlink( buf );
+	}
+}
+
+static void
+maildir_stash_box_msgs( store_t *gctx, const char *name,
+                        void (*cb)( void *stash, char *msgid, void *aux ), void *aux )
+{
+	maildir_store_conf_t *conf = (maildir_store_conf_t *)gctx->conf;
+	maildir_msgid_ent_t *ents, *ent, **entmap;
+	maildir_msgid_out_t out;
+	DIR *dir;
+	struct dirent *e;
+	char *path, *msgid, *ibuf;
+	uint hashsz, idx;
+	int i, bl, kl, nents, dirty;
+	char buf[_POSIX_PATH_MAX], tuid[TUIDL];
+
+	/* This must not disturb the currently selected box. */
+	if (starts_with( name, -1, "INBOX", 5 ) && (!name[5] || name[5] == '/'))
+		path = maildir_join_path( conf, conf->inbox, name + 5 );
+	else if (conf->gen.path)
+		path = maildir_join_path( conf, conf->gen.path, name );
+	else
 		return;
+	if (!path)
+		return;
+	ents = maildir_load_msgids( path, &ibuf, &nents );
+	hashsz = bucketsForSize( nents * 3 );
+	entmap = nfcalloc( hashsz * sizeof(*entmap) );
+	for (i = 0; i < nents; i++) {
+		idx = maildir_hash_key( ents[i].key, ents[i].klen ) % hashsz;
+		while (entmap[idx])
+			if (++idx == hashsz)
+				idx = 0;
+		entmap[idx] = &ents[i];
 	}
+	out.buf = 0;
+	out.len = out.alloc = 0;
+	dirty = 0;
+	for (i = 0; i < 2; i++) {
+		bl = nfsnprintf( buf, sizeof(buf), "%s/%s/", path, subdirs[i] );
+		if (!(dir = opendir( buf )))
+			continue;
+		while ((e = readdir( dir ))) {
+			if (*e->d_name == '.')
+				continue;
+			nfsnprintf( buf + bl, sizeof(buf) - bl, "%s", e->d_name );
+			kl = strcspn( e->d_name, conf->info_stop );
+			for (idx = maildir_hash_key( e->d_name, kl ) % hashsz; (ent = entmap[idx]); ) {
+				if (ent->klen == kl && !memcmp( ent->key, e->d_name, kl ))
+					break;
+				if (++idx == hashsz)
+					idx = 0;
+			}
+			if (ent) {
+				ent->seen = 1;
+				if (ent->msgid)
+					cb( maildir_new_stash( buf, ent->tuid, 0 ), nfstrdup( ent->msgid ), aux );
+				continue;
+			}
+			msgid = maildir_read_msgid( buf, tuid );
+			/* Such names could not be told apart in the index. */
+			if (!strpbrk( e->d_name, " \n" )) {
+				maildir_put_msgid_ent( &out, e->d_name, kl, msgid, msgid && tuid[0] ? tuid : 0 );
+				dirty = 1;
+			}
+			if (msgid)
+				cb( maildir_new_stash( buf, tuid[0] ? tuid : 0, 0 ), msgid, aux );
+		}
+		closedir( dir );
+	}
+	/* Entries of messages which are gone are dropped. */
+	for (i = 0; i < nents; i++) {
+		if (ents[i].seen)
+			maildir_put_msgid_ent( &out, ents[i].key, ents[i].klen, ents[i].msgid, ents[i].tuid );
+		else
+			dirty = 1;
+	}
+	if (dirty)
+		maildir_save_msgids( path, &out );
+	free( out.buf );
+	free( entmap );
+	free( ents );
+	free( ibuf );
+	free( path );
+}
 
-	if (data->date) {
-		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
-		struct utimbuf utimebuf;
-		utimebuf.actime = utimebuf.modtime = data->date;
-		if (utime( buf, &utimebuf ) < 0) {
-			sys_error( "Maildir error: cannot set times for %s", buf );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+/* Write a new copy of a stashed message which lacks an X-TUID, adding the given one. */
+static int
+maildir_copy_stashed_msg( store_t *gctx, maildir_stash_t *stash, const char *tuid, msg_data_t *data )
+{
+	struct stat st;
+	const char *p, *eol;
+	char *fbuf;
+	int fd, len, eoh, tl, ret;
+	char tbuf[8 + TUIDL + 2];
+
+	if ((fd = open( stash->path, O_RDONLY )) < 0)
+		return DRV_MSG_BAD;
+	if (fstat( fd, &st )) {
+		close( fd );
+		return DRV_MSG_BAD;
+	}
+	fbuf = nfmalloc( st.st_size + 1 );
+	len = read( fd, fbuf, st.st_size + 1 );
+	close( fd );
+	if (len != st.st_size) {
+		free( fbuf );
+		return DRV_MSG_BAD;
+	}
+	for (p = fbuf; ; p = eol + 1) {
+		if (!(eol = memchr( p, '\n', fbuf + len - p ))) {
+			/* Not a complete message. */
+			free( fbuf );
+			return DRV_MSG_BAD;
 		}
+		if (p == eol || (*p == '\r' && p + 1 == eol))
+			break;
+	}
+	eoh = p - fbuf;
+	memcpy( tbuf, "X-TUID: ", 8 );
+	memcpy( tbuf + 8, tuid, TUIDL );
+	tl = 8 + TUIDL;
+	if (eol != p)
+		tbuf[tl++] = '\r';
+	tbuf[tl++] = '\n';
+	if ((ret = maildir_store_msg_begin( gctx, data, 0 )) == DRV_OK) {
+		if ((ret = maildir_store_msg_data( gctx, data, fbuf, eoh )) != DRV_OK ||
+		    (ret = maildir_store_msg_data( gctx, data, tbuf, tl )) != DRV_OK ||
+		    (ret = maildir_store_msg_data( gctx, data, fbuf + eoh, len - eoh )) != DRV_OK)
+			maildir_abort_store_msg( gctx, data );
 	}
+	free( fbuf );
+	return ret;
+}
 
-	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
-	nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s%s", box, subdirs[!(data->flags & F_SEEN)], base, fbuf );
-	if (rename( buf, nbuf )) {
-		sys_error( "Maildir error: cannot rename %s to %s", buf, nbuf );
-		cb( DRV_BOX_BAD, 0, aux );
-		return;
+static int
+maildir_store_stashed_msg( store_t *gctx, void *vstash, int size, char *tuid, msg_data_t *data )
+{
+	maildir_stash_t *stash = (maildir_stash_t *)vstash;
+	maildir_store_job_t *job;
+	int i, fd, len, sz, bl;
+	char *dbuf;
+	char buf[_POSIX_PATH_MAX];
+
+	if (stash->size < 0) {
+		if ((fd = open( stash->path, O_RDONLY )) < 0)
+			return DRV_MSG_BAD;
+		dbuf = nfmalloc( MSG_CHUNK_SIZE );
+		for (sz = 0; (len = read( fd, dbuf, MSG_CHUNK_SIZE )) > 0; sz += len)
+			for (i = 0; i < len; i++)
+				if (dbuf[i] == '\n')
+					sz++;
+				else if (dbuf[i] == '\r')
+					sz--;
+		free( dbuf );
+		close( fd );
+		if (len < 0)
+			return DRV_MSG_BAD;
+		stash->size = sz;
+	}
+	/* Either copy may have gained an X-TUID header. */
+	if (stash->size != size && stash->size != size + 8 + TUIDL + 2 &&
+	    (stash->tuid[0] || stash->size + 8 + TUIDL + 2 != size))
+		return DRV_MSG_BAD;
+	/* Without an X-TUID, a linked copy could not be found again after an interruption. */
+	if (!stash->tuid[0])
+		return maildir_copy_stashed_msg( gctx, stash, tuid, data );
+	bl = nfsnprintf( buf, sizeof(buf), "%s/tmp/", gctx->path );
+	nfsnprintf( buf + bl, sizeof(buf) - bl, "%ld.%d_%d.%s", (long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	if (link( stash->path, buf )) {
+		debug( "cannot re-use %s: %s\n", stash->path, strerror( errno ) );
+		return DRV_MSG_BAD;
 	}
-	cb( DRV_OK, uid, aux );
+	if ((fd = open( buf, O_RDONLY )) < 0) {
+		sys_error( "Maildir error: cannot open %s", buf );
+		unlink( buf );
+		return DRV_MSG_BAD;
+	}
+	job = nfmalloc( sizeof(*job) );
+	job->tname = nfstrdup( buf );
+	job->base = job->tname + bl;
+	job->fd = fd;
+	data->stream = job;
+	memcpy( tuid, stash->tuid, TUIDL );
+	return DRV_OK;
+}
+
+static void
+maildir_free_stash( void *vstash )
+{
+	maildir_stash_t *stash = (maildir_stash_t *)vstash;
+
+	if (stash->linked)
+		unlink( stash->path );
+	free( stash->path );
+	free( stash );
 }
 
 static void
@@ -1665,6 +2227,7 @@ static void
 maildir_cancel_cmds( store_t *gctx ATTR_UNUSED,
                      void (*cb)( void *aux ), void *aux )
 {
+	flush_fsyncs();
 	cb( aux );
 }
 
@@ -1758,7 +2321,15 @@ struct driver maildir_driver = {
 	maildir_prepare_load_box,
 	maildir_load_box,
 	maildir_fetch_msg,
+	maildir_store_msg_begin,
+	maildir_store_msg_data,
 	maildir_store_msg,
+	maildir_abort_store_msg,
+	maildir_stash_msg,
+	maildir_stash_stored_msg,
+	maildir_stash_box_msgs,
+	maildir_store_stashed_msg,
+	maildir_free_stash,
 	maildir_find_new_msgs,
 	maildir_set_msg_flags,
 	maildir_trash_msg,
@@ -1766,5 +2337,6 @@ struct driver maildir_driver = {
 	maildir_cancel_cmds,
 	maildir_commit_cmds,
 	maildir_memory_usage,
+	0, /* buffer_limit */
 	maildir_fail_state,
 };
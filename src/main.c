@@ -27,12 +27,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/wait.h>
 
 int DFlags;
-int UseFSync = 1;
+int UseFSync = FSYNC_FULL;
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__) || defined(__CYGWIN__)
 char FieldDelimiter = ';';
 #else
@@ -44,6 +45,9 @@ char Hostname[256];	/* for maildir */
 const char *Home;	/* for config */
 
 int BufferLimit = 10 * 1024 * 1024;
+int BufferLimitMin; /* if non-zero, the buffer limit is adapted, and BufferLimit is the upper bound */
+int ParallelChannels = 1;
+int MaxConnections = INT_MAX;
 
 int chans_total, chans_done;
 int boxes_total, boxes_done;
@@ -354,28 +358,54 @@ add_named_channel( chan_ent_t ***chanapp, char *channame, int ops[] )
 	return ce;
 }
 
+typedef struct main_vars main_vars_t;
+typedef struct chan_vars chan_vars_t;
+
+/* A pair of stores on which one box at a time is synced. */
 typedef struct {
 	int t[2];
+	chan_vars_t *cvars;
+	store_t *ctx[2];
+	char *names[2];
+	int state[2];
+	char busy, dead;
+} lane_t;
+
+/* A channel which is being synced. */
+struct chan_vars {
+	chan_vars_t *next;
+	main_vars_t *mvars;
 	channel_conf_t *chan;
 	driver_t *drv[2];
-	store_t *ctx[2];
+	const char *labels[2];
+	lane_t *lanes;
 	chan_ent_t *chanptr;
 	box_ent_t *boxptr;
-	char *names[2];
-	int ret, all, list, state[2];
-	char done, skip, cben;
-} main_vars_t;
-
-#define AUX &mvars->t[t]
-#define MVARS(aux) \
+	move_map_t *moves;
+	int nlanes, busy;
+	int ret, starved;
+	char skip, cben, single, wake;
+};
+
+struct main_vars {
+	chan_ent_t *chanptr; /* the channels which were not started yet */
+	chan_vars_t *chans; /* the channels which are being synced */
+	int nchans;
+	int ret, all, list;
+	char cben, resched;
+};
+
+#define AUX &lane->t[t]
+#define LVARS(aux) \
 	int t = *(int *)aux; \
-	main_vars_t *mvars = (main_vars_t *)(((char *)(&((int *)aux)[-t])) - offsetof(main_vars_t, t));
+	lane_t *lane = (lane_t *)(((char *)(&((int *)aux)[-t])) - offsetof(lane_t, t)); \
+	chan_vars_t *cvars = lane->cvars;
 
 #define E_START  0
 #define E_OPEN   1
 #define E_SYNC   2
 
-static void sync_chans( main_vars_t *mvars, int ent );
+static void sched_chans( main_vars_t *mvars );
 
 int
 main( int argc, char **argv )
@@ -400,7 +430,6 @@ main( int argc, char **argv )
 	arc4_init();
 
 	memset( mvars, 0, sizeof(*mvars) );
-	mvars->t[1] = 1;
 
 	for (oind = 1, ochar = 0; ; ) {
 		if (!ochar || !*ochar) {
@@ -719,7 +748,7 @@ main( int argc, char **argv )
 	if (!mvars->list)
 		stats();
 	mvars->cben = 1;
-	sync_chans( mvars, E_START );
+	sched_chans( mvars );
 	main_loop();
 	if (!mvars->list)
 		flushn();
@@ -732,192 +761,441 @@ main( int argc, char **argv )
 #define ST_CANCELING 3
 #define ST_CLOSED    4
 
+static void sync_chans( chan_vars_t *cvars, int ent );
+
 static void
 cancel_prep_done( void *aux )
 {
-	MVARS(aux)
+	LVARS(aux)
+
+	cvars->drv[t]->free_store( lane->ctx[t] );
+	lane->state[t] = ST_CLOSED;
+	sched_chans( cvars->mvars );
+	sync_chans( cvars, lane == cvars->lanes ? E_OPEN : E_SYNC );
+}
+
+static void
+close_lane( lane_t *lane )
+{
+	chan_vars_t *cvars = lane->cvars;
+	int t;
+
+	for (t = 0; t < 2; t++)
+		if (lane->state[t] == ST_FRESH) {
+			/* An unconnected store may be only cancelled. */
+			lane->state[t] = ST_CLOSED;
+			cvars->drv[t]->cancel_store( lane->ctx[t] );
+		} else if (lane->state[t] == ST_CONNECTED || lane->state[t] == ST_OPEN) {
+			lane->state[t] = ST_CANCELING;
+			cvars->drv[t]->cancel_cmds( lane->ctx[t], cancel_prep_done, AUX );
+		}
+}
 
-	mvars->drv[t]->free_store( mvars->ctx[t] );
-	mvars->state[t] = ST_CLOSED;
-	sync_chans( mvars, E_OPEN );
+/* Only the first lane is essential. The server may well refuse additional
+ * connections, so the channel simply carries on without the others. */
+static void
+drop_lane( lane_t *lane )
+{
+	chan_vars_t *cvars = lane->cvars;
+
+	notice( "Notice: dropping parallel connection to %s.\n", cvars->chan->name );
+	lane->dead = 1;
+	cvars->cben = 0;
+	close_lane( lane );
+	cvars->cben = 1;
+	sched_chans( cvars->mvars );
+	sync_chans( cvars, E_SYNC );
 }
 
 static void
 store_bad( void *aux )
 {
-	MVARS(aux)
+	LVARS(aux)
 
-	mvars->drv[t]->cancel_store( mvars->ctx[t] );
-	mvars->state[t] = ST_CLOSED;
-	mvars->ret = mvars->skip = 1;
-	sync_chans( mvars, E_OPEN );
+	cvars->drv[t]->cancel_store( lane->ctx[t] );
+	lane->state[t] = ST_CLOSED;
+	if (lane != cvars->lanes && !cvars->skip) {
+		drop_lane( lane );
+		return;
+	}
+	cvars->ret = cvars->skip = 1;
+	sched_chans( cvars->mvars );
+	sync_chans( cvars, E_OPEN );
 }
 
 static void store_connected( int sts, void *aux );
 static void store_listed( int sts, void *aux );
-static int sync_listed_boxes( main_vars_t *mvars, box_ent_t *mbox );
+static void sync_listed_boxes( lane_t *lane, box_ent_t *mbox );
 static void done_sync_2_dyn( int sts, void *aux );
 static void done_sync( int sts, void *aux );
 
 #define nz(a,b) ((a)?(a):(b))
 
+static int
+shares_store( main_vars_t *mvars, channel_conf_t *chan )
+{
+	chan_vars_t *cvars;
+	int t, u;
+
+	for (cvars = mvars->chans; cvars; cvars = cvars->next)
+		for (t = 0; t < 2; t++)
+			for (u = 0; u < 2; u++)
+				if (cvars->chan->stores[t] == chan->stores[u])
+					return 1;
+	return 0;
+}
+
 static void
-sync_chans( main_vars_t *mvars, int ent )
+start_chan( main_vars_t *mvars, chan_ent_t *ce )
 {
-	box_ent_t *mbox, *nmbox, **mboxapp;
-	char **boxes[2];
-	const char *labels[2];
-	int t, mb, sb, cmp;
+	chan_vars_t *cvars, **cvarsp;
+
+	cvars = nfcalloc( sizeof(*cvars) );
+	cvars->mvars = mvars;
+	cvars->chanptr = ce;
+	cvars->chan = ce->conf;
+	if ((cvars->chan->detect_moves || cvars->chan->link_dups) && !mvars->list)
+		cvars->moves = new_move_map();
+	cvars->cben = 1;
+	for (cvarsp = &mvars->chans; *cvarsp; cvarsp = &(*cvarsp)->next) ;
+	*cvarsp = cvars;
+	mvars->nchans++;
+	sync_chans( cvars, E_START );
+}
+
+static void
+done_chan( chan_vars_t *cvars )
+{
+	main_vars_t *mvars = cvars->mvars;
+	chan_vars_t **cvarsp;
 
-	if (!mvars->cben)
+	if (!mvars->list) {
+		chans_done++;
+		stats();
+	}
+	if (ParallelChannels > 1) {
+		/* The output of concurrent channels is interleaved, so sum it up. */
+		if (cvars->ret)
+			error( "Channel %s failed.\n", cvars->chan->name );
+		else
+			info( "Channel %s done.\n", cvars->chan->name );
+	}
+	if (cvars->ret)
+		mvars->ret = 1;
+	for (cvarsp = &mvars->chans; *cvarsp != cvars; cvarsp = &(*cvarsp)->next) ;
+	*cvarsp = cvars->next;
+	mvars->nchans--;
+	free_move_map( cvars->moves );
+	free( cvars );
+	sched_chans( mvars );
+}
+
+/* Start as many channels as permitted, and let the channels which are waiting
+ * for server connections retry. Channels may complete synchronously, and may
+ * release connections while doing so, so keep going until nothing changes. */
+static void
+sched_chans( main_vars_t *mvars )
+{
+	chan_vars_t *cvars;
+	chan_ent_t *ce, **cep;
+	int t, ent;
+
+	if (!mvars->cben) {
+		mvars->resched = 1;
 		return;
-	switch (ent) {
-	case E_OPEN: goto opened;
-	case E_SYNC: goto syncone;
 	}
+	mvars->cben = 0;
 	do {
-		mvars->chan = mvars->chanptr->conf;
-		info( "Channel %s\n", mvars->chan->name );
-		mvars->skip = mvars->cben = 0;
-		for (t = 0; t < 2; t++) {
-			int st = mvars->chan->stores[t]->driver->fail_state( mvars->chan->stores[t] );
-			if (st != FAIL_TEMP) {
-				info( "Skipping due to %sfailed %s store %s.\n",
-				      (st == FAIL_WAIT) ? "temporarily " : "", str_ms[t], mvars->chan->stores[t]->name );
-				mvars->skip = 1;
+		mvars->resched = 0;
+		for (cvars = mvars->chans; cvars; cvars = cvars->next)
+			cvars->wake = cvars->starved != 0;
+	  rewake:
+		for (cvars = mvars->chans; cvars; cvars = cvars->next) {
+			if (cvars->wake) {
+				cvars->wake = 0;
+				if (cvars->cben) {
+					ent = cvars->starved;
+					cvars->starved = 0;
+					sync_chans( cvars, ent );
+					/* The channel may be gone now. */
+					goto rewake;
+				}
 			}
 		}
-		if (mvars->skip)
-			goto next2;
-		mvars->state[M] = mvars->state[S] = ST_FRESH;
-		if (mvars->chan->stores[M]->driver->flags & mvars->chan->stores[S]->driver->flags & DRV_VERBOSE)
-			labels[M] = "M: ", labels[S] = "S: ";
-		else
-			labels[M] = labels[S] = "";
-		for (t = 0; t < 2; t++) {
-			mvars->drv[t] = mvars->chan->stores[t]->driver;
-			mvars->ctx[t] = mvars->drv[t]->alloc_store( mvars->chan->stores[t], labels[t] );
-			set_bad_callback( mvars->ctx[t], store_bad, AUX );
+		for (cep = &mvars->chanptr; (ce = *cep) && mvars->nchans < (mvars->list ? 1 : ParallelChannels); ) {
+			if (shares_store( mvars, ce->conf )) {
+				cep = &ce->next;
+			} else {
+				*cep = ce->next;
+				start_chan( mvars, ce );
+			}
 		}
-		for (t = 0; ; t++) {
-			info( "Opening %s store %s...\n", str_ms[t], mvars->chan->stores[t]->name );
-			mvars->drv[t]->connect_store( mvars->ctx[t], store_connected, AUX );
-			if (t || mvars->skip)
-				break;
+		if (!mvars->resched && mvars->chans) {
+			for (cvars = mvars->chans; cvars; cvars = cvars->next)
+				if (cvars->starved != E_OPEN)
+					break;
+			if (!cvars) {
+				/* No channel holds any connections which could be freed up. */
+				cvars = mvars->chans;
+				error( "Error: connection limits do not permit syncing channel %s\n", cvars->chan->name );
+				cvars->ret = cvars->skip = 1;
+				cvars->starved = 0;
+				sync_chans( cvars, E_OPEN );
+			}
 		}
+	} while (mvars->resched);
+	if (!mvars->chans && !mvars->chanptr) {
+		/* All done; stay disabled. */
+		for (t = 0; t < N_DRIVERS; t++)
+			drivers[t]->cleanup();
+		return;
+	}
+	mvars->cben = 1;
+}
 
-		mvars->cben = 1;
-	  opened:
-		if (mvars->skip)
-			goto next;
-		if (mvars->state[M] != ST_OPEN || mvars->state[S] != ST_OPEN)
+static int
+open_lane( lane_t *lane )
+{
+	chan_vars_t *cvars = lane->cvars;
+	int t;
+
+	for (t = 0; t < 2; t++) {
+		if (!(lane->ctx[t] = cvars->drv[t]->alloc_store( cvars->chan->stores[t], cvars->labels[t] ))) {
+			/* Connection limit reached; try again when something is released. */
+			if (t)
+				cvars->drv[M]->free_store( lane->ctx[M] );
+			return 0;
+		}
+	}
+	lane->state[M] = lane->state[S] = ST_FRESH;
+	for (t = 0; t < 2; t++)
+		set_bad_callback( lane->ctx[t], store_bad, AUX );
+	for (t = 0; ; t++) {
+		info( "Opening %s store %s...\n", str_ms[t], cvars->chan->stores[t]->name );
+		cvars->drv[t]->connect_store( lane->ctx[t], store_connected, AUX );
+		if (t || cvars->skip)
+			break;
+	}
+	return 1;
+}
+
+static void
+sync_chans( chan_vars_t *cvars, int ent )
+{
+	main_vars_t *mvars = cvars->mvars;
+	box_ent_t *mbox, *nmbox, **mboxapp;
+	lane_t *lane;
+	char *name, **boxes[2];
+	int t, l, mb, sb, cmp, started, opening;
+
+	if (!cvars->cben)
+		return;
+	switch (ent) {
+	case E_OPEN: goto opened;
+	case E_SYNC: goto syncml;
+	}
+	info( "Channel %s\n", cvars->chan->name );
+	for (t = 0; t < 2; t++) {
+		int st = cvars->chan->stores[t]->driver->fail_state( cvars->chan->stores[t] );
+		if (st != FAIL_TEMP) {
+			info( "Skipping due to %sfailed %s store %s.\n",
+			      (st == FAIL_WAIT) ? "temporarily " : "", str_ms[t], cvars->chan->stores[t]->name );
+			cvars->skip = 1;
+		}
+	}
+	if (cvars->skip)
+		goto next2;
+	if (cvars->chan->stores[M]->driver->flags & cvars->chan->stores[S]->driver->flags & DRV_VERBOSE)
+		cvars->labels[M] = "M: ", cvars->labels[S] = "S: ";
+	else
+		cvars->labels[M] = cvars->labels[S] = "";
+	for (t = 0; t < 2; t++)
+		cvars->drv[t] = cvars->chan->stores[t]->driver;
+	/* The first lane lists the boxes; the others are opened only once there is work. */
+	cvars->nlanes = mvars->list ? 1 : cvars->chan->parallel_boxes;
+	cvars->lanes = nfcalloc( cvars->nlanes * sizeof(lane_t) );
+	for (l = 0; l < cvars->nlanes; l++) {
+		lane = &cvars->lanes[l];
+		lane->t[1] = 1;
+		lane->cvars = cvars;
+		lane->state[M] = lane->state[S] = ST_CLOSED;
+	}
+
+  opened:
+	if (cvars->skip)
+		goto next;
+	lane = cvars->lanes;
+	if (lane->state[M] == ST_CLOSED && lane->state[S] == ST_CLOSED) {
+		cvars->cben = 0;
+		started = open_lane( lane );
+		cvars->cben = 1;
+		if (!started) {
+			cvars->starved = E_OPEN;
 			return;
+		}
+		if (cvars->skip)
+			goto next;
+	}
+	if (lane->state[M] != ST_OPEN || lane->state[S] != ST_OPEN)
+		return;
 
-		if (!mvars->chanptr->boxlist && mvars->chan->patterns) {
-			mvars->chanptr->boxlist = 2;
-			boxes[M] = filter_boxes( mvars->ctx[M]->boxes, mvars->chan->boxes[M], mvars->chan->patterns );
-			boxes[S] = filter_boxes( mvars->ctx[S]->boxes, mvars->chan->boxes[S], mvars->chan->patterns );
-			mboxapp = &mvars->chanptr->boxes;
-			for (mb = sb = 0; ; ) {
-				char *mname = boxes[M] ? boxes[M][mb] : 0;
-				char *sname = boxes[S] ? boxes[S][sb] : 0;
-				if (!mname && !sname)
-					break;
-				mbox = nfmalloc( sizeof(*mbox) );
-				if (!(cmp = !mname - !sname) && !(cmp = cmp_box_names( &mname, &sname ))) {
-					mbox->name = mname;
-					free( sname );
-					mbox->present[M] = mbox->present[S] = BOX_PRESENT;
-					mb++;
-					sb++;
-				} else if (cmp < 0) {
-					mbox->name = mname;
-					mbox->present[M] = BOX_PRESENT;
-					mbox->present[S] = (!mb && !strcmp( mbox->name, "INBOX" )) ? BOX_PRESENT : BOX_ABSENT;
-					mb++;
-				} else {
-					mbox->name = sname;
-					mbox->present[M] = (!sb && !strcmp( mbox->name, "INBOX" )) ? BOX_PRESENT : BOX_ABSENT;
-					mbox->present[S] = BOX_PRESENT;
-					sb++;
-				}
-				mbox->next = 0;
-				*mboxapp = mbox;
-				mboxapp = &mbox->next;
-				boxes_total++;
+	if (!cvars->chanptr->boxlist && cvars->chan->patterns) {
+		cvars->chanptr->boxlist = 2;
+		boxes[M] = filter_boxes( lane->ctx[M]->boxes, cvars->chan->boxes[M], cvars->chan->patterns );
+		boxes[S] = filter_boxes( lane->ctx[S]->boxes, cvars->chan->boxes[S], cvars->chan->patterns );
+		mboxapp = &cvars->chanptr->boxes;
+		for (mb = sb = 0; ; ) {
+			char *mname = boxes[M] ? boxes[M][mb] : 0;
+			char *sname = boxes[S] ? boxes[S][sb] : 0;
+			if (!mname && !sname)
+				break;
+			mbox = nfmalloc( sizeof(*mbox) );
+			if (!(cmp = !mname - !sname) && !(cmp = cmp_box_names( &mname, &sname ))) {
+				mbox->name = mname;
+				free( sname );
+				mbox->present[M] = mbox->present[S] = BOX_PRESENT;
+				mb++;
+				sb++;
+			} else if (cmp < 0) {
+				mbox->name = mname;
+				mbox->present[M] = BOX_PRESENT;
+				mbox->present[S] = (!mb && !strcmp( mbox->name, "INBOX" )) ? BOX_PRESENT : BOX_ABSENT;
+				mb++;
+			} else {
+				mbox->name = sname;
+				mbox->present[M] = (!sb && !strcmp( mbox->name, "INBOX" )) ? BOX_PRESENT : BOX_ABSENT;
+				mbox->present[S] = BOX_PRESENT;
+				sb++;
 			}
-			free( boxes[M] );
-			free( boxes[S] );
-			if (!mvars->list)
-				stats();
+			mbox->next = 0;
+			*mboxapp = mbox;
+			mboxapp = &mbox->next;
+			boxes_total++;
 		}
-		mvars->boxptr = mvars->chanptr->boxes;
-
-		if (mvars->list && chans_total > 1)
-			printf( "%s:\n", mvars->chan->name );
-	  syncml:
-		mvars->done = mvars->cben = 0;
-		if (mvars->chanptr->boxlist) {
-			while ((mbox = mvars->boxptr)) {
-				mvars->boxptr = mbox->next;
-				if (sync_listed_boxes( mvars, mbox ))
-					goto syncw;
+		free( boxes[M] );
+		free( boxes[S] );
+		if (!mvars->list)
+			stats();
+	}
+
+	if (mvars->list) {
+		if (chans_total > 1)
+			printf( "%s:\n", cvars->chan->name );
+		if (cvars->chanptr->boxlist) {
+			for (mbox = cvars->chanptr->boxes; mbox; mbox = mbox->next) {
+				if (cvars->chan->boxes[M] || cvars->chan->boxes[S])
+					printf( "%s%s <=> %s%s\n", nz( cvars->chan->boxes[M], "" ), mbox->name,
+					                           nz( cvars->chan->boxes[S], "" ), mbox->name );
+				else
+					puts( mbox->name );
 			}
 		} else {
-			if (!mvars->list) {
-				int present[] = { BOX_POSSIBLE, BOX_POSSIBLE };
-				sync_boxes( mvars->ctx, mvars->chan->boxes, present, mvars->chan, done_sync, mvars );
-				mvars->skip = 1;
-			  syncw:
-				mvars->cben = 1;
-				if (!mvars->done)
-					return;
-			  syncone:
-				if (!mvars->skip)
-					goto syncml;
-			} else
-				printf( "%s <=> %s\n", nz( mvars->chan->boxes[M], "INBOX" ), nz( mvars->chan->boxes[S], "INBOX" ) );
+			printf( "%s <=> %s\n", nz( cvars->chan->boxes[M], "INBOX" ), nz( cvars->chan->boxes[S], "INBOX" ) );
 		}
+		goto next;
+	}
 
-	  next:
-		mvars->cben = 0;
-		for (t = 0; t < 2; t++)
-			if (mvars->state[t] == ST_FRESH) {
-				/* An unconnected store may be only cancelled. */
-				mvars->state[t] = ST_CLOSED;
-				mvars->drv[t]->cancel_store( mvars->ctx[t] );
-			} else if (mvars->state[t] == ST_CONNECTED || mvars->state[t] == ST_OPEN) {
-				mvars->state[t] = ST_CANCELING;
-				mvars->drv[t]->cancel_cmds( mvars->ctx[t], cancel_prep_done, AUX );
+	if (cvars->chan->link_dups && cvars->chanptr->boxlist) {
+		for (mbox = cvars->chanptr->boxes; mbox; mbox = mbox->next) {
+			for (t = 0; t < 2; t++) {
+				if (mbox->present[t] != BOX_PRESENT)
+					continue;
+				nfasprintf( &name, "%s%s", nz( cvars->chan->boxes[t], "" ), mbox->name );
+				add_move_map_box( cvars->moves, t, name );
+				free( name );
 			}
-		mvars->cben = 1;
-		if (mvars->state[M] != ST_CLOSED || mvars->state[S] != ST_CLOSED) {
-			mvars->skip = 1;
-			return;
 		}
-		if (mvars->chanptr->boxlist == 2) {
-			for (nmbox = mvars->chanptr->boxes; (mbox = nmbox); ) {
-				nmbox = mbox->next;
-				free( mbox->name );
-				free( mbox );
+	}
+
+	cvars->boxptr = cvars->chanptr->boxes;
+	cvars->single = !cvars->chanptr->boxlist;
+  syncml:
+	/* Hand out the boxes to idle lanes, and open more lanes while there are
+	 * more boxes left than lanes being opened. Syncs may complete synchronously,
+	 * so keep going until nothing changes anymore. */
+	cvars->cben = 0;
+	do {
+		started = 0;
+		for (l = 0; l < cvars->nlanes && !cvars->skip && (cvars->single || cvars->boxptr); l++) {
+			lane = &cvars->lanes[l];
+			if (lane->busy || lane->state[M] != ST_OPEN || lane->state[S] != ST_OPEN)
+				continue;
+			lane->busy = 1;
+			cvars->busy++;
+			started = 1;
+			if (cvars->single) {
+				int present[] = { BOX_POSSIBLE, BOX_POSSIBLE };
+				cvars->single = 0;
+				sync_boxes( lane->ctx, cvars->chan->boxes, present, cvars->chan, cvars->moves, done_sync, lane );
+			} else {
+				mbox = cvars->boxptr;
+				cvars->boxptr = mbox->next;
+				sync_listed_boxes( lane, mbox );
 			}
-			mvars->chanptr->boxes = 0;
-			mvars->chanptr->boxlist = 0;
 		}
-	  next2:
-		if (!mvars->list) {
-			chans_done++;
-			stats();
+		if (started || cvars->skip)
+			continue;
+		for (opening = 0, l = 0; l < cvars->nlanes; l++) {
+			lane = &cvars->lanes[l];
+			if (lane->state[M] != ST_CLOSED && (lane->state[M] != ST_OPEN || lane->state[S] != ST_OPEN))
+				opening++;
+		}
+		for (mbox = cvars->boxptr; mbox && opening; mbox = mbox->next)
+			opening--;
+		if (!mbox)
+			continue;
+		for (l = 0; l < cvars->nlanes; l++) {
+			lane = &cvars->lanes[l];
+			if (!lane->dead && lane->state[M] == ST_CLOSED && lane->state[S] == ST_CLOSED) {
+				if (open_lane( lane ))
+					started = 1;
+				else
+					cvars->starved = E_SYNC;
+				break;
+			}
+		}
+	} while (started);
+	cvars->cben = 1;
+	if (cvars->busy)
+		return;
+
+  next:
+	cvars->starved = 0;
+	if (cvars->busy) {
+		/* Let the boxes which are being synced finish first. */
+		cvars->skip = 1;
+		return;
+	}
+	cvars->cben = 0;
+	for (l = 0; l < cvars->nlanes; l++)
+		close_lane( &cvars->lanes[l] );
+	cvars->cben = 1;
+	for (l = 0; l < cvars->nlanes; l++) {
+		lane = &cvars->lanes[l];
+		if (lane->state[M] != ST_CLOSED || lane->state[S] != ST_CLOSED) {
+			cvars->skip = 1;
+			return;
+		}
+	}
+	free( cvars->lanes );
+	cvars->lanes = 0;
+	if (cvars->chanptr->boxlist == 2) {
+		for (nmbox = cvars->chanptr->boxes; (mbox = nmbox); ) {
+			nmbox = mbox->next;
+			free( mbox->name );
+			free( mbox );
 		}
-	} while ((mvars->chanptr = mvars->chanptr->next));
-	for (t = 0; t < N_DRIVERS; t++)
-		drivers[t]->cleanup();
+		cvars->chanptr->boxes = 0;
+		cvars->chanptr->boxlist = 0;
+	}
+  next2:
+	done_chan( cvars );
 }
 
 static void
 store_connected( int sts, void *aux )
 {
-	MVARS(aux)
+	LVARS(aux)
 	string_list_t *cpat;
 	int cflags;
 
@@ -925,12 +1203,12 @@ store_connected( int sts, void *aux )
 	case DRV_CANCELED:
 		return;
 	case DRV_OK:
-		if (!mvars->skip && !mvars->chanptr->boxlist && mvars->chan->patterns && !mvars->ctx[t]->listed) {
-			for (cflags = 0, cpat = mvars->chan->patterns; cpat; cpat = cpat->next) {
+		if (!cvars->skip && !cvars->chanptr->boxlist && cvars->chan->patterns && !lane->ctx[t]->listed) {
+			for (cflags = 0, cpat = cvars->chan->patterns; cpat; cpat = cpat->next) {
 				const char *pat = cpat->string;
 				if (*pat != '!') {
 					char buf[8];
-					int bufl = snprintf( buf, sizeof(buf), "%s%s", nz( mvars->chan->boxes[t], "" ), pat );
+					int bufl = snprintf( buf, sizeof(buf), "%s%s", nz( cvars->chan->boxes[t], "" ), pat );
 					int flags = 0;
 					/* Partial matches like "INB*" or even "*" are not considered,
 					 * except implicity when the INBOX lives under Path. */
@@ -941,7 +1219,7 @@ store_connected( int sts, void *aux )
 							flags |= LIST_INBOX;
 						} else if (c == '/') {
 							/* Flattened sub-folders of INBOX actually end up in Path. */
-							if (mvars->ctx[t]->conf->flat_delim)
+							if (lane->ctx[t]->conf->flat_delim)
 								flags |= LIST_PATH;
 							else
 								flags |= LIST_INBOX;
@@ -960,42 +1238,46 @@ store_connected( int sts, void *aux )
 					cflags |= flags;
 				}
 			}
-			mvars->state[t] = ST_CONNECTED;
-			mvars->drv[t]->list_store( mvars->ctx[t], cflags, store_listed, AUX );
+			lane->state[t] = ST_CONNECTED;
+			cvars->drv[t]->list_store( lane->ctx[t], cflags, store_listed, AUX );
 			return;
 		}
-		mvars->state[t] = ST_OPEN;
+		lane->state[t] = ST_OPEN;
 		break;
 	default:
-		mvars->ret = mvars->skip = 1;
-		mvars->state[t] = ST_OPEN;
+		lane->state[t] = ST_OPEN;
+		if (lane != cvars->lanes && !cvars->skip) {
+			drop_lane( lane );
+			return;
+		}
+		cvars->ret = cvars->skip = 1;
 		break;
 	}
-	sync_chans( mvars, E_OPEN );
+	sync_chans( cvars, lane == cvars->lanes ? E_OPEN : E_SYNC );
 }
 
 static void
 store_listed( int sts, void *aux )
 {
-	MVARS(aux)
+	LVARS(aux)
 	string_list_t **box, *bx;
 
 	switch (sts) {
 	case DRV_CANCELED:
 		return;
 	case DRV_OK:
-		mvars->ctx[t]->listed = 1;
+		lane->ctx[t]->listed = 1;
 		if (DFlags & DEBUG_MAIN) {
 			debug( "got mailbox list from %s:\n", str_ms[t] );
-			for (bx = mvars->ctx[t]->boxes; bx; bx = bx->next)
+			for (bx = lane->ctx[t]->boxes; bx; bx = bx->next)
 				debug( "  %s\n", bx->string );
 		}
-		if (mvars->ctx[t]->conf->flat_delim) {
-			for (box = &mvars->ctx[t]->boxes; *box; box = &(*box)->next) {
+		if (lane->ctx[t]->conf->flat_delim) {
+			for (box = &lane->ctx[t]->boxes; *box; box = &(*box)->next) {
 				string_list_t *nbox;
-				if (map_name( (*box)->string, (char **)&nbox, offsetof(string_list_t, string), mvars->ctx[t]->conf->flat_delim, "/" ) < 0) {
+				if (map_name( (*box)->string, (char **)&nbox, offsetof(string_list_t, string), lane->ctx[t]->conf->flat_delim, "/" ) < 0) {
 					error( "Error: flattened mailbox name '%s' contains canonical hierarchy delimiter\n", (*box)->string );
-					mvars->ret = mvars->skip = 1;
+					cvars->ret = cvars->skip = 1;
 				} else {
 					nbox->next = (*box)->next;
 					free( *box );
@@ -1003,70 +1285,63 @@ store_listed( int sts, void *aux )
 				}
 			}
 		}
-		if (mvars->ctx[t]->conf->map_inbox) {
-			debug( "adding mapped inbox to %s: %s\n", str_ms[t], mvars->ctx[t]->conf->map_inbox );
-			add_string_list( &mvars->ctx[t]->boxes, mvars->ctx[t]->conf->map_inbox );
+		if (lane->ctx[t]->conf->map_inbox) {
+			debug( "adding mapped inbox to %s: %s\n", str_ms[t], lane->ctx[t]->conf->map_inbox );
+			add_string_list( &lane->ctx[t]->boxes, lane->ctx[t]->conf->map_inbox );
 		}
 		break;
 	default:
-		mvars->ret = mvars->skip = 1;
+		cvars->ret = cvars->skip = 1;
 		break;
 	}
-	mvars->state[t] = ST_OPEN;
-	sync_chans( mvars, E_OPEN );
+	lane->state[t] = ST_OPEN;
+	sync_chans( cvars, lane == cvars->lanes ? E_OPEN : E_SYNC );
 }
 
-static int
-sync_listed_boxes( main_vars_t *mvars, box_ent_t *mbox )
+static void
+sync_listed_boxes( lane_t *lane, box_ent_t *mbox )
 {
-	if (mvars->chan->boxes[M] || mvars->chan->boxes[S]) {
-		const char *mpfx = nz( mvars->chan->boxes[M], "" );
-		const char *spfx = nz( mvars->chan->boxes[S], "" );
-		if (!mvars->list) {
-			nfasprintf( &mvars->names[M], "%s%s", mpfx, mbox->name );
-			nfasprintf( &mvars->names[S], "%s%s", spfx, mbox->name );
-			sync_boxes( mvars->ctx, (const char **)mvars->names, mbox->present, mvars->chan, done_sync_2_dyn, mvars );
-			return 1;
-		}
-		printf( "%s%s <=> %s%s\n", mpfx, mbox->name, spfx, mbox->name );
+	chan_vars_t *cvars = lane->cvars;
+
+	if (cvars->chan->boxes[M] || cvars->chan->boxes[S]) {
+		nfasprintf( &lane->names[M], "%s%s", nz( cvars->chan->boxes[M], "" ), mbox->name );
+		nfasprintf( &lane->names[S], "%s%s", nz( cvars->chan->boxes[S], "" ), mbox->name );
+		sync_boxes( lane->ctx, (const char **)lane->names, mbox->present, cvars->chan, cvars->moves, done_sync_2_dyn, lane );
 	} else {
-		if (!mvars->list) {
-			mvars->names[M] = mvars->names[S] = mbox->name;
-			sync_boxes( mvars->ctx, (const char **)mvars->names, mbox->present, mvars->chan, done_sync, mvars );
-			return 1;
-		}
-		puts( mbox->name );
+		lane->names[M] = lane->names[S] = mbox->name;
+		sync_boxes( lane->ctx, (const char **)lane->names, mbox->present, cvars->chan, cvars->moves, done_sync, lane );
 	}
-	return 0;
 }
 
 static void
 done_sync_2_dyn( int sts, void *aux )
 {
-	main_vars_t *mvars = (main_vars_t *)aux;
+	lane_t *lane = (lane_t *)aux;
 
-	free( mvars->names[M] );
-	free( mvars->names[S] );
+	free( lane->names[M] );
+	free( lane->names[S] );
 	done_sync( sts, aux );
 }
 
 static void
 done_sync( int sts, void *aux )
 {
-	main_vars_t *mvars = (main_vars_t *)aux;
+	lane_t *lane = (lane_t *)aux;
+	chan_vars_t *cvars = lane->cvars;
 
-	mvars->done = 1;
+	lane->busy = 0;
+	cvars->busy--;
 	boxes_done++;
 	stats();
 	if (sts) {
-		mvars->ret = 1;
+		cvars->ret = 1;
 		if (sts & (SYNC_BAD(M) | SYNC_BAD(S))) {
 			if (sts & SYNC_BAD(M))
-				mvars->state[M] = ST_CLOSED;
+				lane->state[M] = ST_CLOSED;
 			if (sts & SYNC_BAD(S))
-				mvars->state[S] = ST_CLOSED;
-			mvars->skip = 1;
+				lane->state[S] = ST_CLOSED;
+			cvars->skip = 1;
 		}
 	}
-	sync_chans( mvars, E_SYNC );
+	sync_chans( cvars, E_SYNC );
 }
@@ -24,6 +24,7 @@ chdir "tmp" or die "Cannot enter temp direcory.\n";
 
 sub show($$$);
 sub test($$$@);
+sub printhdr($);
 
 ################################################################################
 
@@ -224,6 +225,65 @@ my @X51 = (
 );
 test("max messages + expire", \@x50, \@X51, @O51);
 
+# The test messages' names date them to 1970, so nothing is recent.
+my @O61 = ("", "", "MaxAge 30\n");
+#show("01", "61", "61");
+my @X61 = (
+ [ 9,
+   1, 1, "F", 2, 2, "", 3, 3, "FS", 4, 4, "", 5, 5, "T", 6, 6, "F", 7, 7, "FT", 9, 9, "" ],
+ [ 9,
+   1, 1, "", 2, 2, "F", 3, 3, "F", 4, 4, "", 5, 5, "", 7, 7, "", 8, 8, "", 10, 9, "" ],
+ [ 8, 0, 0,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "", 5, 5, "", 6, 6, "", 7, 7, "", 8, 8, "" ],
+);
+test("max age", \@x01, \@X61, @O61);
+
+# The last run's window started at 2, and the recent message 2 was deleted since.
+my @x62 = (
+ [ 4,
+   1, 1, "", 3, 3, "+", 4, 4, "+" ],
+ [ 4,
+   1, 1, "", 2, 2, "+", 3, 3, "+", 4, 4, "+" ],
+ [ 4, 0, 4,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "" ],
+ { MasterWindowUid => 2, SlaveWindowUid => 2 },
+);
+
+#show("62", "62", "61");
+my @X62 = (
+ [ 4,
+   1, 1, "", 3, 3, "", 4, 4, "" ],
+ [ 4,
+   1, 1, "", 2, 2, "T", 3, 3, "", 4, 4, "" ],
+ [ 4, 0, 4,
+   1, 1, "", 0, 2, "", 3, 3, "", 4, 4, "" ],
+ { MasterWindowUid => 3, SlaveWindowUid => 2 },
+);
+test("max age vs. deletion", \@x62, \@X62, @O61);
+
+# state recovery tests
+
+# The sync state was lost; the slave's UIDs do not match the master's.
+my @x70 = (
+ [ 5,
+   1, 1, "F", 2, 2, "", 3, 3, "FS", 4, 4, "T", 5, 5, "" ],
+ [ 5,
+   1, 1, "", 2, 3, "S", 3, 2, "FS", 4, 4, "", 6, 5, "" ],
+ [ ],
+);
+
+my @O71 = ("", "", "RecoverState yes\n");
+#show("70", "71", "71");
+my @X71 = (
+ [ 6,
+   1, 1, "F", 2, 2, "S", 3, 3, "FS", 4, 4, "", 5, 5, "", 6, 6, "" ],
+ [ 6,
+   1, 1, "F", 2, 3, "S", 3, 2, "FS", 4, 4, "", 5, 6, "", 6, 5, "" ],
+ [ 5, 0, 5,
+   1, 1, "F", 2, 3, "S", 3, 2, "FS", 4, 4, "", 6, 5, "", 5, 6, "" ],
+);
+test("recover state", \@x70, \@X71, @O71);
+
 
 ################################################################################
 
@@ -394,6 +454,8 @@ sub showstate($)
 		}
 	}
 	print " ],\n";
+	delete @hdr{'MasterUidValidity', 'SlaveUidValidity', 'MaxPulledUid', 'MaxExpiredSlaveUid', 'MaxPushedUid'};
+	printhdr(\%hdr) if (%hdr);
 }
 
 # $filename
@@ -413,7 +475,7 @@ sub show($$$)
 	my (@sp, @sfx);
 	eval "\@sp = \@x$sx";
 	eval "\@sfx = \@O$sfxn";
-	mkchan($sp[0], $sp[1], @{ $sp[2] });
+	mkchan($sp[0], $sp[1], $sp[3], @{ $sp[2] });
 	print "my \@x$sx = (\n";
 	showchan("slave/.mbsyncstate");
 	print ");\n";
@@ -447,23 +509,27 @@ sub mkbox($$@)
 			$uid = "";
 		}
 		my $big = $flg =~ s/\*//;
-		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/0.1_".$num.".local".$uid.":2,".$flg) or
+		my $recent = $flg =~ s/\+//;
+		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/".($recent ? time() : 0).".1_".$num.".local".$uid.":2,".$flg) or
 			die "Cannot create message $num in mailbox $bn.\n";
-		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\n\n".(("A"x50)."\n")x($big*30);
+		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\nMessage-Id: <$num\@local>\n\n".(("A"x50)."\n")x($big*30);
 		close FILE;
 	}
 }
 
-# \@master, \@slave, @syncstate
-sub mkchan($$@)
+# \@master, \@slave, \%extra_header, @syncstate
+sub mkchan($$$@)
 {
-	my ($m, $s, @t) = @_;
+	my ($m, $s, $h, @t) = @_;
 	&mkbox("master", @{ $m });
 	&mkbox("slave", @{ $s });
+	return if (!@t);  # no sync state
 	open(FILE, ">", "slave/.mbsyncstate") or
 		die "Cannot create sync state.\n";
 	print FILE "MasterUidValidity 1\nMaxPulledUid ".shift(@t)."\n".
-	           "SlaveUidValidity 1\nMaxExpiredSlaveUid ".shift(@t)."\nMaxPushedUid ".shift(@t)."\n\n";
+	           "SlaveUidValidity 1\nMaxExpiredSlaveUid ".shift(@t)."\nMaxPushedUid ".shift(@t)."\n";
+	print FILE map { "$_ $$h{$_}\n" } sort keys %$h if ($h);
+	print FILE "\n";
 	while (@t) {
 		print FILE shift(@t)." ".shift(@t)." ".shift(@t)."\n";
 	}
@@ -503,11 +569,11 @@ sub ckbox($$$@)
 	return 0;
 }
 
-# $filename, @syncstate
-sub ckstate($@)
+# $filename, \%extra_header, @syncstate
+sub ckstate($$@)
 {
-	my ($fn, $mmaxuid, $smaxxuid, $smaxuid, @T) = @_;
-	my %hdr;
+	my ($fn, $h, $mmaxuid, $smaxxuid, $smaxuid, @T) = @_;
+	my %hdr = $h ? %$h : ();
 	$hdr{'MasterUidValidity'} = "1";
 	$hdr{'SlaveUidValidity'} = "1";
 	$hdr{'MaxPulledUid'} = $mmaxuid;
@@ -564,7 +630,7 @@ sub ckstate($@)
 sub ckchan($$)
 {
 	my ($F, $cs) = @_;
-	my $rslt = ckstate($F, @{ $$cs[2] });
+	my $rslt = ckstate($F, $$cs[3], @{ $$cs[2] });
 	$rslt |= &ckbox("master", @{ $$cs[0] });
 	$rslt |= &ckbox("slave", @{ $$cs[1] });
 	return $rslt;
@@ -587,6 +653,14 @@ sub printbox($$@)
 	print " ],\n";
 }
 
+# \%extra_header
+sub printhdr($)
+{
+	my ($h) = @_;
+
+	print " { ".join(", ", map { "$_ => $$h{$_}" } sort keys %$h)." },\n";
+}
+
 # @syncstate
 sub printstate(@)
 {
@@ -614,6 +688,7 @@ sub printchan($)
 	&printbox("master", @{ $$cs[0] });
 	&printbox("slave", @{ $$cs[1] });
 	printstate(@{ $$cs[2] });
+	printhdr($$cs[3]) if ($$cs[3]);
 }
 
 # $title, \@source_state, \@target_state, @channel_configs
@@ -623,7 +698,7 @@ sub test($$$@)
 
 	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
 	print "Testing: ".$ttl." ...\n";
-	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
+	mkchan($$sx[0], $$sx[1], $$sx[3], @{ $$sx[2] });
 	&writecfg(@sfx);
 
 	my ($xc, @ret) = runsync("-J");
@@ -667,7 +742,7 @@ sub test($$$@)
 		print @ret;
 		exit 1;
 	}
-	if (ckstate("slave/.mbsyncstate", @{ $$tx[2] })) {
+	if (ckstate("slave/.mbsyncstate", $$tx[3], @{ $$tx[2] })) {
 		print "Journal replay failed.\n";
 		print "Options:\n";
 		print " [ ".join(", ", map('"'.qm($_).'"', @sfx))." ]\n";
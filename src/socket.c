@@ -563,6 +563,8 @@ socket_close( conn_t *sock )
 	if (sock->fd >= 0)
 		socket_close_internal( sock );
 	socket_cleanup_names( sock );
+	sock->direct_buf = 0;
+	sock->direct_bytes = 0;
 #ifdef HAVE_LIBSSL
 	if (sock->ssl) {
 		SSL_free( sock->ssl );
@@ -628,6 +630,8 @@ do_read( conn_t *sock, char *buf, int len )
 		}
 	}
 
+	if (n > 0)
+		sock->bytes_in += n;
 	return n;
 }
 
@@ -680,6 +684,15 @@ socket_fill( conn_t *sock )
 		char *buf;
 		int len;
 
+		if (sock->direct_buf) {
+			/* Bypass the buffer; socket_read() will find the data in place. */
+			if ((len = do_read( sock, sock->direct_buf, sock->direct_len )) <= 0)
+				return;
+			sock->direct_bytes = len;
+			sock->read_callback( sock->callback_aux );
+			return;
+		}
+
 		if (prepare_read( sock, &buf, &len ) < 0)
 			return;
 
@@ -698,10 +711,28 @@ socket_expect_read( conn_t *conn, int expect )
 		conf_wakeup( &conn->fd_timeout, expect ? conn->conf->timeout : -1 );
 }
 
+/* Reads of at least this size go straight into the caller's buffer. */
+#define DIRECT_READ_MIN 8192
+
 int
 socket_read( conn_t *conn, char *buf, int len )
 {
-	int n = conn->bytes;
+	int n;
+
+	if (conn->direct_buf) {
+		assert( buf == conn->direct_buf );
+		if (!(n = conn->direct_bytes)) {
+			/* Nothing arrived yet; stay armed for the next fill. */
+			if (conn->state != SCK_EOF)
+				return 0;
+			conn->direct_buf = 0;
+			return -1;
+		}
+		conn->direct_buf = 0;
+		conn->direct_bytes = 0;
+		return n;
+	}
+	n = conn->bytes;
 	if (!n && conn->state == SCK_EOF)
 		return -1;
 	if (n > len)
@@ -711,6 +742,14 @@ socket_read( conn_t *conn, char *buf, int len )
 		conn->offset = 0;
 	else
 		conn->offset += n;
+	if (len - n >= DIRECT_READ_MIN
+#ifdef HAVE_LIBZ
+	    && !conn->in_z
+#endif
+	   ) {
+		conn->direct_buf = buf + n;
+		conn->direct_len = len - n;
+	}
 	return n;
 }
 
@@ -749,10 +788,15 @@ do_write( conn_t *sock, char *buf, int len )
 
 	assert( sock->fd >= 0 );
 #ifdef HAVE_LIBSSL
-	if (sock->ssl)
-		return ssl_return( "write to", sock, SSL_write( sock->ssl, buf, len ) );
+	if (sock->ssl) {
+		if ((n = ssl_return( "write to", sock, SSL_write( sock->ssl, buf, len ) )) > 0)
+			sock->bytes_out += n;
+		return n;
+	}
 #endif
 	n = write( sock->fd, buf, len );
+	if (n > 0)
+		sock->bytes_out += n;
 	if (n < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			sys_error( "Socket error: write to %s", sock->name );
@@ -111,11 +111,16 @@ typedef struct {
 #endif
 	int write_offset; /* offset into buffer head */
 	int buffer_mem; /* memory currently occupied by buffers in the queue */
+	uint bytes_out; /* total bytes written, for measuring throughput */
 
 	/* reading */
+	uint bytes_in; /* total bytes read, for measuring throughput */
 	int offset; /* start of filled bytes in buffer */
 	int bytes; /* number of filled bytes in buffer */
 	int scanoff; /* offset to continue scanning for newline at, relative to 'offset' */
+	char *direct_buf; /* caller's buffer to read the rest of a large socket_read() into */
+	int direct_len; /* size of that buffer */
+	int direct_bytes; /* number of bytes read into that buffer so far */
 	char buf[100000];
 #ifdef HAVE_LIBZ
 	char z_buf[100000];
@@ -144,7 +149,8 @@ void socket_start_tls(conn_t *conn, void (*cb)( int ok, void *aux ) );
 void socket_start_deflate( conn_t *conn );
 void socket_close( conn_t *sock );
 void socket_expect_read( conn_t *sock, int expect );
-int socket_read( conn_t *sock, char *buf, int len ); /* never waits */
+/* never waits; if it comes up short, the call must be repeated with buf advanced by the returned count */
+int socket_read( conn_t *sock, char *buf, int len );
 char *socket_read_line( conn_t *sock ); /* don't free return value; never waits */
 typedef enum { KeepOwn = 0, GiveOwn } ownership_t;
 typedef struct conn_iovec {
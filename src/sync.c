@@ -34,6 +34,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #if !defined(_POSIX_SYNCHRONIZED_IO) || _POSIX_SYNCHRONIZED_IO <= 0
 # define fdatasync fsync
@@ -65,6 +66,14 @@ debugn( const char *msg, ... )
 	va_end( va );
 }
 
+static void
+debug_arena( const char *what, arena_t *arena )
+{
+	if (arena->nblks)
+		debug( "arena for %s: peak %u objects of %u bytes, %u blocks, %u bytes\n",
+		       what, arena->max_objs, arena->obj_size, arena->nblks, arena->nbytes );
+}
+
 void
 Fclose( FILE *f, int safe )
 {
@@ -171,11 +180,12 @@ typedef struct {
 	FILE *jfp, *nfp;
 	sync_rec_t *srecs, **srecadd;
 	channel_conf_t *chan;
+	move_map_t *moves;
 	store_t *ctx[2];
 	driver_t *drv[2];
 	const char *orig_name[2];
 	message_t *new_msgs[2];
-	int state[2], ref_count, nsrecs, ret, lfd, existing, replayed;
+	int state[2], ref_count, nsrecs, ret, lfd, existing, replayed, recover;
 	int new_pending[2], flags_pending[2], trash_pending[2];
 	int maxuid[2]; /* highest UID that was already propagated */
 	int newmaxuid[2]; /* highest UID that is currently being propagated */
@@ -183,6 +193,14 @@ typedef struct {
 	int newuid[2]; /* TUID lookup makes sense only for UIDs >= this */
 	int mmaxxuid; /* highest expired UID on master during new message propagation */
 	int smaxxuid; /* highest expired UID on slave */
+	uint64_t modseq[2]; /* HIGHESTMODSEQ up to which all flag changes were propagated */
+	int window_uid[2]; /* lowest UID of a message which was recent in the last run with MaxAge */
+	int *known_uids[2]; /* the existing messages up to ctx[]->changed_uid */
+	int state_fmt; /* format of the loaded sync state */
+	int snap_len; /* length of the full snapshot at the start of the sync state file */
+	int state_len; /* length of the sync state file including complete delta records */
+	int state_maxuid[2]; /* maxuid as recorded in the sync state file */
+	arena_t srec_arena, flag_arena, copy_arena; /* released at once when the box is done */
 } sync_vars_t;
 
 static void sync_ref( sync_vars_t *svars ) { ++svars->ref_count; }
@@ -229,202 +247,525 @@ static int check_cancel( sync_vars_t *svars );
 #define ST_SENDING_NEW     (1<<15)
 
 
+typedef struct {
+	message_t *msg;
+	int pos;
+} tuid_map_t;
+
+static uint
+hash_tuid( const char *tuid )
+{
+	uint i, h = 0;
+
+	for (i = 0; i < TUIDL; i++)
+		h = h * 33 + (uchar)tuid[i];
+	return h * 1103515245U;
+}
+
 static void
 match_tuids( sync_vars_t *svars, int t )
 {
 	sync_rec_t *srec;
-	message_t *tmsg, *ntmsg = 0;
+	message_t *tmsg;
+	tuid_map_t *tuidmap;
 	const char *diag;
-	int num_lost = 0;
+	uint hashsz, idx;
+	int num_lost = 0, nmsgs, pos, npos, fwd, bpos, bfwd;
+
+	/* The position in the message list is recorded, so we can tell where
+	 * the found message is relative to the previously found one. */
+	for (nmsgs = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next)
+		if (!(tmsg->status & M_DEAD) && tmsg->tuid[0])
+			nmsgs++;
+	hashsz = bucketsForSize( nmsgs * 3 );
+	tuidmap = nfcalloc( hashsz * sizeof(*tuidmap) );
+	for (pos = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next, pos++) {
+		if ((tmsg->status & M_DEAD) || !tmsg->tuid[0])
+			continue;
+		idx = hash_tuid( tmsg->tuid ) % hashsz;
+		while (tuidmap[idx].msg)
+			if (++idx == hashsz)
+				idx = 0;
+		tuidmap[idx].msg = tmsg;
+		tuidmap[idx].pos = pos;
+	}
 
+	npos = -1;
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
 			continue;
 		if (srec->uid[t] == -2 && srec->tuid[0]) {
 			debug( "  pair(%d,%d): lookup %s, TUID %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], str_ms[t], srec->tuid );
-			for (tmsg = ntmsg; tmsg; tmsg = tmsg->next) {
-				if (tmsg->status & M_DEAD)
-					continue;
-				if (tmsg->tuid[0] && !memcmp( tmsg->tuid, srec->tuid, TUIDL )) {
-					diag = (tmsg == ntmsg) ? "adjacently" : "after gap";
-					goto mfound;
+			/* Among duplicates, prefer the first one following the previously
+			 * found message, and otherwise the first one overall. */
+			tmsg = 0;
+			bpos = bfwd = 0;
+			for (idx = hash_tuid( srec->tuid ) % hashsz; tuidmap[idx].msg; ) {
+				if (!memcmp( tuidmap[idx].msg->tuid, srec->tuid, TUIDL )) {
+					pos = tuidmap[idx].pos;
+					fwd = npos >= 0 && pos >= npos;
+					if (!tmsg || (fwd ? !bfwd || pos < bpos : !bfwd && pos < bpos)) {
+						tmsg = tuidmap[idx].msg;
+						bpos = pos;
+						bfwd = fwd;
+					}
 				}
+				if (++idx == hashsz)
+					idx = 0;
 			}
-			for (tmsg = svars->ctx[t]->msgs; tmsg != ntmsg; tmsg = tmsg->next) {
-				if (tmsg->status & M_DEAD)
-					continue;
-				if (tmsg->tuid[0] && !memcmp( tmsg->tuid, srec->tuid, TUIDL )) {
-					diag = "after reset";
-					goto mfound;
-				}
+			if (!tmsg) {
+				debug( "  -> TUID lost\n" );
+				Fprintf( svars->jfp, "& %d %d\n", srec->uid[M], srec->uid[S] );
+				srec->flags = 0;
+				srec->tuid[0] = 0;
+				num_lost++;
+				continue;
 			}
-			debug( "  -> TUID lost\n" );
-			Fprintf( svars->jfp, "& %d %d\n", srec->uid[M], srec->uid[S] );
-			srec->flags = 0;
-			srec->tuid[0] = 0;
-			num_lost++;
-			continue;
-		  mfound:
+			diag = !bfwd ? "after reset" : (bpos == npos) ? "adjacently" : "after gap";
 			debug( "  -> new UID %d %s\n", tmsg->uid, diag );
 			Fprintf( svars->jfp, "%c %d %d %d\n", "<>"[t], srec->uid[M], srec->uid[S], tmsg->uid );
 			tmsg->srec = srec;
 			srec->msg[t] = tmsg;
-			ntmsg = tmsg->next;
+			npos = tmsg->next ? bpos + 1 : -1;
 			srec->uid[t] = tmsg->uid;
 			srec->tuid[0] = 0;
 		}
 	}
+	free( tuidmap );
 	if (num_lost)
 		warn( "Warning: lost track of %d %sed message(s)\n", num_lost, str_hl[t] );
 }
 
 
+typedef struct moved_msg {
+	struct moved_msg *next;
+	store_conf_t *conf;
+	void *stash;
+	char *msgid;
+	string_list_t *tuid_boxes; /* boxes which already have a copy with the stash's TUID */
+	char keep; /* a copy of a stored message, which may be re-used any number of times */
+} moved_msg_t;
+
+struct move_map {
+	moved_msg_t **buckets;
+	uint hashsz, count;
+	string_list_t *boxes[2]; /* the boxes whose existing messages may be linked */
+	char indexed[2];
+};
+
+move_map_t *
+new_move_map( void )
+{
+	move_map_t *moves = nfmalloc( sizeof(*moves) );
+
+	moves->hashsz = bucketsForSize( 100 );
+	moves->buckets = nfcalloc( moves->hashsz * sizeof(*moves->buckets) );
+	moves->count = 0;
+	moves->boxes[0] = moves->boxes[1] = 0;
+	moves->indexed[0] = moves->indexed[1] = 0;
+	return moves;
+}
+
+void
+free_move_map( move_map_t *moves )
+{
+	moved_msg_t *mm, *nmm;
+	uint i;
+
+	if (!moves)
+		return;
+	for (i = 0; i < moves->hashsz; i++) {
+		for (mm = moves->buckets[i]; mm; mm = nmm) {
+			nmm = mm->next;
+			mm->conf->driver->free_stash( mm->stash );
+			free( mm->msgid );
+			free_string_list( mm->tuid_boxes );
+			free( mm );
+		}
+	}
+	free( moves->buckets );
+	free_string_list( moves->boxes[0] );
+	free_string_list( moves->boxes[1] );
+	free( moves );
+}
+
+void
+add_move_map_box( move_map_t *moves, int t, const char *name )
+{
+	add_string_list( &moves->boxes[t], name );
+}
+
+static uint
+hash_msgid( const char *msgid )
+{
+	uint h = 0;
+
+	for (; *msgid; msgid++)
+		h = h * 33 + (uchar)*msgid;
+	return h * 1103515245U;
+}
+
+static void
+add_stash( move_map_t *moves, store_conf_t *conf, void *stash, char *msgid, const char *box, int keep )
+{
+	moved_msg_t *mm, *nmm, **buckets;
+	uint i, idx, hashsz;
+
+	if (moves->count >= moves->hashsz) {
+		hashsz = bucketsForSize( moves->count * 3 );
+		buckets = nfcalloc( hashsz * sizeof(*buckets) );
+		for (i = 0; i < moves->hashsz; i++) {
+			for (mm = moves->buckets[i]; mm; mm = nmm) {
+				nmm = mm->next;
+				idx = hash_msgid( mm->msgid ) % hashsz;
+				mm->next = buckets[idx];
+				buckets[idx] = mm;
+			}
+		}
+		free( moves->buckets );
+		moves->buckets = buckets;
+		moves->hashsz = hashsz;
+	}
+	mm = nfmalloc( sizeof(*mm) );
+	mm->conf = conf;
+	mm->stash = stash;
+	mm->msgid = msgid;
+	mm->tuid_boxes = 0;
+	if (box)
+		add_string_list( &mm->tuid_boxes, box );
+	mm->keep = keep;
+	idx = hash_msgid( msgid ) % moves->hashsz;
+	mm->next = moves->buckets[idx];
+	moves->buckets[idx] = mm;
+	moves->count++;
+}
+
+/* Keep the copy of a message which is being deleted, as it might have been
+ * moved to another box, in which case it would re-appear as a new message. */
+static void
+stash_msg( sync_vars_t *svars, message_t *msg, int t )
+{
+	void *stash;
+	char *msgid;
+
+	if (!(stash = svars->drv[t]->stash_msg( svars->ctx[t], msg, &msgid )))
+		return;
+	debug( "  stashed %s for move detection\n", msgid );
+	add_stash( svars->moves, svars->ctx[t]->conf, stash, msgid, 0, 0 );
+}
+
+/* Keep the copy of a message which is being stored, as the same message
+ * may appear in other boxes as well, e.g., if it has multiple Gmail labels. */
+static void
+stash_stored_msg( sync_vars_t *svars, sync_rec_t *srec, message_t *msg, msg_data_t *data, int t )
+{
+	void *stash;
+
+	if (!(stash = svars->drv[t]->stash_stored_msg( svars->ctx[t], data, srec->tuid )))
+		return;
+	debug( "  stashed %s for duplicate detection\n", msg->msgid );
+	add_stash( svars->moves, svars->ctx[t]->conf, stash, nfstrdup( msg->msgid ), svars->box_name[t], 1 );
+}
+
+static char *
+driver_box_name( store_t *ctx, const char *name )
+{
+	char *box_name;
+
+	if (!ctx->conf->flat_delim)
+		return nfstrdup( name );
+	if (map_name( name, &box_name, 0, "/", ctx->conf->flat_delim ) < 0) {
+		error( "Error: canonical mailbox name '%s' contains flattened hierarchy delimiter\n", name );
+		return 0;
+	}
+	return box_name;
+}
+
+typedef struct {
+	move_map_t *moves;
+	store_conf_t *conf;
+	char *box;
+} index_vars_t;
+
+static void
+index_stash( void *stash, char *msgid, void *aux )
+{
+	index_vars_t *ivars = (index_vars_t *)aux;
+
+	add_stash( ivars->moves, ivars->conf, stash, msgid, ivars->box, 1 );
+}
+
+/* Stash the messages which already exist in the channel's boxes, so that
+ * duplicates which were downloaded in earlier runs can be linked as well. */
+static void
+index_dups( sync_vars_t *svars, int t )
+{
+	string_list_t *box;
+	const char *name;
+	index_vars_t ivars;
+
+	svars->moves->indexed[t] = 1;
+	if (!svars->drv[t]->stash_box_msgs)
+		return;
+	debug( "indexing existing %s messages\n", str_ms[t] );
+	ivars.moves = svars->moves;
+	ivars.conf = svars->ctx[t]->conf;
+	for (box = svars->moves->boxes[t]; box; box = box->next) {
+		name = (svars->ctx[t]->conf->map_inbox && !strcmp( svars->ctx[t]->conf->map_inbox, box->string )) ?
+			"INBOX" : box->string;
+		if (!(ivars.box = driver_box_name( svars->ctx[t], name )))
+			continue;
+		svars->drv[t]->stash_box_msgs( svars->ctx[t], ivars.box, index_stash, &ivars );
+		free( ivars.box );
+	}
+}
+
 typedef struct copy_vars {
 	void (*cb)( int sts, int uid, struct copy_vars *vars );
 	void *aux;
 	sync_rec_t *srec; /* also ->tuid */
 	message_t *msg;
 	msg_data_t data;
+	char *hdr; /* header collected while looking for the X-TUID insertion point */
+	int hdr_len, hdr_alloc, hdr_line, hdr_crs;
+	int ret; /* status of the storing side */
+	char scr, tcr, in_hdr, started;
 } copy_vars_t;
 
+typedef struct {
+	void *aux;
+	sync_rec_t *srec;
+	int aflags, dflags;
+} flag_vars_t;
+
+static void msg_data( const char *buf, int len, void *aux );
 static void msg_fetched( int sts, void *aux );
+static void msg_stored( int sts, int uid, void *aux );
+
+/* If the message was stashed when it was deleted from or stored to another
+ * box, store that copy instead of fetching the message again. */
+static int
+copy_moved_msg( copy_vars_t *vars )
+{
+	DECL_INIT_SVARS(vars->aux);
+	move_map_t *moves = svars->moves;
+	message_t *msg = vars->msg;
+	sync_rec_t *srec = vars->srec;
+	moved_msg_t *mm, **mmp;
+	string_list_t *box;
+	char tuid[TUIDL];
+
+	for (mmp = &moves->buckets[hash_msgid( msg->msgid ) % moves->hashsz]; (mm = *mmp); mmp = &mm->next) {
+		if (mm->conf != svars->ctx[t]->conf || strcmp( mm->msgid, msg->msgid ))
+			continue;
+		memcpy( tuid, srec->tuid, TUIDL );
+		if (svars->drv[t]->store_stashed_msg( svars->ctx[t], mm->stash, (int)msg->size, srec->tuid, &vars->data ) != DRV_OK)
+			continue;
+		if (memcmp( tuid, srec->tuid, TUIDL )) {
+			/* The copy keeps its X-TUID, so the record must be found by that one
+			 * should we be interrupted before its UID is recorded. Two records of
+			 * the same box must not share a TUID, though. */
+			for (box = mm->tuid_boxes; box; box = box->next)
+				if (!strcmp( box->string, svars->box_name[t] ))
+					break;
+			if (box) {
+				svars->drv[t]->abort_store_msg( svars->ctx[t], &vars->data );
+				memcpy( srec->tuid, tuid, TUIDL );
+				continue;
+			}
+			if (mm->keep)
+				add_string_list( &mm->tuid_boxes, svars->box_name[t] );
+			Fprintf( svars->jfp, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
+			debug( "  -> TUID now %." stringify(TUIDL) "s\n", srec->tuid );
+			if (UseFSync == FSYNC_BATCH)
+				defer_fsync( fileno( svars->jfp ), 0, 0 );
+			else if (UseFSync)
+				fdatasync( fileno( svars->jfp ) );
+		}
+		debug( "  -> re-using stashed %s\n", mm->msgid );
+		if (!mm->keep) {
+			*mmp = mm->next;
+			moves->count--;
+			svars->drv[t]->free_stash( mm->stash );
+			free( mm->msgid );
+			free_string_list( mm->tuid_boxes );
+			free( mm );
+		}
+		vars->data.flags = msg->flags;
+		vars->data.date = 0;
+		svars->drv[t]->store_msg( svars->ctx[t], &vars->data, 0, msg_stored, vars );
+		return 1;
+	}
+	return 0;
+}
 
 static void
 copy_msg( copy_vars_t *vars )
 {
 	DECL_INIT_SVARS(vars->aux);
 
+	vars->scr = (svars->drv[1-t]->flags / DRV_CRLF) & 1;
+	vars->tcr = (svars->drv[t]->flags / DRV_CRLF) & 1;
+	vars->in_hdr = vars->srec != 0;
+	vars->hdr = 0;
+	vars->hdr_len = vars->hdr_alloc = vars->hdr_line = vars->hdr_crs = 0;
+	vars->ret = DRV_OK;
+	vars->started = 0;
+	vars->data.stream = 0;
+
+	if (svars->moves && vars->srec && vars->msg->msgid && (vars->msg->status & M_FLAGS) && copy_moved_msg( vars ))
+		return;
+
 	t ^= 1;
 	vars->data.flags = vars->msg->flags;
 	vars->data.date = svars->chan->use_internal_date ? -1 : 0;
-	svars->drv[t]->fetch_msg( svars->ctx[t], vars->msg, &vars->data, msg_fetched, vars );
+	svars->drv[t]->fetch_msg( svars->ctx[t], vars->msg, &vars->data, msg_data, msg_fetched, vars );
 }
 
-static void msg_stored( int sts, int uid, void *aux );
+static void
+store_data( copy_vars_t *vars, const char *buf, int len )
+{
+	DECL_INIT_SVARS(vars->aux);
+
+	if (vars->ret != DRV_OK)
+		return;
+	if (!vars->started) {
+		vars->started = 1;
+		if ((vars->ret = svars->drv[t]->store_msg_begin( svars->ctx[t], &vars->data, !vars->srec )) != DRV_OK)
+			return;
+	}
+	vars->ret = svars->drv[t]->store_msg_data( svars->ctx[t], &vars->data, buf, len );
+}
 
 static void
-msg_fetched( int sts, void *aux )
+store_converted( copy_vars_t *vars, const char *buf, int len )
 {
-	copy_vars_t *vars = (copy_vars_t *)aux;
-	DECL_SVARS;
-	char *fmap, *buf;
-	int i, len, extra, scr, tcr, lcrs, hcrs, bcrs, lines;
-	int start, sbreak = 0, ebreak = 0;
-	char c;
+	int n;
+	char obuf[MSG_CHUNK_SIZE];
 
-	switch (sts) {
-	case DRV_OK:
-		INIT_SVARS(vars->aux);
-		if (check_cancel( svars )) {
-			free( vars->data.data );
-			vars->cb( SYNC_CANCELED, 0, vars );
+	if (vars->tcr == vars->scr) {
+		store_data( vars, buf, len );
+		return;
+	}
+	for (; len; buf += n, len -= n) {
+		n = len < (int)sizeof(obuf) / 2 ? len : (int)sizeof(obuf) / 2;
+		store_data( vars, obuf, convert_line_ends( obuf, buf, n, vars->tcr ) );
+	}
+}
+
+/* Find the place for the X-TUID in the header, collecting it if it spans pieces. */
+static void
+scan_header( copy_vars_t *vars, const char *buf, int len )
+{
+	const char *hdr, *eol;
+	int i, hlen, start, lcrs, sbreak, ebreak;
+	char tbuf[8 + TUIDL + 2];
+
+	if (vars->hdr_len) {
+		if (vars->hdr_len + len > vars->hdr_alloc) {
+			vars->hdr_alloc = vars->hdr_len + len;
+			if (vars->hdr_alloc < vars->hdr_len * 2)
+				vars->hdr_alloc = vars->hdr_len * 2;
+			vars->hdr = nfrealloc( vars->hdr, vars->hdr_alloc );
+		}
+		memcpy( vars->hdr + vars->hdr_len, buf, len );
+		vars->hdr_len += len;
+		hdr = vars->hdr;
+		hlen = vars->hdr_len;
+	} else {
+		hdr = buf;
+		hlen = len;
+	}
+	for (;;) {
+		start = vars->hdr_line;
+		if (!(eol = memchr( hdr + start, '\n', hlen - start ))) {
+			if (!vars->hdr_len && len) {
+				vars->hdr = nfmalloc( len );
+				memcpy( vars->hdr, buf, len );
+				vars->hdr_len = vars->hdr_alloc = len;
+			}
 			return;
 		}
+		i = eol - hdr + 1;
+		for (lcrs = 0; eol > hdr + start; )
+			if (*--eol == '\r')
+				lcrs++;
+		if (starts_with_upper( hdr + start, hlen - start, "X-TUID: ", 8 )) {
+			sbreak = start;
+			ebreak = i;
+			break;
+		}
+		vars->hdr_crs += lcrs;
+		if (i - lcrs - 1 == start) {
+			sbreak = ebreak = start;
+			break;
+		}
+		vars->hdr_line = i;
+	}
 
-		vars->msg->flags = vars->data.flags;
-
-		scr = (svars->drv[1-t]->flags / DRV_CRLF) & 1;
-		tcr = (svars->drv[t]->flags / DRV_CRLF) & 1;
-		if (vars->srec || scr != tcr) {
-			fmap = vars->data.data;
-			len = vars->data.len;
-			extra = lines = hcrs = bcrs = i = 0;
-			if (vars->srec) {
-			  nloop:
-				start = i;
-				lcrs = 0;
-				while (i < len) {
-					c = fmap[i++];
-					if (c == '\r')
-						lcrs++;
-					else if (c == '\n') {
-						if (starts_with_upper( fmap + start, len - start, "X-TUID: ", 8 )) {
-							extra = (sbreak = start) - (ebreak = i);
-							goto oke;
-						}
-						lines++;
-						hcrs += lcrs;
-						if (i - lcrs - 1 == start) {
-							sbreak = ebreak = start;
-							goto oke;
-						}
-						goto nloop;
-					}
-				}
-				/* invalid message */
-				warn( "Warning: message %d from %s has incomplete header.\n",
-				      vars->msg->uid, str_ms[1-t] );
-				free( fmap );
-				vars->cb( SYNC_NOGOOD, 0, vars );
-				return;
-			  oke:
-				extra += 8 + TUIDL + 1 + (tcr && (!scr || hcrs));
-			}
-			if (tcr != scr) {
-				for (; i < len; i++) {
-					c = fmap[i];
-					if (c == '\r')
-						bcrs++;
-					else if (c == '\n')
-						lines++;
-				}
-				extra -= hcrs + bcrs;
-				if (tcr)
-					extra += lines;
-			}
+	vars->in_hdr = 0;
+	store_converted( vars, hdr, sbreak );
+	memcpy( tbuf, "X-TUID: ", 8 );
+	memcpy( tbuf + 8, vars->srec->tuid, TUIDL );
+	i = 8 + TUIDL;
+	if (vars->tcr && (!vars->scr || vars->hdr_crs))
+		tbuf[i++] = '\r';
+	tbuf[i++] = '\n';
+	store_data( vars, tbuf, i );
+	store_converted( vars, hdr + ebreak, hlen - ebreak );
+	free( vars->hdr );
+	vars->hdr = 0;
+}
 
-			vars->data.len = len + extra;
-			buf = vars->data.data = nfmalloc( vars->data.len );
-			i = 0;
-			if (vars->srec) {
-				if (tcr != scr) {
-					if (tcr) {
-						for (; i < sbreak; i++)
-							if ((c = fmap[i]) != '\r') {
-								if (c == '\n')
-									*buf++ = '\r';
-								*buf++ = c;
-							}
-					} else {
-						for (; i < sbreak; i++)
-							if ((c = fmap[i]) != '\r')
-								*buf++ = c;
-					}
-				} else {
-					memcpy( buf, fmap, sbreak );
-					buf += sbreak;
-				}
+static void
+msg_data( const char *buf, int len, void *aux )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
 
-				memcpy( buf, "X-TUID: ", 8 );
-				buf += 8;
-				memcpy( buf, vars->srec->tuid, TUIDL );
-				buf += TUIDL;
-				if (tcr && (!scr || hcrs))
-					*buf++ = '\r';
-				*buf++ = '\n';
-				i = ebreak;
-			}
-			if (tcr != scr) {
-				if (tcr) {
-					for (; i < len; i++)
-						if ((c = fmap[i]) != '\r') {
-							if (c == '\n')
-								*buf++ = '\r';
-							*buf++ = c;
-						}
-				} else {
-					for (; i < len; i++)
-						if ((c = fmap[i]) != '\r')
-							*buf++ = c;
-				}
-			} else
-				memcpy( buf, fmap + i, len - i );
+	if (vars->ret != DRV_OK)
+		return;
+	if (vars->in_hdr)
+		scan_header( vars, buf, len );
+	else
+		store_converted( vars, buf, len );
+}
+
+static void
+msg_fetched( int sts, void *aux )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
+	DECL_INIT_SVARS(vars->aux);
 
-			free( fmap );
+	free( vars->hdr );
+	if (sts == DRV_OK) {
+		if (check_cancel( svars )) {
+			sts = DRV_CANCELED;
+		} else if (vars->in_hdr) {
+			/* invalid message */
+			warn( "Warning: message %d from %s has incomplete header.\n",
+			      vars->msg->uid, str_ms[1-t] );
+			sts = DRV_MSG_BAD;
+		} else {
+			if (!vars->started)
+				store_data( vars, "", 0 );
+			if (vars->ret != DRV_OK) {
+				sts = vars->ret;
+				if (vars->data.stream)
+					svars->drv[t]->abort_store_msg( svars->ctx[t], &vars->data );
+				msg_stored( sts, 0, vars );
+				return;
+			}
+			vars->msg->flags = vars->data.flags;
+			if (svars->chan->link_dups && vars->srec && vars->msg->msgid && svars->drv[t]->stash_stored_msg)
+				stash_stored_msg( svars, vars->srec, vars->msg, &vars->data, t );
+			svars->drv[t]->store_msg( svars->ctx[t], &vars->data, !vars->srec, msg_stored, vars );
+			return;
 		}
+	}
+	if (vars->data.stream)
+		svars->drv[t]->abort_store_msg( svars->ctx[t], &vars->data );
 
-		svars->drv[t]->store_msg( svars->ctx[t], &vars->data, !vars->srec, msg_stored, vars );
-		break;
+	switch (sts) {
 	case DRV_CANCELED:
 		vars->cb( SYNC_CANCELED, 0, vars );
 		break;
@@ -541,21 +882,18 @@ check_ret( int sts, void *aux )
 		return; \
 	INIT_SVARS(aux)
 
+/* The vars are not freed upon cancellation; the arena is released anyway. */
 #define SVARS_CHECK_RET_VARS(type) \
 	type *vars = (type *)aux; \
 	DECL_SVARS; \
-	if (check_ret( sts, vars->aux )) { \
-		free( vars ); \
+	if (check_ret( sts, vars->aux )) \
 		return; \
-	} \
 	INIT_SVARS(vars->aux)
 
 #define SVARS_CHECK_CANCEL_RET \
 	DECL_SVARS; \
-	if (sts == SYNC_CANCELED) { \
-		free( vars ); \
+	if (sts == SYNC_CANCELED) \
 		return; \
-	} \
 	INIT_SVARS(vars->aux)
 
 static char *
@@ -572,7 +910,29 @@ clean_strdup( const char *s )
 }
 
 
-#define JOURNAL_VERSION "2"
+#define JOURNAL_VERSION "3"
+
+/* The binary sync state is a header followed by fixed-size records sorted
+ * by master UID. It is in host byte order, as it is not meant to be shared
+ * between machines; a foreign file is rejected rather than misinterpreted.
+ * The leading NUL of the magic cannot start a text state file. */
+#define BSTATE_VERSION 3
+#define BSTATE_BYTE_ORDER 0x01020304
+
+static const char bstate_magic[8] = "\0" EXE "S";
+
+typedef struct {
+	char magic[8];
+	int version, byte_order, nrecs;
+	int uidval[2], maxuid[2], smaxxuid;
+	uint64_t modseq[2]; /* not in version 1 */
+	int window_uid[2]; /* not before version 3 */
+} bstate_hdr_t;
+
+typedef struct {
+	int uid[2];
+	uchar status, flags, pad[2];
+} bstate_rec_t;
 
 static int
 prepare_state( sync_vars_t *svars )
@@ -617,79 +977,662 @@ prepare_state( sync_vars_t *svars )
 }
 
 static int
-lock_state( sync_vars_t *svars )
+lock_state( sync_vars_t *svars )
+{
+	struct flock lck;
+
+	if (svars->lfd >= 0)
+		return 1;
+	memset( &lck, 0, sizeof(lck) );
+#if SEEK_SET != 0
+	lck.l_whence = SEEK_SET;
+#endif
+#if F_WRLCK != 0
+	lck.l_type = F_WRLCK;
+#endif
+	if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
+		sys_error( "Error: cannot create lock file %s", svars->lname );
+		return 0;
+	}
+	if (fcntl( svars->lfd, F_SETLK, &lck )) {
+		error( "Error: channel :%s:%s-:%s:%s is locked\n",
+		       svars->chan->stores[M]->name, svars->orig_name[M], svars->chan->stores[S]->name, svars->orig_name[S] );
+		close( svars->lfd );
+		svars->lfd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+static void
+Fwrite( FILE *f, const void *buf, size_t len )
+{
+	if (fwrite( buf, 1, len, f ) != len) {
+		sys_error( "Error: cannot write file" );
+		exit( 1 );
+	}
+}
+
+static int
+srec_cmp_muid( const void *a, const void *b )
+{
+	const sync_rec_t *l = *(const sync_rec_t * const *)a, *r = *(const sync_rec_t * const *)b;
+
+	if (l->uid[M] != r->uid[M])
+		return l->uid[M] < r->uid[M] ? -1 : 1;
+	return l->uid[S] < r->uid[S] ? -1 : l->uid[S] > r->uid[S];
+}
+
+static void
+save_bin_state( sync_vars_t *svars )
+{
+	sync_rec_t *srec, **srecs;
+	bstate_rec_t *recs;
+	bstate_hdr_t hdr;
+	int i, n;
+
+	srecs = nfmalloc( (svars->nsrecs + 1) * sizeof(*srecs) );
+	for (n = 0, srec = svars->srecs; srec; srec = srec->next)
+		if (!(srec->status & S_DEAD))
+			srecs[n++] = srec;
+	qsort( srecs, n, sizeof(*srecs), srec_cmp_muid );
+
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, bstate_magic, sizeof(hdr.magic) );
+	hdr.version = BSTATE_VERSION;
+	hdr.byte_order = BSTATE_BYTE_ORDER;
+	hdr.nrecs = n;
+	hdr.uidval[M] = svars->uidval[M];
+	hdr.uidval[S] = svars->uidval[S];
+	hdr.maxuid[M] = svars->maxuid[M];
+	hdr.maxuid[S] = svars->maxuid[S];
+	hdr.smaxxuid = svars->smaxxuid;
+	hdr.modseq[M] = svars->modseq[M];
+	hdr.modseq[S] = svars->modseq[S];
+	hdr.window_uid[M] = svars->window_uid[M];
+	hdr.window_uid[S] = svars->window_uid[S];
+	Fwrite( svars->nfp, &hdr, sizeof(hdr) );
+
+	recs = nfcalloc( (n + 1) * sizeof(*recs) );
+	for (i = 0; i < n; i++) {
+		recs[i].uid[M] = srecs[i]->uid[M];
+		recs[i].uid[S] = srecs[i]->uid[S];
+		recs[i].status = srecs[i]->status & S_EXPIRED;
+		recs[i].flags = srecs[i]->flags;
+	}
+	Fwrite( svars->nfp, recs, n * sizeof(*recs) );
+	free( recs );
+	free( srecs );
+}
+
+typedef struct {
+	FILE *nfp;
+	char *dname, *jname, *nname, *lname;
+	int fd, lfd;
+} state_commit_t;
+
+static void
+commit_state( const char *dname, const char *jname, const char *nname, int append )
+{
+	if (append) {
+		/* The grown state file supersedes the journal, see load_state(). */
+		if (unlink( nname ))
+			warn( "Warning: cannot delete new sync state %s\n", nname );
+		else if (unlink( jname ))
+			warn( "Warning: cannot delete journal %s\n", jname );
+	} else {
+		/* order is important! */
+		if (rename( nname, dname ))
+			warn( "Warning: cannot commit sync state %s\n", dname );
+		else if (unlink( jname ))
+			warn( "Warning: cannot delete journal %s\n", jname );
+	}
+}
+
+static void
+state_synced( int err, void *aux )
+{
+	state_commit_t *sc = (state_commit_t *)aux;
+
+	if (err || (sc->fd >= 0 && close( sc->fd ))) {
+		sys_error( "Error: cannot write sync state %s", sc->dname );
+		exit( 1 );
+	}
+	Fclose( sc->nfp, 0 );
+	commit_state( sc->dname, sc->jname, sc->nname, sc->fd >= 0 );
+	unlink( sc->lname );
+	close( sc->lfd );
+	free( sc->dname );
+	free( sc->jname );
+	free( sc->nname );
+	free( sc->lname );
+	free( sc );
+}
+
+/* With FSync Batch, the commit of the sync state is deferred until the
+ * file (or the appended delta, if fd is valid) is synced together with
+ * other pending writes. The lock is held until then. */
+static void
+defer_state_commit( sync_vars_t *svars, int fd )
+{
+	state_commit_t *sc;
+
+	if (fflush( svars->nfp )) {
+		sys_error( "Error: cannot write file" );
+		exit( 1 );
+	}
+	Fclose( svars->jfp, 0 );
+	sc = nfmalloc( sizeof(*sc) );
+	sc->nfp = svars->nfp;
+	sc->dname = nfstrdup( svars->dname );
+	sc->jname = nfstrdup( svars->jname );
+	sc->nname = nfstrdup( svars->nname );
+	sc->lname = nfstrdup( svars->lname );
+	sc->fd = fd;
+	sc->lfd = svars->lfd;
+	svars->lfd = -1;
+	defer_fsync( fd >= 0 ? fd : fileno( sc->nfp ), state_synced, sc );
+}
+
+/* Append the persistent part of this run's journal to the sync state as
+ * one length-prefixed delta record. Returns 0 if the state needs to be
+ * compacted (i.e., fully rewritten) instead. */
+static int
+append_state_delta( sync_vars_t *svars )
+{
+	FILE *jfp;
+	char *seg;
+	int fd, line, based, t, sl, sa, hl, maxuid[2];
+	char buf[128], hbuf[16];
+
+	if (!svars->existing || svars->state_fmt != svars->chan->state_format)
+		return 0;
+	if (!(jfp = fopen( svars->jname, "r" ))) {
+		sys_error( "Error: cannot read journal %s", svars->jname );
+		return 0;
+	}
+	seg = 0;
+	sl = sa = 0;
+	based = 0;
+	maxuid[M] = svars->state_maxuid[M];
+	maxuid[S] = svars->state_maxuid[S];
+	for (line = 0; fgets( buf, sizeof(buf), jfp ); line++) {
+		/* The TUID related entries are meaningful only to an interrupted run. */
+		if (!line || buf[0] == '{' || buf[0] == '}' || buf[0] == '#')
+			continue;
+		if (buf[0] == '=') {
+			based = 1;
+			continue;
+		}
+		if (buf[0] == '(' || buf[0] == ')') {
+			/* These are logged even if nothing changed. */
+			t = atoi( buf + 2 );
+			if (maxuid[buf[0] == ')'] == t)
+				continue;
+			maxuid[buf[0] == ')'] = t;
+		}
+		t = strlen( buf );
+		if (sl + t > sa) {
+			sa = (sl + t) * 2;
+			seg = nfrealloc( seg, sa );
+		}
+		memcpy( seg + sl, buf, t );
+		sl += t;
+	}
+	fclose( jfp );
+	if (!based) {
+		debug( "journal has no sync state base, compacting\n" );
+		goto compact;
+	}
+	if ((double)(svars->state_len - svars->snap_len + sl) * 100 >
+	    (double)svars->chan->state_delta * svars->snap_len) {
+		debug( "sync state delta exceeds %d%%, compacting\n", svars->chan->state_delta );
+		goto compact;
+	}
+	if (sl) {
+		debug( "appending %d bytes to sync state delta\n", sl );
+		if ((fd = open( svars->dname, O_WRONLY )) < 0) {
+			sys_error( "Error: cannot open sync state %s", svars->dname );
+			goto compact;
+		}
+		hl = sprintf( hbuf, "= %d\n", sl );
+		if (ftruncate( fd, svars->state_len ) || lseek( fd, 0, SEEK_END ) != svars->state_len ||
+		    write( fd, hbuf, hl ) != hl || write( fd, seg, sl ) != sl || (UseFSync == FSYNC_FULL && fdatasync( fd ))) {
+			sys_error( "Error: cannot append to sync state %s", svars->dname );
+			if (ftruncate( fd, svars->state_len ))
+				sys_error( "Error: cannot truncate sync state %s", svars->dname );
+			close( fd );
+			goto compact;
+		}
+		if (UseFSync == FSYNC_BATCH) {
+			free( seg );
+			defer_state_commit( svars, fd );
+			return 1;
+		}
+		if (close( fd )) {
+			sys_error( "Error: cannot append to sync state %s", svars->dname );
+			goto compact;
+		}
+	}
+	free( seg );
+	Fclose( svars->nfp, 0 );
+	Fclose( svars->jfp, 0 );
+	commit_state( svars->dname, svars->jname, svars->nname, 1 );
+	return 1;
+
+  compact:
+	free( seg );
+	return 0;
+}
+
+static void
+save_state( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	char fbuf[16]; /* enlarge when support for keywords is added */
+
+	if (svars->chan->state_delta && !(DFlags & KEEPJOURNAL) && append_state_delta( svars ))
+		return;
+	if (svars->chan->state_format == STATE_BINARY) {
+		save_bin_state( svars );
+		goto commit;
+	}
+	Fprintf( svars->nfp,
+	         "MasterUidValidity %d\nSlaveUidValidity %d\nMaxPulledUid %d\nMaxPushedUid %d\n",
+	         svars->uidval[M], svars->uidval[S], svars->maxuid[M], svars->maxuid[S] );
+	if (svars->smaxxuid)
+		Fprintf( svars->nfp, "MaxExpiredSlaveUid %d\n", svars->smaxxuid );
+	if (svars->modseq[M])
+		Fprintf( svars->nfp, "MasterHighestModSeq %" PRIu64 "\n", svars->modseq[M] );
+	if (svars->modseq[S])
+		Fprintf( svars->nfp, "SlaveHighestModSeq %" PRIu64 "\n", svars->modseq[S] );
+	if (svars->window_uid[M])
+		Fprintf( svars->nfp, "MasterWindowUid %d\n", svars->window_uid[M] );
+	if (svars->window_uid[S])
+		Fprintf( svars->nfp, "SlaveWindowUid %d\n", svars->window_uid[S] );
+	Fprintf( svars->nfp, "\n" );
+	for (srec = svars->srecs; srec; srec = srec->next) {
+		if (srec->status & S_DEAD)
+			continue;
+		make_flags( srec->flags, fbuf );
+		Fprintf( svars->nfp, "%d %d %s%s\n", srec->uid[M], srec->uid[S],
+		         srec->status & S_EXPIRED ? "X" : "", fbuf );
+	}
+
+  commit:
+	if (UseFSync == FSYNC_BATCH && !(DFlags & KEEPJOURNAL)) {
+		defer_state_commit( svars, -1 );
+		return;
+	}
+	Fclose( svars->nfp, 1 );
+	Fclose( svars->jfp, 0 );
+	if (!(DFlags & KEEPJOURNAL))
+		commit_state( svars->dname, svars->jname, svars->nname, 0 );
+}
+
+/* Index of the sync records by UID pair, for looking up replayed entries.
+ * Entries are not removed when a record's UIDs change; the lookup compares
+ * the records' current UIDs, so stale entries are harmless. */
+typedef struct {
+	sync_rec_t **map;
+	uint hashsz, count;
+} srec_index_t;
+
+static uint
+hash_uid_pair( int uid1, int uid2 )
+{
+	return ((uint)uid1 * 1103515245U + (uint)uid2) * 1103515245U;
+}
+
+static void
+srec_index_insert( srec_index_t *sidx, sync_rec_t *srec )
+{
+	uint idx;
+
+	idx = hash_uid_pair( srec->uid[M], srec->uid[S] ) % sidx->hashsz;
+	while (sidx->map[idx])
+		if (++idx == sidx->hashsz)
+			idx = 0;
+	sidx->map[idx] = srec;
+	sidx->count++;
+}
+
+static void
+srec_index_build( sync_vars_t *svars, srec_index_t *sidx )
+{
+	sync_rec_t *srec;
+
+	free( sidx->map );
+	sidx->hashsz = bucketsForSize( (svars->nsrecs + 1) * 3 );
+	sidx->map = nfcalloc( sidx->hashsz * sizeof(*sidx->map) );
+	sidx->count = 0;
+	for (srec = svars->srecs; srec; srec = srec->next)
+		srec_index_insert( sidx, srec );
+}
+
+/* Call after adding a record or changing its UIDs. */
+static void
+srec_index_update( sync_vars_t *svars, srec_index_t *sidx, sync_rec_t *srec )
+{
+	if (!sidx->map)
+		return;
+	if ((sidx->count + 1) * 3 > sidx->hashsz * 2)
+		srec_index_build( svars, sidx );
+	else
+		srec_index_insert( sidx, srec );
+}
+
+static sync_rec_t *
+srec_index_find( sync_vars_t *svars, srec_index_t *sidx, int uid1, int uid2 )
+{
+	sync_rec_t *srec;
+	uint idx;
+
+	if (!sidx->map)
+		srec_index_build( svars, sidx );
+	idx = hash_uid_pair( uid1, uid2 ) % sidx->hashsz;
+	while ((srec = sidx->map[idx])) {
+		if (srec->uid[M] == uid1 && srec->uid[S] == uid2)
+			return srec;
+		if (++idx == sidx->hashsz)
+			idx = 0;
+	}
+	return 0;
+}
+
+static int
+replay_entry( sync_vars_t *svars, srec_index_t *sidx, const char *buf, int t, const char *fname, int line )
+{
+	sync_rec_t *srec;
+	int t1, t2, t3;
+
+	if (buf[0] == '^') {
+		if (sscanf( buf + 2, "%" SCNu64 " %" SCNu64, &svars->modseq[M], &svars->modseq[S] ) != 2) {
+			error( "Error: malformed journal entry at %s:%d\n", fname, line );
+			return 0;
+		}
+		return 1;
+	}
+	if (buf[0] == '#' ?
+	      (t3 = 0, (sscanf( buf + 2, "%d %d %n", &t1, &t2, &t3 ) < 2) || !t3 || (t - t3 != TUIDL + 3)) :
+	      buf[0] == '(' || buf[0] == ')' || buf[0] == '{' || buf[0] == '}' || buf[0] == '!' ?
+	        (sscanf( buf + 2, "%d", &t1 ) != 1) :
+	        buf[0] == '+' || buf[0] == '&' || buf[0] == '-' || buf[0] == '|' || buf[0] == '@' || buf[0] == '/' || buf[0] == '\\' ?
+	          (sscanf( buf + 2, "%d %d", &t1, &t2 ) != 2) :
+	          (sscanf( buf + 2, "%d %d %d", &t1, &t2, &t3 ) != 3))
+	{
+		error( "Error: malformed journal entry at %s:%d\n", fname, line );
+		return 0;
+	}
+	if (buf[0] == '(')
+		svars->maxuid[M] = t1;
+	else if (buf[0] == ')')
+		svars->maxuid[S] = t1;
+	else if (buf[0] == '{')
+		svars->newuid[M] = t1;
+	else if (buf[0] == '}')
+		svars->newuid[S] = t1;
+	else if (buf[0] == '!')
+		svars->smaxxuid = t1;
+	else if (buf[0] == '|') {
+		svars->uidval[M] = t1;
+		svars->uidval[S] = t2;
+	} else if (buf[0] == '@') {
+		svars->window_uid[M] = t1;
+		svars->window_uid[S] = t2;
+	} else if (buf[0] == '+') {
+		srec = arena_alloc( &svars->srec_arena );
+		srec->uid[M] = t1;
+		srec->uid[S] = t2;
+		if (svars->newmaxuid[M] < t1)
+			svars->newmaxuid[M] = t1;
+		if (svars->newmaxuid[S] < t2)
+			svars->newmaxuid[S] = t2;
+		debug( "  new entry(%d,%d)\n", t1, t2 );
+		srec->msg[M] = srec->msg[S] = 0;
+		srec->status = 0;
+		srec->flags = 0;
+		srec->tuid[0] = 0;
+		srec->next = 0;
+		*svars->srecadd = srec;
+		svars->srecadd = &srec->next;
+		svars->nsrecs++;
+		srec_index_update( svars, sidx, srec );
+	} else {
+		if (!(srec = srec_index_find( svars, sidx, t1, t2 ))) {
+			error( "Error: journal entry at %s:%d refers to non-existing sync state entry\n", fname, line );
+			return 0;
+		}
+		debugn( "  entry(%d,%d,%u) ", srec->uid[M], srec->uid[S], srec->flags );
+		switch (buf[0]) {
+		case '-':
+			debug( "killed\n" );
+			if (srec->msg[M])
+				srec->msg[M]->srec = 0;
+			srec->status = S_DEAD;
+			break;
+		case '#':
+			debug( "TUID now %." stringify(TUIDL) "s\n", buf + t3 + 2 );
+			memcpy( srec->tuid, buf + t3 + 2, TUIDL );
+			break;
+		case '&':
+			debug( "TUID %." stringify(TUIDL) "s lost\n", srec->tuid );
+			srec->flags = 0;
+			srec->tuid[0] = 0;
+			break;
+		case '<':
+			debug( "master now %d\n", t3 );
+			srec->uid[M] = t3;
+			srec->tuid[0] = 0;
+			srec_index_update( svars, sidx, srec );
+			break;
+		case '>':
+			debug( "slave now %d\n", t3 );
+			srec->uid[S] = t3;
+			srec->tuid[0] = 0;
+			srec_index_update( svars, sidx, srec );
+			break;
+		case '*':
+			debug( "flags now %d\n", t3 );
+			srec->flags = t3;
+			break;
+		case '~':
+			debug( "expire now %d\n", t3 );
+			if (t3)
+				srec->status |= S_EXPIRE;
+			else
+				srec->status &= ~S_EXPIRE;
+			break;
+		case '\\':
+			t3 = (srec->status & S_EXPIRED);
+			debug( "expire back to %d\n", t3 / S_EXPIRED );
+			if (t3)
+				srec->status |= S_EXPIRE;
+			else
+				srec->status &= ~S_EXPIRE;
+			break;
+		case '/':
+			t3 = (srec->status & S_EXPIRE);
+			debug( "expired now %d\n", t3 / S_EXPIRE );
+			if (t3) {
+				if (svars->smaxxuid < srec->uid[S])
+					svars->smaxxuid = srec->uid[S];
+				srec->status |= S_EXPIRED;
+			} else
+				srec->status &= ~S_EXPIRED;
+			break;
+		default:
+			error( "Error: unrecognized journal entry at %s:%d\n", fname, line );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+load_state_delta( sync_vars_t *svars, srec_index_t *sidx, FILE *fp, int line )
+{
+	sync_rec_t *srec, **srecp;
+	struct stat st;
+	long end;
+	int t, len, nsegs;
+	char buf[128];
+
+	if (fstat( fileno( fp ), &st )) {
+		sys_error( "Error: cannot stat sync state %s", svars->dname );
+		return 0;
+	}
+	for (nsegs = 0; fgets( buf, sizeof(buf), fp ); nsegs++) {
+		line++;
+		if (!(t = strlen( buf )) || buf[t - 1] != '\n')
+			goto incomplete;
+		if (buf[0] != '=' || sscanf( buf + 2, "%d", &len ) != 1) {
+			error( "Error: malformed sync state delta at %s:%d\n", svars->dname, line );
+			return 0;
+		}
+		if ((end = ftell( fp ) + len) > st.st_size) {
+		  incomplete:
+			/* An interrupted append leaves an incomplete record behind, which is
+			 * discarded. The journal still has the data in that case. */
+			debug( "ignoring incomplete sync state delta at %s:%d\n", svars->dname, line );
+			break;
+		}
+		while (ftell( fp ) < end) {
+			if (!fgets( buf, sizeof(buf), fp ) || !(t = strlen( buf )) || buf[t - 1] != '\n') {
+				error( "Error: incomplete sync state delta entry at %s:%d\n", svars->dname, line + 1 );
+				return 0;
+			}
+			line++;
+			if (!replay_entry( svars, sidx, buf, t, svars->dname, line ))
+				return 0;
+		}
+		svars->state_len = end;
+	}
+	if (!nsegs)
+		return 1;
+	debug( "applied %d sync state delta records\n", nsegs );
+	free( sidx->map );
+	sidx->map = 0;
+	/* Reduce the entries to what a snapshot would have recorded. */
+	for (srecp = &svars->srecs; (srec = *srecp); ) {
+		if (srec->status & S_DEAD) {
+			*srecp = srec->next;
+			arena_free( &svars->srec_arena, srec );
+			svars->nsrecs--;
+		} else {
+			srec->status = (srec->status & S_EXPIRED) ? S_EXPIRE | S_EXPIRED : 0;
+			srec->tuid[0] = 0;
+			srecp = &srec->next;
+		}
+	}
+	svars->srecadd = srecp;
+	return 1;
+}
+
+static int
+load_bin_state( sync_vars_t *svars, int fd )
 {
-	struct flock lck;
+	const bstate_hdr_t *hdr;
+	const bstate_rec_t *rec;
+	sync_rec_t *srec;
+	char *map;
+	struct stat st;
+	size_t hlen;
+	int i, ret = 0;
 
-	if (svars->lfd >= 0)
-		return 1;
-	memset( &lck, 0, sizeof(lck) );
-#if SEEK_SET != 0
-	lck.l_whence = SEEK_SET;
-#endif
-#if F_WRLCK != 0
-	lck.l_type = F_WRLCK;
-#endif
-	if ((svars->lfd = open( svars->lname, O_WRONLY|O_CREAT, 0666 )) < 0) {
-		sys_error( "Error: cannot create lock file %s", svars->lname );
+	if (fstat( fd, &st )) {
+		sys_error( "Error: cannot stat sync state %s", svars->dname );
 		return 0;
 	}
-	if (fcntl( svars->lfd, F_SETLK, &lck )) {
-		error( "Error: channel :%s:%s-:%s:%s is locked\n",
-		       svars->chan->stores[M]->name, svars->orig_name[M], svars->chan->stores[S]->name, svars->orig_name[S] );
-		close( svars->lfd );
-		svars->lfd = -1;
+	if ((size_t)st.st_size < offsetof(bstate_hdr_t, modseq)) {
+		error( "Error: incomplete sync state header in %s\n", svars->dname );
 		return 0;
 	}
-	return 1;
-}
-
-static void
-save_state( sync_vars_t *svars )
-{
-	sync_rec_t *srec;
-	char fbuf[16]; /* enlarge when support for keywords is added */
-
-	Fprintf( svars->nfp,
-	         "MasterUidValidity %d\nSlaveUidValidity %d\nMaxPulledUid %d\nMaxPushedUid %d\n",
-	         svars->uidval[M], svars->uidval[S], svars->maxuid[M], svars->maxuid[S] );
-	if (svars->smaxxuid)
-		Fprintf( svars->nfp, "MaxExpiredSlaveUid %d\n", svars->smaxxuid );
-	Fprintf( svars->nfp, "\n" );
-	for (srec = svars->srecs; srec; srec = srec->next) {
-		if (srec->status & S_DEAD)
-			continue;
-		make_flags( srec->flags, fbuf );
-		Fprintf( svars->nfp, "%d %d %s%s\n", srec->uid[M], srec->uid[S],
-		         srec->status & S_EXPIRED ? "X" : "", fbuf );
+	if ((map = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 )) == MAP_FAILED) {
+		sys_error( "Error: cannot map sync state %s", svars->dname );
+		return 0;
 	}
-
-	Fclose( svars->nfp, 1 );
-	Fclose( svars->jfp, 0 );
-	if (!(DFlags & KEEPJOURNAL)) {
-		/* order is important! */
-		if (rename( svars->nname, svars->dname ))
-			warn( "Warning: cannot commit sync state %s\n", svars->dname );
-		else if (unlink( svars->jname ))
-			warn( "Warning: cannot delete journal %s\n", svars->jname );
+	hdr = (const bstate_hdr_t *)map;
+	if (memcmp( hdr->magic, bstate_magic, sizeof(hdr->magic) ) || hdr->byte_order != BSTATE_BYTE_ORDER) {
+		error( "Error: invalid sync state header in %s\n", svars->dname );
+		goto bail;
+	}
+	if (hdr->version == 1) {
+		hlen = offsetof(bstate_hdr_t, modseq);
+	} else if (hdr->version == 2) {
+		hlen = offsetof(bstate_hdr_t, window_uid);
+	} else if (hdr->version == BSTATE_VERSION) {
+		hlen = sizeof(*hdr);
+	} else {
+		error( "Error: incompatible sync state version in %s (got %d, expected %d)\n",
+		       svars->dname, hdr->version, BSTATE_VERSION );
+		goto bail;
+	}
+	if (hdr->nrecs < 0 || (size_t)st.st_size < hlen + hdr->nrecs * sizeof(*rec)) {
+		error( "Error: sync state %s has an invalid size\n", svars->dname );
+		goto bail;
+	}
+	svars->uidval[M] = hdr->uidval[M];
+	svars->uidval[S] = hdr->uidval[S];
+	svars->maxuid[M] = hdr->maxuid[M];
+	svars->maxuid[S] = hdr->maxuid[S];
+	svars->smaxxuid = hdr->smaxxuid;
+	if (hdr->version > 1) {
+		svars->modseq[M] = hdr->modseq[M];
+		svars->modseq[S] = hdr->modseq[S];
+	}
+	if (hdr->version > 2) {
+		svars->window_uid[M] = hdr->window_uid[M];
+		svars->window_uid[S] = hdr->window_uid[S];
+	}
+	svars->snap_len = hlen + hdr->nrecs * sizeof(*rec);
+	svars->state_fmt = STATE_BINARY;
+	for (rec = (const bstate_rec_t *)(map + hlen), i = 0; i < hdr->nrecs; rec++, i++) {
+		srec = arena_alloc( &svars->srec_arena );
+		srec->uid[M] = rec->uid[M];
+		srec->uid[S] = rec->uid[S];
+		srec->status = (rec->status & S_EXPIRED) ? S_EXPIRE | S_EXPIRED : 0;
+		srec->flags = rec->flags;
+		debug( "  entry (%d,%d,%u,%s)\n", srec->uid[M], srec->uid[S], srec->flags, srec->status & S_EXPIRED ? "X" : "" );
+		srec->msg[M] = srec->msg[S] = 0;
+		srec->tuid[0] = 0;
+		srec->next = 0;
+		*svars->srecadd = srec;
+		svars->srecadd = &srec->next;
+		svars->nsrecs++;
 	}
+	ret = 1;
+  bail:
+	munmap( map, st.st_size );
+	return ret;
 }
 
 static int
 load_state( sync_vars_t *svars )
 {
-	sync_rec_t *srec, *nsrec;
+	sync_rec_t *srec;
+	srec_index_t sidx;
 	char *s;
 	FILE *jfp;
-	int line, t, t1, t2, t3;
+	int line, t, t1, t2;
 	struct stat st;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 	char buf[128], buf1[64], buf2[64];
 
+	memset( &sidx, 0, sizeof(sidx) );
 	if ((jfp = fopen( svars->dname, "r" ))) {
 		if (!lock_state( svars ))
 			goto jbail;
 		debug( "reading sync state %s ...\n", svars->dname );
+		if ((t = getc( jfp )) == bstate_magic[0]) {
+			if (!load_bin_state( svars, fileno( jfp ) ))
+				goto jbail;
+			fseek( jfp, svars->snap_len, SEEK_SET );
+			line = 0;
+			goto gotsnap;
+		}
+		if (t != EOF)
+			ungetc( t, jfp );
 		line = 0;
 		while (fgets( buf, sizeof(buf), jfp )) {
 			line++;
@@ -697,6 +1640,7 @@ load_state( sync_vars_t *svars )
 				error( "Error: incomplete sync state header entry at %s:%d\n", svars->dname, line );
 			  jbail:
 				fclose( jfp );
+				free( sidx.map );
 				return 0;
 			}
 			if (t == 1)
@@ -724,6 +1668,14 @@ load_state( sync_vars_t *svars )
 				svars->maxuid[S] = t1;
 			else if (!strcmp( buf1, "MaxExpiredSlaveUid" ))
 				svars->smaxxuid = t1;
+			else if (!strcmp( buf1, "MasterHighestModSeq" ))
+				sscanf( buf, "%*s %" SCNu64, &svars->modseq[M] );
+			else if (!strcmp( buf1, "SlaveHighestModSeq" ))
+				sscanf( buf, "%*s %" SCNu64, &svars->modseq[S] );
+			else if (!strcmp( buf1, "MasterWindowUid" ))
+				svars->window_uid[M] = t1;
+			else if (!strcmp( buf1, "SlaveWindowUid" ))
+				svars->window_uid[S] = t1;
 			else {
 				error( "Error: unrecognized sync state header entry at %s:%d\n", svars->dname, line );
 				goto jbail;
@@ -734,7 +1686,13 @@ load_state( sync_vars_t *svars )
 	  gothdr:
 		while (fgets( buf, sizeof(buf), jfp )) {
 			line++;
-			if (!(t = strlen( buf )) || buf[t - 1] != '\n') {
+			t = strlen( buf );
+			if (buf[0] == '=') {
+				fseek( jfp, -t, SEEK_CUR );
+				line--;
+				break;
+			}
+			if (!t || buf[t - 1] != '\n') {
 				error( "Error: incomplete sync state entry at %s:%d\n", svars->dname, line );
 				goto jbail;
 			}
@@ -743,7 +1701,7 @@ load_state( sync_vars_t *svars )
 				error( "Error: invalid sync state entry at %s:%d\n", svars->dname, line );
 				goto jbail;
 			}
-			srec = nfmalloc( sizeof(*srec) );
+			srec = arena_alloc( &svars->srec_arena );
 			srec->uid[M] = t1;
 			srec->uid[S] = t2;
 			s = fbuf;
@@ -761,6 +1719,11 @@ load_state( sync_vars_t *svars )
 			svars->srecadd = &srec->next;
 			svars->nsrecs++;
 		}
+		svars->snap_len = ftell( jfp );
+	  gotsnap:
+		svars->state_len = svars->snap_len;
+		if (!load_state_delta( svars, &sidx, jfp, line ))
+			goto jbail;
 		fclose( jfp );
 		svars->existing = 1;
 	} else {
@@ -770,8 +1733,8 @@ load_state( sync_vars_t *svars )
 		}
 		svars->existing = 0;
 	}
-	svars->newmaxuid[M] = svars->maxuid[M];
-	svars->newmaxuid[S] = svars->maxuid[S];
+	svars->state_maxuid[M] = svars->newmaxuid[M] = svars->maxuid[M];
+	svars->state_maxuid[S] = svars->newmaxuid[S] = svars->maxuid[S];
 	svars->mmaxxuid = INT_MAX;
 	line = 0;
 	if ((jfp = fopen( svars->jname, "r" ))) {
@@ -788,7 +1751,6 @@ load_state( sync_vars_t *svars )
 				                 "(got %.*s, expected " JOURNAL_VERSION ")\n", t - 1, buf );
 				goto jbail;
 			}
-			srec = 0;
 			line = 1;
 			while (fgets( buf, sizeof(buf), jfp )) {
 				line++;
@@ -796,118 +1758,28 @@ load_state( sync_vars_t *svars )
 					error( "Error: incomplete journal entry at %s:%d\n", svars->jname, line );
 					goto jbail;
 				}
-				if (buf[0] == '#' ?
-				      (t3 = 0, (sscanf( buf + 2, "%d %d %n", &t1, &t2, &t3 ) < 2) || !t3 || (t - t3 != TUIDL + 3)) :
-				      buf[0] == '(' || buf[0] == ')' || buf[0] == '{' || buf[0] == '}' || buf[0] == '!' ?
-				        (sscanf( buf + 2, "%d", &t1 ) != 1) :
-				        buf[0] == '+' || buf[0] == '&' || buf[0] == '-' || buf[0] == '|' || buf[0] == '/' || buf[0] == '\\' ?
-				          (sscanf( buf + 2, "%d %d", &t1, &t2 ) != 2) :
-				          (sscanf( buf + 2, "%d %d %d", &t1, &t2, &t3 ) != 3))
-				{
-					error( "Error: malformed journal entry at %s:%d\n", svars->jname, line );
-					goto jbail;
-				}
-				if (buf[0] == '(')
-					svars->maxuid[M] = t1;
-				else if (buf[0] == ')')
-					svars->maxuid[S] = t1;
-				else if (buf[0] == '{')
-					svars->newuid[M] = t1;
-				else if (buf[0] == '}')
-					svars->newuid[S] = t1;
-				else if (buf[0] == '!')
-					svars->smaxxuid = t1;
-				else if (buf[0] == '|') {
-					svars->uidval[M] = t1;
-					svars->uidval[S] = t2;
-				} else if (buf[0] == '+') {
-					srec = nfmalloc( sizeof(*srec) );
-					srec->uid[M] = t1;
-					srec->uid[S] = t2;
-					if (svars->newmaxuid[M] < t1)
-						svars->newmaxuid[M] = t1;
-					if (svars->newmaxuid[S] < t2)
-						svars->newmaxuid[S] = t2;
-					debug( "  new entry(%d,%d)\n", t1, t2 );
-					srec->msg[M] = srec->msg[S] = 0;
-					srec->status = 0;
-					srec->flags = 0;
-					srec->tuid[0] = 0;
-					srec->next = 0;
-					*svars->srecadd = srec;
-					svars->srecadd = &srec->next;
-					svars->nsrecs++;
-				} else {
-					for (nsrec = srec; srec; srec = srec->next)
-						if (srec->uid[M] == t1 && srec->uid[S] == t2)
-							goto syncfnd;
-					for (srec = svars->srecs; srec != nsrec; srec = srec->next)
-						if (srec->uid[M] == t1 && srec->uid[S] == t2)
-							goto syncfnd;
-					error( "Error: journal entry at %s:%d refers to non-existing sync state entry\n", svars->jname, line );
-					goto jbail;
-				  syncfnd:
-					debugn( "  entry(%d,%d,%u) ", srec->uid[M], srec->uid[S], srec->flags );
-					switch (buf[0]) {
-					case '-':
-						debug( "killed\n" );
-						if (srec->msg[M])
-							srec->msg[M]->srec = 0;
-						srec->status = S_DEAD;
-						break;
-					case '#':
-						debug( "TUID now %." stringify(TUIDL) "s\n", buf + t3 + 2 );
-						memcpy( srec->tuid, buf + t3 + 2, TUIDL );
-						break;
-					case '&':
-						debug( "TUID %." stringify(TUIDL) "s lost\n", srec->tuid );
-						srec->flags = 0;
-						srec->tuid[0] = 0;
-						break;
-					case '<':
-						debug( "master now %d\n", t3 );
-						srec->uid[M] = t3;
-						srec->tuid[0] = 0;
-						break;
-					case '>':
-						debug( "slave now %d\n", t3 );
-						srec->uid[S] = t3;
-						srec->tuid[0] = 0;
-						break;
-					case '*':
-						debug( "flags now %d\n", t3 );
-						srec->flags = t3;
-						break;
-					case '~':
-						debug( "expire now %d\n", t3 );
-						if (t3)
-							srec->status |= S_EXPIRE;
-						else
-							srec->status &= ~S_EXPIRE;
-						break;
-					case '\\':
-						t3 = (srec->status & S_EXPIRED);
-						debug( "expire back to %d\n", t3 / S_EXPIRED );
-						if (t3)
-							srec->status |= S_EXPIRE;
-						else
-							srec->status &= ~S_EXPIRE;
-						break;
-					case '/':
-						t3 = (srec->status & S_EXPIRE);
-						debug( "expired now %d\n", t3 / S_EXPIRE );
-						if (t3) {
-							if (svars->smaxxuid < srec->uid[S])
-								svars->smaxxuid = srec->uid[S];
-							srec->status |= S_EXPIRED;
-						} else
-							srec->status &= ~S_EXPIRED;
-						break;
-					default:
-						error( "Error: unrecognized journal entry at %s:%d\n", svars->jname, line );
+				if (buf[0] == '=') {
+					if (sscanf( buf + 2, "%d", &t1 ) != 1) {
+						error( "Error: malformed journal entry at %s:%d\n", svars->jname, line );
 						goto jbail;
 					}
+					if (t1 != svars->state_len) {
+						/* The sync state grew past the journal's base, so the
+						 * journal was already appended as a delta. */
+						debug( "journal already merged into sync state\n" );
+						fclose( jfp );
+						if (unlink( svars->jname )) {
+							sys_error( "Error: cannot delete journal %s", svars->jname );
+							free( sidx.map );
+							return 0;
+						}
+						line = 0;
+						goto jdone;
+					}
+					continue;
 				}
+				if (!replay_entry( svars, &sidx, buf, t, svars->jname, line ))
+					goto jbail;
 			}
 		}
 		fclose( jfp );
@@ -917,6 +1789,8 @@ load_state( sync_vars_t *svars )
 			return 0;
 		}
 	}
+  jdone:
+	free( sidx.map );
 	svars->replayed = line;
 	return 1;
 }
@@ -934,6 +1808,7 @@ delete_state( sync_vars_t *svars )
 
 static void box_confirmed( int sts, void *aux );
 static void box_confirmed2( sync_vars_t *svars, int t );
+static void prepare_opts( sync_vars_t *svars );
 static void box_deleted( int sts, void *aux );
 static void box_created( int sts, void *aux );
 static void box_opened( int sts, void *aux );
@@ -942,7 +1817,7 @@ static void load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nm
 
 void
 sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *chan,
-            void (*cb)( int sts, void *aux ), void *aux )
+            move_map_t *moves, void (*cb)( int sts, void *aux ), void *aux )
 {
 	sync_vars_t *svars;
 	int t;
@@ -955,18 +1830,19 @@ sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *
 	svars->ctx[0] = ctx[0];
 	svars->ctx[1] = ctx[1];
 	svars->chan = chan;
+	svars->moves = moves;
 	svars->lfd = -1;
 	svars->uidval[0] = svars->uidval[1] = -1;
 	svars->srecadd = &svars->srecs;
+	arena_init( &svars->srec_arena, sizeof(sync_rec_t) );
+	arena_init( &svars->flag_arena, sizeof(flag_vars_t) );
+	arena_init( &svars->copy_arena, sizeof(copy_vars_t) );
 
 	for (t = 0; t < 2; t++) {
 		svars->orig_name[t] =
 			(!names[t] || (ctx[t]->conf->map_inbox && !strcmp( ctx[t]->conf->map_inbox, names[t] ))) ?
 				"INBOX" : names[t];
-		if (!ctx[t]->conf->flat_delim) {
-			svars->box_name[t] = nfstrdup( svars->orig_name[t] );
-		} else if (map_name( svars->orig_name[t], &svars->box_name[t], 0, "/", ctx[t]->conf->flat_delim ) < 0) {
-			error( "Error: canonical mailbox name '%s' contains flattened hierarchy delimiter\n", svars->orig_name[t] );
+		if (!(svars->box_name[t] = driver_box_name( ctx[t], svars->orig_name[t] ))) {
 		  bail3:
 			svars->ret = SYNC_FAIL;
 			sync_bail3( svars );
@@ -998,6 +1874,10 @@ sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *
 		sync_bail( svars );
 		return;
 	}
+	if (!svars->existing && chan->recover_state)
+		svars->recover = 1;
+	/* The drivers may open boxes which are only appended to more cheaply. */
+	prepare_opts( svars );
 
 	sync_ref( svars );
 	for (t = 0; ; t++) {
@@ -1133,49 +2013,11 @@ box_opened( int sts, void *aux )
 }
 
 static void
-box_opened2( sync_vars_t *svars, int t )
+prepare_opts( sync_vars_t *svars )
 {
-	store_t *ctx[2];
-	channel_conf_t *chan;
+	channel_conf_t *chan = svars->chan;
 	sync_rec_t *srec;
-	int opts[2], fails;
-	int *mexcs, nmexcs, rmexcs, minwuid;
-
-	svars->state[t] |= ST_SELECTED;
-	if (!(svars->state[1-t] & ST_SELECTED))
-		return;
-	ctx[0] = svars->ctx[0];
-	ctx[1] = svars->ctx[1];
-	chan = svars->chan;
-
-	fails = 0;
-	for (t = 0; t < 2; t++)
-		if (svars->uidval[t] >= 0 && svars->uidval[t] != ctx[t]->uidvalidity) {
-			error( "Error: UIDVALIDITY of %s changed (got %d, expected %d)\n",
-			       str_ms[t], ctx[t]->uidvalidity, svars->uidval[t] );
-			fails++;
-		}
-	if (fails) {
-	  bail:
-		svars->ret = SYNC_FAIL;
-		sync_bail( svars );
-		return;
-	}
-
-	if (!lock_state( svars ))
-		goto bail;
-	if (!(svars->nfp = fopen( svars->nname, "w" ))) {
-		sys_error( "Error: cannot create new sync state %s", svars->nname );
-		goto bail;
-	}
-	if (!(svars->jfp = fopen( svars->jname, "a" ))) {
-		sys_error( "Error: cannot create journal %s", svars->jname );
-		fclose( svars->nfp );
-		goto bail;
-	}
-	setlinebuf( svars->jfp );
-	if (!svars->replayed)
-		Fprintf( svars->jfp, JOURNAL_VERSION "\n" );
+	int t, opts[2];
 
 	opts[M] = opts[S] = 0;
 	for (t = 0; t < 2; t++) {
@@ -1208,6 +2050,14 @@ box_opened2( sync_vars_t *svars, int t )
 	}
 	if ((chan->ops[S] & (OP_NEW|OP_RENEW|OP_FLAGS)) && chan->max_messages)
 		opts[S] |= OPEN_OLD|OPEN_NEW|OPEN_FLAGS;
+	if (svars->moves)
+		for (t = 0; t < 2; t++)
+			if ((chan->ops[t] & OP_NEW) && svars->drv[t]->stash_msg)
+				opts[1-t] |= OPEN_MSGID;
+	if (svars->recover) {
+		opts[M] |= OPEN_NEW|OPEN_FLAGS|OPEN_MSGID;
+		opts[S] |= OPEN_NEW|OPEN_FLAGS|OPEN_MSGID;
+	}
 	if (svars->replayed)
 		for (srec = svars->srecs; srec; srec = srec->next) {
 			if (srec->status & S_DEAD)
@@ -1221,8 +2071,133 @@ box_opened2( sync_vars_t *svars, int t )
 					assert( !"sync record with stray TUID" );
 			}
 		}
-	svars->drv[M]->prepare_load_box( ctx[M], opts[M] );
-	svars->drv[S]->prepare_load_box( ctx[S], opts[S] );
+	svars->drv[M]->prepare_load_box( svars->ctx[M], opts[M] );
+	svars->drv[S]->prepare_load_box( svars->ctx[S], opts[S] );
+}
+
+/* Whether the synced flags in the sync records are known to match all
+ * messages on the given side, so only changed messages need to be looked at. */
+static int
+flags_tracked( sync_vars_t *svars, int t )
+{
+	channel_conf_t *chan = svars->chan;
+
+	return (chan->ops[1-t] & OP_FLAGS) && !chan->max_messages && !chan->max_age;
+}
+
+static void
+box_opened2( sync_vars_t *svars, int t )
+{
+	store_t *ctx[2];
+	channel_conf_t *chan;
+	sync_rec_t *srec;
+	int fails;
+	int *mexcs, nmexcs, rmexcs, minwuid, minuid[2];
+
+	svars->state[t] |= ST_SELECTED;
+	if (!(svars->state[1-t] & ST_SELECTED))
+		return;
+	ctx[0] = svars->ctx[0];
+	ctx[1] = svars->ctx[1];
+	chan = svars->chan;
+
+	fails = 0;
+	for (t = 0; t < 2; t++)
+		if (svars->uidval[t] >= 0 && svars->uidval[t] != ctx[t]->uidvalidity) {
+			if (chan->recover_state) {
+				warn( "Warning: UIDVALIDITY of %s changed (got %d, expected %d); recovering sync state\n",
+				      str_ms[t], ctx[t]->uidvalidity, svars->uidval[t] );
+				svars->recover = 1;
+			} else {
+				error( "Error: UIDVALIDITY of %s changed (got %d, expected %d)\n",
+				       str_ms[t], ctx[t]->uidvalidity, svars->uidval[t] );
+				fails++;
+			}
+		}
+	if (fails) {
+	  bail:
+		svars->ret = SYNC_FAIL;
+		sync_bail( svars );
+		return;
+	}
+
+	if (!lock_state( svars ))
+		goto bail;
+	if (!(svars->nfp = fopen( svars->nname, "w" ))) {
+		sys_error( "Error: cannot create new sync state %s", svars->nname );
+		goto bail;
+	}
+	if (!(svars->jfp = fopen( svars->jname, "a" ))) {
+		sys_error( "Error: cannot create journal %s", svars->jname );
+		fclose( svars->nfp );
+		goto bail;
+	}
+	setlinebuf( svars->jfp );
+	if (!svars->replayed) {
+		Fprintf( svars->jfp, JOURNAL_VERSION "\n" );
+		if (chan->state_delta && svars->existing)
+			Fprintf( svars->jfp, "= %d\n", svars->state_len );
+	}
+	if (svars->recover && svars->existing) {
+		/* Start from scratch; the sync records are re-created once both sides are loaded. */
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			srec->status = S_DEAD;
+			Fprintf( svars->jfp, "- %d %d\n", srec->uid[M], srec->uid[S] );
+		}
+		for (t = 0; t < 2; t++)
+			svars->maxuid[t] = svars->newmaxuid[t] = svars->newuid[t] = 0;
+		svars->smaxxuid = 0;
+		svars->modseq[M] = svars->modseq[S] = 0;
+		svars->window_uid[M] = svars->window_uid[S] = 0;
+		Fprintf( svars->jfp, "( 0\n) 0\n{ 0\n} 0\n! 0\n^ 0 0\n@ 0 0\n" );
+		svars->uidval[M] = svars->uidval[S] = -1;
+		svars->existing = 0; /* write a fresh state instead of a delta */
+		/* The boxes need to be loaded in full now. */
+		prepare_opts( svars );
+	}
+
+	for (t = 0; t < 2; t++) {
+		ctx[t]->since = chan->max_age ? time( 0 ) - chan->max_age * 24 * 60 * 60 : 0;
+		ctx[t]->keep_uid = svars->window_uid[t];
+		ctx[t]->changed_since = flags_tracked( svars, t ) ? svars->modseq[t] : 0;
+		ctx[t]->changed_uid = 0;
+		ctx[t]->known_uids = 0;
+		ctx[t]->nknown_uids = 0;
+	}
+	if (ctx[M]->changed_since || ctx[S]->changed_since) {
+		minuid[M] = minuid[S] = INT_MAX;
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			for (t = 0; t < 2; t++) {
+				if (ctx[t]->changed_uid < srec->uid[t])
+					ctx[t]->changed_uid = srec->uid[t];
+				/* The flags of messages which still need propagation are not tracked. */
+				if (srec->uid[1-t] < 0 && minuid[t] > srec->uid[t])
+					minuid[t] = srec->uid[t];
+			}
+		}
+		for (t = 0; t < 2; t++) {
+			if (ctx[t]->changed_uid >= minuid[t])
+				ctx[t]->changed_uid = minuid[t] - 1;
+			if (ctx[t]->changed_since) {
+				svars->known_uids[t] = nfmalloc( (svars->nsrecs + 1) * sizeof(int) );
+				ctx[t]->known_uids = svars->known_uids[t];
+			}
+		}
+		for (srec = svars->srecs; srec; srec = srec->next) {
+			if (srec->status & S_DEAD)
+				continue;
+			for (t = 0; t < 2; t++)
+				if (ctx[t]->known_uids && srec->uid[t] > 0 && srec->uid[t] <= ctx[t]->changed_uid)
+					ctx[t]->known_uids[ctx[t]->nknown_uids++] = srec->uid[t];
+		}
+		for (t = 0; t < 2; t++)
+			if (ctx[t]->known_uids)
+				sort_ints( ctx[t]->known_uids, ctx[t]->nknown_uids );
+	}
 
 	mexcs = 0;
 	nmexcs = rmexcs = 0;
@@ -1311,17 +2286,17 @@ load_box( sync_vars_t *svars, int t, int minwuid, int *mexcs, int nmexcs )
 	svars->drv[t]->load_box( svars->ctx[t], minwuid, maxwuid, svars->newuid[t], mexcs, nmexcs, box_loaded, AUX );
 }
 
-typedef struct {
-	void *aux;
-	sync_rec_t *srec;
-	int aflags, dflags;
-} flag_vars_t;
-
 typedef struct {
 	int uid;
 	sync_rec_t *srec;
 } sync_rec_map_t;
 
+static int
+cmp_srec_map( const void *a, const void *b )
+{
+	return ((const sync_rec_map_t *)a)->uid - ((const sync_rec_map_t *)b)->uid;
+}
+
 static void flags_set( int sts, void *aux );
 static void flags_set_p2( sync_vars_t *svars, sync_rec_t *srec, int t );
 static void msgs_flags_set( sync_vars_t *svars, int t );
@@ -1329,6 +2304,85 @@ static void msg_copied( int sts, int uid, copy_vars_t *vars );
 static void msg_copied_p2( sync_vars_t *svars, sync_rec_t *srec, int t, int uid );
 static void msgs_copied( sync_vars_t *svars, int t );
 
+static int
+same_msg( message_t *mmsg, message_t *smsg )
+{
+	int diff;
+
+	if (mmsg->hdr_hash != smsg->hdr_hash || strcmp( mmsg->msgid, smsg->msgid ))
+		return 0;
+	/* Either copy may have gained an X-TUID header. */
+	diff = (int)mmsg->size - (int)smsg->size;
+	return !diff || diff == 8 + TUIDL + 2 || diff == -(8 + TUIDL + 2);
+}
+
+/* Re-create the sync records by pairing up messages which have the same
+ * Message-ID, header hash, and size. Unpaired messages are treated as new. */
+static void
+recover_srecs( sync_vars_t *svars )
+{
+	sync_rec_t *srec;
+	message_t *tmsg, *smsg, **msgmap;
+	uint hashsz, idx;
+	int nmsgs, npairs;
+
+	debug( "recovering sync records\n" );
+	for (nmsgs = 0, tmsg = svars->ctx[S]->msgs; tmsg; tmsg = tmsg->next)
+		if (!(tmsg->status & M_DEAD) && tmsg->msgid)
+			nmsgs++;
+	hashsz = bucketsForSize( nmsgs * 3 );
+	msgmap = nfcalloc( hashsz * sizeof(*msgmap) );
+	for (tmsg = svars->ctx[S]->msgs; tmsg; tmsg = tmsg->next) {
+		if ((tmsg->status & M_DEAD) || !tmsg->msgid)
+			continue;
+		idx = hash_msgid( tmsg->msgid ) % hashsz;
+		while (msgmap[idx])
+			if (++idx == hashsz)
+				idx = 0;
+		msgmap[idx] = tmsg;
+	}
+	npairs = 0;
+	for (tmsg = svars->ctx[M]->msgs; tmsg; tmsg = tmsg->next) {
+		if ((tmsg->status & M_DEAD) || !tmsg->msgid)
+			continue;
+		for (idx = hash_msgid( tmsg->msgid ) % hashsz; (smsg = msgmap[idx]); ) {
+			if (!smsg->srec && same_msg( tmsg, smsg ))
+				break;
+			if (++idx == hashsz)
+				idx = 0;
+		}
+		if (!smsg)
+			continue;
+		srec = arena_alloc( &svars->srec_arena );
+		srec->next = 0;
+		*svars->srecadd = srec;
+		svars->srecadd = &srec->next;
+		svars->nsrecs++;
+		srec->status = 0;
+		srec->tuid[0] = 0;
+		srec->uid[M] = tmsg->uid;
+		srec->uid[S] = smsg->uid;
+		srec->msg[M] = tmsg;
+		srec->msg[S] = smsg;
+		tmsg->srec = smsg->srec = srec;
+		/* This is logged only once the unpaired messages are propagated. */
+		if (svars->maxuid[M] < tmsg->uid)
+			svars->maxuid[M] = tmsg->uid;
+		if (svars->maxuid[S] < smsg->uid)
+			svars->maxuid[S] = smsg->uid;
+		/* Flags which are set on only one side are propagated, except that
+		 * deletions are reverted, as the other side may be the only copy. */
+		srec->flags = (tmsg->flags & smsg->flags) | ((tmsg->flags | smsg->flags) & F_DELETED);
+		Fprintf( svars->jfp, "+ %d %d\n", srec->uid[M], srec->uid[S] );
+		if (srec->flags)
+			Fprintf( svars->jfp, "* %d %d %u\n", srec->uid[M], srec->uid[S], srec->flags );
+		debug( "  pair(%d,%d) recovered\n", srec->uid[M], srec->uid[S] );
+		npairs++;
+	}
+	free( msgmap );
+	info( "Recovered %d pairs of messages\n", npairs );
+}
+
 static void
 box_loaded( int sts, void *aux )
 {
@@ -1337,9 +2391,9 @@ box_loaded( int sts, void *aux )
 	sync_rec_map_t *srecmap;
 	message_t *tmsg;
 	flag_vars_t *fv;
-	int uid, no[2], del[2], alive, todel, t1, t2;
-	int sflags, nflags, aflags, dflags, nex;
-	uint hashsz, idx;
+	int uid, lastuid, no[2], del[2], winuid[2], alive, todel, t1, t2;
+	int sflags, nflags, aflags, dflags, nex, sorted;
+	uint nmap, idx, lo, hi;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 
 	if (check_ret( sts, aux ))
@@ -1354,20 +2408,23 @@ box_loaded( int sts, void *aux )
 	}
 
 	debug( "matching messages on %s against sync records\n", str_ms[t] );
-	hashsz = bucketsForSize( svars->nsrecs * 3 );
-	srecmap = nfcalloc( hashsz * sizeof(*srecmap) );
-	for (srec = svars->srecs; srec; srec = srec->next) {
+	/* Both the messages and the sync records are normally ordered by UID
+	 * already, so this is a merge join of two sequential sweeps. */
+	srecmap = nfmalloc( (svars->nsrecs + 1) * sizeof(*srecmap) );
+	for (nmap = 0, sorted = 1, srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
 			continue;
-		uid = srec->uid[t];
-		idx = (uint)((uint)uid * 1103515245U) % hashsz;
-		while (srecmap[idx].uid)
-			if (++idx == hashsz)
-				idx = 0;
-		srecmap[idx].uid = uid;
-		srecmap[idx].srec = srec;
+		if ((uid = srec->uid[t]) <= 0)
+			continue;
+		if (nmap && uid < srecmap[nmap - 1].uid)
+			sorted = 0;
+		srecmap[nmap].uid = uid;
+		srecmap[nmap].srec = srec;
+		nmap++;
 	}
-	for (tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
+	if (!sorted)
+		qsort( srecmap, nmap, sizeof(*srecmap), cmp_srec_map );
+	for (idx = 0, lastuid = 0, tmsg = svars->ctx[t]->msgs; tmsg; tmsg = tmsg->next) {
 		if (tmsg->srec) /* found by TUID */
 			continue;
 		uid = tmsg->uid;
@@ -1375,27 +2432,43 @@ box_loaded( int sts, void *aux )
 			make_flags( tmsg->flags, fbuf );
 			printf( svars->ctx[t]->opts & OPEN_SIZE ? "  message %5d, %-4s, %6lu: " : "  message %5d, %-4s: ", uid, fbuf, tmsg->size );
 		}
-		idx = (uint)((uint)uid * 1103515245U) % hashsz;
-		while (srecmap[idx].uid) {
-			if (srecmap[idx].uid == uid) {
-				srec = srecmap[idx].srec;
-				goto found;
+		if (uid < lastuid) {
+			/* Out of order - seek back. */
+			for (lo = 0, hi = idx; lo < hi; ) {
+				uint mid = (lo + hi) / 2;
+				if (srecmap[mid].uid < uid)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			idx = lo;
+		} else {
+			while (idx < nmap && srecmap[idx].uid < uid)
+				idx++;
+		}
+		lastuid = uid;
+		if (idx < nmap && srecmap[idx].uid == uid) {
+			srec = srecmap[idx].srec;
+			tmsg->srec = srec;
+			srec->msg[t] = tmsg;
+			if (!(tmsg->status & M_FLAGS) && svars->ctx[t]->changed_since) {
+				/* Not modified since the last run, so the flags are still the synced ones. */
+				tmsg->flags = srec->flags;
+				tmsg->status |= M_FLAGS;
 			}
-			if (++idx == hashsz)
-				idx = 0;
+			debug( "pairs %5d\n", srec->uid[1-t] );
+		} else {
+			debug( "new\n" );
 		}
-		debug( "new\n" );
-		continue;
-	  found:
-		tmsg->srec = srec;
-		srec->msg[t] = tmsg;
-		debug( "pairs %5d\n", srec->uid[1-t] );
 	}
 	free( srecmap );
 
 	if (!(svars->state[1-t] & ST_LOADED))
 		return;
 
+	if (svars->recover)
+		recover_srecs( svars );
+
 	if (svars->uidval[M] < 0 || svars->uidval[S] < 0) {
 		svars->uidval[M] = svars->ctx[M]->uidvalidity;
 		svars->uidval[S] = svars->ctx[S]->uidvalidity;
@@ -1404,11 +2477,26 @@ box_loaded( int sts, void *aux )
 
 	info( "Synchronizing...\n" );
 
+	for (t = 0; t < 2; t++) {
+		/* Messages which were recent in the last run are still synchronized,
+		 * so their deletion is propagated even if they were the oldest ones. */
+		winuid[t] = svars->ctx[t]->since_uid;
+		if (svars->window_uid[t] && winuid[t] > svars->window_uid[t])
+			winuid[t] = svars->window_uid[t];
+	}
+
 	debug( "synchronizing old entries\n" );
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
 			continue;
 		debug( "pair (%d,%d)\n", srec->uid[M], srec->uid[S] );
+		if (svars->chan->max_age &&
+		    ((srec->uid[M] > 0 && srec->uid[M] < winuid[M]) ||
+		     (srec->uid[S] > 0 && srec->uid[S] < winuid[S]))) {
+			debug( "  too old\n" );
+			srec->aflags[M] = srec->dflags[M] = srec->aflags[S] = srec->dflags[S] = 0;
+			continue;
+		}
 		no[M] = !srec->msg[M] && (svars->ctx[M]->opts & OPEN_OLD);
 		no[S] = !srec->msg[S] && (svars->ctx[S]->opts & OPEN_OLD);
 		if (no[M] && no[S]) {
@@ -1442,6 +2530,8 @@ box_loaded( int sts, void *aux )
 							debug( "  %sing delete\n", str_hl[t] );
 							srec->aflags[t] = F_DELETED;
 							srec->status |= S_DELETE;
+							if (svars->chan->detect_moves && srec->msg[t] && (svars->ctx[1-t]->opts & OPEN_MSGID))
+								stash_msg( svars, srec->msg[t], t );
 						} else {
 							debug( "  not %sing delete\n", str_hl[t] );
 						}
@@ -1498,7 +2588,7 @@ box_loaded( int sts, void *aux )
 					if (srec) {
 						debug( "  -> pair(%d,%d) exists\n", srec->uid[M], srec->uid[S] );
 					} else {
-						srec = nfmalloc( sizeof(*srec) );
+						srec = arena_alloc( &svars->srec_arena );
 						srec->next = 0;
 						*svars->srecadd = srec;
 						svars->srecadd = &srec->next;
@@ -1534,6 +2624,9 @@ box_loaded( int sts, void *aux )
 						}
 						Fprintf( svars->jfp, "# %d %d %." stringify(TUIDL) "s\n", srec->uid[M], srec->uid[S], srec->tuid );
 						debug( "  -> %sing message, TUID %." stringify(TUIDL) "s\n", str_hl[t], srec->tuid );
+						/* Index before this box sends any commands, so none of them can time out meanwhile. */
+						if (svars->chan->link_dups && svars->moves && tmsg->msgid && !svars->moves->indexed[t])
+							index_dups( svars, t );
 					} else {
 						if (srec->uid[t] == -1) {
 							debug( "  -> not %sing - still too big\n", str_hl[t] );
@@ -1698,7 +2791,7 @@ box_loaded( int sts, void *aux )
 				flags_total[t]++;
 				stats();
 				svars->flags_pending[t]++;
-				fv = nfmalloc( sizeof(*fv) );
+				fv = arena_alloc( &svars->flag_arena );
 				fv->aux = AUX;
 				fv->srec = srec;
 				fv->aflags = aflags;
@@ -1719,8 +2812,15 @@ box_loaded( int sts, void *aux )
 	}
 
 	debug( "propagating new messages\n" );
-	if (UseFSync)
+	if (UseFSync == FSYNC_BATCH) {
+		/* This commits whatever else is pending as well, but it cannot
+		 * be deferred, as the journal must be on disk before the new
+		 * messages appear in the target mailbox. */
+		defer_fsync( fileno( svars->jfp ), 0, 0 );
+		flush_fsyncs();
+	} else if (UseFSync) {
 		fdatasync( fileno( svars->jfp ) );
+	}
 	for (t = 0; t < 2; t++) {
 		svars->newuid[t] = svars->ctx[t]->uidnext;
 		Fprintf( svars->jfp, "%c %d\n", "{}"[t], svars->newuid[t] );
@@ -1750,11 +2850,11 @@ msg_copied( int sts, int uid, copy_vars_t *vars )
 		Fprintf( svars->jfp, "- %d %d\n", vars->srec->uid[M], vars->srec->uid[S] );
 		break;
 	default:
+		arena_free( &svars->copy_arena, vars );
 		cancel_sync( svars );
-		free( vars );
 		return;
 	}
-	free( vars );
+	arena_free( &svars->copy_arena, vars );
 	new_done[t]++;
 	stats();
 	svars->new_pending[t]--;
@@ -1793,6 +2893,20 @@ static void msgs_found_new( int sts, void *aux );
 static void msgs_new_done( sync_vars_t *svars, int t );
 static void sync_close( sync_vars_t *svars, int t );
 
+static int
+get_buffer_limit( sync_vars_t *svars )
+{
+	int t, lim, limit;
+
+	if (!BufferLimitMin)
+		return BufferLimit;
+	limit = 0;
+	for (t = 0; t < 2; t++)
+		if (svars->drv[t]->buffer_limit && (lim = svars->drv[t]->buffer_limit( svars->ctx[t] )) > limit)
+			limit = lim;
+	return limit ? limit : BufferLimit;
+}
+
 static void
 msgs_copied( sync_vars_t *svars, int t )
 {
@@ -1808,7 +2922,11 @@ msgs_copied( sync_vars_t *svars, int t )
 	if (!(svars->state[t] & ST_SENT_NEW)) {
 		for (tmsg = svars->new_msgs[t]; tmsg; tmsg = tmsg->next) {
 			if ((srec = tmsg->srec) && srec->tuid[0]) {
-				if (svars->drv[t]->memory_usage( svars->ctx[t] ) >= BufferLimit) {
+				/* Both the messages being fetched and the ones being stored count. As the
+				 * completion of a pending copy resumes the loop, at least one is let through. */
+				if (svars->new_pending[t] &&
+				    svars->drv[1-t]->memory_usage( svars->ctx[1-t] ) +
+				    svars->drv[t]->memory_usage( svars->ctx[t] ) >= get_buffer_limit( svars )) {
 					svars->new_msgs[t] = tmsg;
 					goto out;
 				}
@@ -1816,7 +2934,7 @@ msgs_copied( sync_vars_t *svars, int t )
 				stats();
 				svars->new_pending[t]++;
 				svars->state[t] |= ST_SENDING_NEW;
-				cv = nfmalloc( sizeof(*cv) );
+				cv = arena_alloc( &svars->copy_arena );
 				cv->cb = msg_copied;
 				cv->aux = AUX;
 				cv->srec = srec;
@@ -1885,7 +3003,7 @@ flags_set( int sts, void *aux )
 		flags_set_p2( svars, vars->srec, t );
 		break;
 	}
-	free( vars );
+	arena_free( &svars->flag_arena, vars );
 	flags_done[t]++;
 	stats();
 	svars->flags_pending[t]--;
@@ -1960,7 +3078,7 @@ msgs_flags_set( sync_vars_t *svars, int t )
 							trash_total[t]++;
 							stats();
 							svars->trash_pending[t]++;
-							cv = nfmalloc( sizeof(*cv) );
+							cv = arena_alloc( &svars->copy_arena );
 							cv->cb = msg_rtrashed;
 							cv->aux = INV_AUX;
 							cv->srec = 0;
@@ -2007,11 +3125,11 @@ msg_rtrashed( int sts, int uid ATTR_UNUSED, copy_vars_t *vars )
 	case SYNC_NOGOOD: /* the message is gone or heavily busted */
 		break;
 	default:
+		arena_free( &svars->copy_arena, vars );
 		cancel_sync( svars );
-		free( vars );
 		return;
 	}
-	free( vars );
+	arena_free( &svars->copy_arena, vars );
 	t ^= 1;
 	trash_done[t]++;
 	stats();
@@ -2053,7 +3171,8 @@ static void
 box_closed_p2( sync_vars_t *svars, int t )
 {
 	sync_rec_t *srec;
-	int minwuid;
+	uint64_t modseq[2];
+	int minwuid, uid, winuid[2];
 
 	svars->state[t] |= ST_CLOSED;
 	if (!(svars->state[1-t] & ST_CLOSED))
@@ -2098,6 +3217,34 @@ box_closed_p2( sync_vars_t *svars, int t )
 		}
 	}
 
+	for (t = 0; t < 2; t++) {
+		/* All flag changes up to the state at the start of the run were propagated now. */
+		modseq[t] = flags_tracked( svars, t ) ? svars->ctx[t]->highestmodseq : 0;
+	}
+	if (modseq[M] != svars->modseq[M] || modseq[S] != svars->modseq[S]) {
+		svars->modseq[M] = modseq[M];
+		svars->modseq[S] = modseq[S];
+		Fprintf( svars->jfp, "^ %" PRIu64 " %" PRIu64 "\n", modseq[M], modseq[S] );
+	}
+
+	for (t = 0; t < 2; t++) {
+		/* The next run's window starts at the first message which is recent
+		 * now. Messages which were stored in this run are included, whatever
+		 * their arrival date. If nothing is known, the window stays put. */
+		winuid[t] = svars->window_uid[t];
+		if (svars->chan->max_age && (uid = svars->ctx[t]->since_uid)) {
+			if (svars->newuid[t] && uid > svars->newuid[t])
+				uid = svars->newuid[t];
+			if (uid != INT_MAX)
+				winuid[t] = uid;
+		}
+	}
+	if (winuid[M] != svars->window_uid[M] || winuid[S] != svars->window_uid[S]) {
+		svars->window_uid[M] = winuid[M];
+		svars->window_uid[S] = winuid[S];
+		Fprintf( svars->jfp, "@ %d %d\n", winuid[M], winuid[S] );
+	}
+
 	save_state( svars );
 
 	sync_bail( svars );
@@ -2106,12 +3253,6 @@ box_closed_p2( sync_vars_t *svars, int t )
 static void
 sync_bail( sync_vars_t *svars )
 {
-	sync_rec_t *srec, *nsrec;
-
-	for (srec = svars->srecs; srec; srec = nsrec) {
-		nsrec = srec->next;
-		free( srec );
-	}
 	if (svars->lfd >= 0) {
 		unlink( svars->lname );
 		close( svars->lfd );
@@ -2134,6 +3275,8 @@ sync_bail3( sync_vars_t *svars )
 {
 	free( svars->box_name[M] );
 	free( svars->box_name[S] );
+	free( svars->known_uids[M] );
+	free( svars->known_uids[S] );
 	sync_deref( svars );
 }
 
@@ -2144,6 +3287,12 @@ sync_deref( sync_vars_t *svars )
 		void (*cb)( int sts, void *aux ) = svars->cb;
 		void *aux = svars->aux;
 		int ret = svars->ret;
+		debug_arena( "sync records", &svars->srec_arena );
+		debug_arena( "flag updates", &svars->flag_arena );
+		debug_arena( "message copies", &svars->copy_arena );
+		arena_release( &svars->srec_arena );
+		arena_release( &svars->flag_arena );
+		arena_release( &svars->copy_arena );
 		free( svars );
 		cb( ret, aux );
 	}
@@ -53,10 +53,20 @@ typedef struct channel_conf {
 	string_list_t *patterns;
 	int ops[2];
 	uint max_messages; /* for slave only */
+	int max_age; /* in days */
+	int state_delta; /* percentage of the snapshot size */
+	int parallel_boxes;
 	signed char expire_unread;
 	char use_internal_date;
+	char detect_moves;
+	char link_dups;
+	char recover_state;
+	char state_format;
 } channel_conf_t;
 
+#define STATE_TEXT     0
+#define STATE_BINARY   1
+
 typedef struct group_conf {
 	struct group_conf *next;
 	const char *name;
@@ -79,8 +89,16 @@ extern const char *str_ms[2], *str_hl[2];
 #define BOX_ABSENT    0
 #define BOX_PRESENT   1
 
+/* Messages which were deleted from the boxes of a channel, by Message-ID. */
+typedef struct move_map move_map_t;
+
+move_map_t *new_move_map( void );
+void free_move_map( move_map_t *moves );
+/* Register a box whose existing messages may be linked to by LinkDuplicates. */
+void add_move_map_box( move_map_t *moves, int t, const char *name );
+
 /* All passed pointers must stay alive until cb is called. */
 void sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *chan,
-                 void (*cb)( int sts, void *aux ), void *aux );
+                 move_map_t *moves, void (*cb)( int sts, void *aux ), void *aux );
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * mbsync - mailbox synchronizer
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+#include "driver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Just to satisfy the references in util.c */
+int DFlags;
+const char *Home;
+
+/* The input piece size of store_converted() in sync.c */
+#define PIECE_SIZE (MSG_CHUNK_SIZE / 2)
+
+/* The plain bytewise conversion, as a reference. */
+static int
+convert_bytewise( char *out, const char *in, int len, int crlf )
+{
+	int i, o;
+	char c;
+
+	for (i = o = 0; i < len; i++) {
+		if ((c = in[i]) != '\r') {
+			if (c == '\n' && crlf)
+				out[o++] = '\r';
+			out[o++] = c;
+		}
+	}
+	return o;
+}
+
+static void
+fill( char *buf, int len, int crlf, int linelen )
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (!(rand() % linelen)) {
+			if (crlf && i + 1 < len)
+				buf[i++] = '\r';
+			buf[i] = '\n';
+		} else if (!(rand() % 1000)) {
+			buf[i] = '\r';
+		} else {
+			buf[i] = 'a' + rand() % 26;
+		}
+	}
+}
+
+static int
+check( const char *in, int len, char *out1, char *out2 )
+{
+	int crlf, off, l, n1, n2;
+
+	for (crlf = 0; crlf < 2; crlf++) {
+		for (off = 0; off < 17; off++) {
+			for (l = 0; l < 100 && off + l <= len; l++) {
+				n1 = convert_bytewise( out1, in + off, l, crlf );
+				n2 = convert_line_ends( out2, in + off, l, crlf );
+				if (n1 != n2 || memcmp( out1, out2, n1 )) {
+					fprintf( stderr, "Mismatch at offset %d, length %d, crlf %d\n", off, l, crlf );
+					return 0;
+				}
+			}
+		}
+		n1 = convert_bytewise( out1, in, len, crlf );
+		n2 = convert_line_ends( out2, in, len, crlf );
+		if (n1 != n2 || memcmp( out1, out2, n1 )) {
+			fprintf( stderr, "Mismatch on full buffer, crlf %d\n", crlf );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static double
+bench( int (*conv)( char *, const char *, int, int ), char *out, const char *in, int len, int crlf, int rounds )
+{
+	clock_t start = clock();
+	int r, o;
+
+	for (r = 0; r < rounds; r++)
+		for (o = 0; o < len; o += PIECE_SIZE)
+			conv( out, in + o, len - o < PIECE_SIZE ? len - o : PIECE_SIZE, crlf );
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int
+main( int argc, char **argv )
+{
+	static const struct {
+		const char *name;
+		int crlf_in, crlf_out, linelen;
+	} cases[] = {
+		{ "LF to CRLF, short lines", 0, 1, 30 },
+		{ "LF to CRLF, long lines", 0, 1, 76 },
+		{ "CRLF to LF, long lines", 1, 0, 76 },
+		{ "LF to CRLF, binary-ish", 0, 1, 4000 },
+	};
+	int mb, len, rounds;
+	uint i;
+	double t1, t2;
+	char *in, *out;
+
+	mb = argc > 1 ? atoi( argv[1] ) : 16;
+	rounds = argc > 2 ? atoi( argv[2] ) : 10;
+	len = mb << 20;
+	in = nfmalloc( len );
+	out = nfmalloc( 4 * len );
+	for (i = 0; i < as(cases); i++) {
+		fill( in, len, cases[i].crlf_in, cases[i].linelen );
+		if (!check( in, len, out, out + 2 * len ))
+			return 1;
+		t1 = bench( convert_bytewise, out, in, len, cases[i].crlf_out, rounds );
+		t2 = bench( convert_line_ends, out, in, len, cases[i].crlf_out, rounds );
+		printf( "%-28s bytewise %7.1f MB/s, kernel %7.1f MB/s\n", cases[i].name,
+		        mb * rounds / t1, mb * rounds / t2 );
+	}
+	free( in );
+	free( out );
+	return 0;
+}
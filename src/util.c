@@ -29,6 +29,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <pwd.h>
+#include <errno.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#if !defined(_POSIX_SYNCHRONIZED_IO) || _POSIX_SYNCHRONIZED_IO <= 0
+# define fdatasync fsync
+#endif
 
 static int need_nl;
 
@@ -265,6 +274,113 @@ equals( const char *str, int strl, const char *cmp, int cmpl )
 	return (strl == cmpl) && !memcmp( str, cmp, cmpl );
 }
 
+int
+convert_line_ends( char *out, const char *in, int len, int crlf )
+{
+	int i = 0, o = 0;
+	char c;
+
+#ifdef __SSE2__
+	/* Copy whole vectors as long as they contain no line ending characters;
+	 * otherwise copy up to the first one and deal with it bytewise. */
+	__m128i vcr = _mm_set1_epi8( '\r' ), vlf = _mm_set1_epi8( '\n' );
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128( (const __m128i *)(in + i) );
+		int m = _mm_movemask_epi8( _mm_cmpeq_epi8( v, vcr ) );
+		if (crlf)
+			m |= _mm_movemask_epi8( _mm_cmpeq_epi8( v, vlf ) );
+		_mm_storeu_si128( (__m128i *)(out + o), v );
+		if (!m) {
+			i += 16;
+			o += 16;
+			continue;
+		}
+		m = __builtin_ctz( m );
+		i += m;
+		o += m;
+		if (in[i++] == '\n') {
+			out[o++] = '\r';
+			out[o++] = '\n';
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if ((c = in[i]) != '\r') {
+			if (c == '\n' && crlf)
+				out[o++] = '\r';
+			out[o++] = c;
+		}
+	}
+	return o;
+}
+
+const char *
+find_header( const char *hdr, int len, const char *name, int nlen, int *vlen )
+{
+	const char *p, *eol, *end = hdr + len;
+
+	for (p = hdr; p < end; p = eol + 1) {
+		if (!(eol = memchr( p, '\n', end - p )))
+			eol = end;
+		if (p == eol || (*p == '\r' && p + 1 == eol))
+			break;
+		if (eol - p > nlen && p[nlen] == ':' && starts_with_upper( p, nlen, name, nlen )) {
+			/* Include continuation lines. */
+			while (eol + 1 < end && (eol[1] == ' ' || eol[1] == '\t'))
+				if (!(eol = memchr( eol + 1, '\n', end - eol - 1 )))
+					eol = end;
+			for (p += nlen + 1; p < eol && isspace( (uchar)*p ); p++) ;
+			while (eol > p && isspace( (uchar)eol[-1] ))
+				eol--;
+			*vlen = eol - p;
+			return p;
+		}
+	}
+	return 0;
+}
+
+char *
+find_msgid( const char *hdr, int len )
+{
+	const char *val;
+	char *msgid;
+	int i, o, vlen;
+
+	if (!(val = find_header( hdr, len, "MESSAGE-ID", 10, &vlen )) || !vlen)
+		return 0;
+	msgid = nfmalloc( vlen + 1 );
+	for (i = o = 0; i < vlen; i++)
+		if (!isspace( (uchar)val[i] ))
+			msgid[o++] = val[i];
+	msgid[o] = 0;
+	return msgid;
+}
+
+uint
+hash_header( const char *hdr, int len )
+{
+	static const struct {
+		const char *name;
+		int len;
+	} fields[] = {
+		{ "DATE", 4 },
+		{ "FROM", 4 },
+		{ "SUBJECT", 7 },
+	};
+	const char *val;
+	uint i, h = 0;
+	int j, vlen;
+
+	for (i = 0; i < as(fields); i++) {
+		if ((val = find_header( hdr, len, fields[i].name, fields[i].len, &vlen )))
+			for (j = 0; j < vlen; j++)
+				if (!isspace( (uchar)val[j] ))
+					h = h * 33 + (uchar)val[j];
+		h = h * 33 + ':';
+	}
+	return h;
+}
+
 #ifndef HAVE_TIMEGM
 /*
    Converts struct tm to time_t, assuming the data in tm is UTC rather
@@ -443,6 +559,73 @@ cur_user( void )
 }
 */
 
+#define ARENA_MIN_BLK (4 * 1024)
+#define ARENA_MAX_BLK (1024 * 1024)
+
+void
+arena_init( arena_t *arena, uint obj_size )
+{
+	memset( arena, 0, sizeof(*arena) );
+	/* Freed objects are chained through their first bytes. */
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	arena->obj_size = (obj_size + sizeof(arena_blk_t) - 1) / sizeof(arena_blk_t) * sizeof(arena_blk_t);
+	arena->blk_size = ARENA_MIN_BLK;
+}
+
+void *
+arena_alloc( arena_t *arena )
+{
+	arena_blk_t *blk;
+	void *obj;
+	uint len;
+
+	if (++arena->nobjs > arena->max_objs)
+		arena->max_objs = arena->nobjs;
+	if ((obj = arena->free_objs)) {
+		arena->free_objs = *(void **)obj;
+		return obj;
+	}
+	if (arena->ptr + arena->obj_size > arena->end) {
+		/* The blocks grow with the number of objects, so huge boxes do
+		 * not need too many, while small ones do not waste memory. */
+		while ((len = arena->blk_size - sizeof(arena_blk_t)) < arena->obj_size)
+			arena->blk_size *= 2;
+		blk = nfmalloc( arena->blk_size );
+		blk->next = arena->blks;
+		arena->blks = blk;
+		arena->ptr = (char *)(blk + 1);
+		arena->end = arena->ptr + len / arena->obj_size * arena->obj_size;
+		arena->nblks++;
+		arena->nbytes += arena->blk_size;
+		if (arena->blk_size < ARENA_MAX_BLK)
+			arena->blk_size *= 2;
+	}
+	obj = arena->ptr;
+	arena->ptr += arena->obj_size;
+	return obj;
+}
+
+void
+arena_free( arena_t *arena, void *obj )
+{
+	*(void **)obj = arena->free_objs;
+	arena->free_objs = obj;
+	arena->nobjs--;
+}
+
+void
+arena_release( arena_t *arena )
+{
+	arena_blk_t *blk, *nblk;
+
+	for (blk = arena->blks; blk; blk = nblk) {
+		nblk = blk->next;
+		free( blk );
+	}
+	arena_init( arena, arena->obj_size );
+}
+
 char *
 expand_strdup( const char *s )
 {
@@ -710,6 +893,15 @@ get_now( void )
 	return time( 0 );
 }
 
+uint
+get_msecs( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, 0 );
+	return (uint)tv.tv_sec * 1000U + (uint)tv.tv_usec / 1000U;
+}
+
 static list_head_t timers = { &timers, &timers };
 
 void
@@ -870,3 +1062,71 @@ main_loop( void )
 	while (notifiers || timers.next != &timers)
 		event_wait();
 }
+
+#define FSYNC_BATCH_MAX 64
+
+typedef struct fsync_job {
+	struct fsync_job *next;
+	void (*cb)( int err, void *aux );
+	void *aux;
+	int fd, err;
+} fsync_job_t;
+
+static fsync_job_t *fsync_jobs, **fsync_jobapp = &fsync_jobs;
+static int fsync_njobs;
+static wakeup_t fsync_tmr;
+
+static void
+fsync_timeout( void *aux ATTR_UNUSED )
+{
+	flush_fsyncs();
+}
+
+void
+defer_fsync( int fd, void (*cb)( int err, void *aux ), void *aux )
+{
+	fsync_job_t *job;
+
+	if (!cb)
+		for (job = fsync_jobs; job; job = job->next)
+			if (job->fd == fd)
+				return;
+	job = nfmalloc( sizeof(*job) );
+	job->next = 0;
+	job->cb = cb;
+	job->aux = aux;
+	job->fd = fd;
+	*fsync_jobapp = job;
+	fsync_jobapp = &job->next;
+	if (++fsync_njobs >= FSYNC_BATCH_MAX) {
+		flush_fsyncs();
+	} else if (!pending_wakeup( &fsync_tmr )) {
+		/* Commit once the current batch of events is processed. */
+		init_wakeup( &fsync_tmr, fsync_timeout, 0 );
+		conf_wakeup( &fsync_tmr, 0 );
+	}
+}
+
+void
+flush_fsyncs( void )
+{
+	fsync_job_t *jobs, *job;
+
+	conf_wakeup( &fsync_tmr, -1 );
+	if (!(jobs = fsync_jobs))
+		return;
+	fsync_jobs = 0;
+	fsync_jobapp = &fsync_jobs;
+	fsync_njobs = 0;
+	for (job = jobs; job; job = job->next)
+		job->err = fdatasync( job->fd ) ? errno : 0;
+	while ((job = jobs)) {
+		jobs = job->next;
+		errno = job->err;
+		if (job->cb)
+			job->cb( job->err, job->aux );
+		else if (job->err)
+			sys_error( "Error: cannot sync file" );
+		free( job );
+	}
+}